@@ -26,13 +26,18 @@
  * $FreeBSD$
  */
 
+#include <sys/file.h>
+#include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/tree.h>
+#include <sys/wait.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <openssl/evp.h>
 #include <openssl/opensslv.h>
+#include <openssl/pem.h>
 #include <openssl/sha.h>
 #include <openssl/ssl.h>
 #include <openssl/ssl3.h>
@@ -46,6 +51,9 @@
 #include <fcntl.h>
 #include <libutil.h>
 #include <netdb.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -56,6 +64,23 @@
 #define	GITUP_VERSION     "0.94"
 #define	BUFFER_UNIT_SMALL  4096
 #define	BUFFER_UNIT_LARGE  1048576
+#define	DIRECTORY_CACHE_SIZE 512
+#define	GZIP_REQUEST_SIZE    65536
+#define	CONNECT_ATTEMPT_DELAY 250
+#define	SERVE_IDLE_TIMEOUT    300
+#define	BLOB_BATCH_SIZE       4096
+
+#define	DURABILITY_NONE    0
+#define	DURABILITY_FILES   1
+#define	DURABILITY_ATOMIC  2
+
+#define	DEDUPLICATE_NONE     0
+#define	DEDUPLICATE_HARDLINK 1
+#define	DEDUPLICATE_COPY     2
+
+#if defined(__FreeBSD_version) && __FreeBSD_version >= 1300037
+#define	HAVE_COPY_FILE_RANGE
+#endif
 
 #ifndef CONFIG_FILE_PATH
 #define CONFIG_FILE_PATH "./gitup.conf"
@@ -85,9 +110,57 @@ struct file_node {
 	bool    save;
 };
 
+struct directory_node {
+	RB_ENTRY(directory_node) link;
+	char *path;
+	int   fd;
+};
+
+struct response_decoder {
+	bool      chunked;
+	bool      compressed;
+	bool      demux;
+	bool      packfile;
+	bool      flushed;
+	bool      done;
+	uint32_t  parsed;
+	uint32_t  decoded;
+	uint32_t  chunk_left;
+	bool      chunk_end;
+	bool      last_chunk;
+	char      packet_header[5];
+	int       packet_header_size;
+	uint32_t  packet_left;
+	uint32_t  packet_start;
+	int       band;
+	char      phase[64];
+	struct timespec phase_start;
+};
+
+struct write_job {
+	int       directory;
+	char     *path;
+	mode_t    mode;
+	char     *buffer;
+	uint32_t  buffer_size;
+	char     *source;
+	bool      remove;
+};
+
 typedef struct {
 	SSL                 *ssl;
 	SSL_CTX             *ctx;
+	SSL_SESSION         *session;
+	char                *session_file;
+	bool                 reconnect;
+	bool                 demux;
+	int                  connect_timeout;
+	char               **mirror;
+	int                  mirrors;
+	int                  mirror_next;
+	char                *refs;
+	char                *refs_path;
+	uint32_t             refs_size;
 	int                  socket_descriptor;
 	char                *host;
 	char                *host_bracketed;
@@ -108,6 +181,7 @@ typedef struct {
 	uint32_t             response_size;
 	bool                 clone;
 	bool                 repair;
+	uint32_t             local_repairs;
 	struct object_node **object;
 	uint32_t             objects;
 	char                *pack_data_file;
@@ -116,62 +190,158 @@ typedef struct {
 	char                *remote_data_file;
 	char               **ignore;
 	int                  ignores;
+	char               **exclude;
+	int                  excludes;
+	bool                 filter;
+	bool                 can_filter;
+	bool                 partial_clone;
+	uint32_t             resolved;
 	bool                 keep_pack_file;
 	bool                 use_pack_file;
+	bool                 resumable;
+	int                  retries;
+	int                  pack_cache_size;
 	int                  verbosity;
 	uint8_t              display_depth;
 	char                *updating;
 	bool                 low_memory;
 	int                  back_store;
+	uint32_t             back_store_size;
+	bool                 incremental_scan;
+	bool                 incremental;
+	int                  scan_interval;
+	int                  write_threads;
+	struct write_job    *write_job;
+	uint32_t             write_jobs;
+	struct write_job    *link_job;
+	uint32_t             link_jobs;
+	struct write_job    *job;
+	uint32_t             jobs;
+	uint32_t             job_next;
+	pthread_mutex_t      write_lock;
+	int                  durability;
+	bool                 resume;
+	int                  deduplicate;
+	char                *serve_certificate;
+	char                *serve_key;
+	int                  serve_port;
+	int                  serve_refs_ttl;
 } connector;
 
+static void     address_command(connector *, char **, int *, char **);
 static void     append(char **, unsigned int *, const char *, size_t);
 static void     apply_deltas(connector *);
+static void     apply_options(connector *, int, char **);
 static char *   build_clone_command(connector *);
 static char *   build_pull_command(connector *);
 static char *   build_repair_command(connector *);
 static char *   calculate_file_hash(char *, int);
 static char *   calculate_object_hash(char *, uint32_t, int);
+static void     close_connection(connector *);
+static void     close_directories(void);
+static void     commit_file(int, char *, int, char *);
+static char *   compress_request(char *, size_t, size_t *);
 static void     connect_server(connector *);
+static int      create_file(int, char *, int, char **, char *);
 static void     create_tunnel(connector *);
+static void     decode_response(connector *, struct response_decoder *, uint32_t);
+static void     demux_packets(connector *, struct response_decoder *, uint32_t, uint32_t);
+static int      directory_node_compare(const struct directory_node *, const struct directory_node *);
+static bool     exclude_file(connector *, char *);
+static void     end_packet(connector *, struct response_decoder *);
 static void     extend_updating_list(connector *, char *);
 static void     extract_command_line_want(connector *, char *);
 static void     extract_proxy_data(connector *, const char *);
 static void     extract_tree_item(struct file_node *, char **);
+static void     fetch_blobs(connector *);
 static void     fetch_pack(connector *, char *);
+static char *   file_name(int, char *);
+static int      file_node_compare_content(const struct file_node *, const struct file_node *);
 static int      file_node_compare_hash(const struct file_node *, const struct file_node *);
 static int      file_node_compare_path(const struct file_node *, const struct file_node *);
 static void     file_node_free(struct file_node *);
+static char *   find_header(const char *, int, const char *);
+static bool     finish_worker(connector *, int, pid_t *, FILE **);
+static void     flush_write_jobs(connector *);
+static void *   flush_worker(void *);
+static void     free_server(connector *);
 static void     get_commit_details(connector *);
+static bool     header_value(const char *, int, const char *, const char *, const char *);
 static bool     ignore_file(connector *, char *);
 static char *   illegible_hash(char *);
+static void     inflate_response(connector *, uint32_t);
+static void     keep_session(connector *);
 static char *   legible_hash(char *);
+static void     link_file(int, int, char *, int, char *, char *, int);
+static char **  list_sections(const char *, char **, int, bool *, int *);
 static void     load_buffer(connector *, struct object_node *);
-static int      load_configuration(connector *, const char *, char **, int);
+static bool     load_cached_pack(connector *, char *);
+static bool     load_cached_response(const char *, int, char **, uint32_t *);
+static void     load_configuration(connector *, const char *, const char *);
 static void     load_file(const char *, char **, uint32_t *);
 static void     load_object(connector *, char *, char *);
 static void     load_pack(connector *);
-static void     load_remote_data(connector *);
+static void     load_remote_data(connector *, const char *, bool);
 static void     make_path(char *, mode_t);
+static bool     move_file(connector *, struct file_node *);
 static int      object_node_compare(const struct object_node *, const struct object_node *);
 static void     object_node_free(struct object_node *);
+static int      open_directory(char *);
+static ucl_object_t * open_configuration(const char *);
+static bool     overlapping_targets(const char *, const char *);
+static char *   pack_cache_id(char *, bool *);
 static bool     path_exists(const char *);
-static void     process_command(connector *, char *);
+static int      prepare_file(char *, int, int);
+static void     process_command(connector *, char *, int);
 static void     process_tree(connector *, int, char *, char *);
-static void     prune_tree(connector *, char *);
+static void     prune_directory(int, char *, char *);
+static void     prune_tree(connector *, int, char *);
+static void     queue_file(connector *, char *, int, char *, int, char *);
+static void     queue_removal(connector *, char *, int);
+static int      receive_data(connector *, char *, int);
+static bool     receive_request(connector *, int *, int *);
+static void     reconnect_server(connector *);
 static void     release_buffer(connector *, struct object_node *);
+static void     remove_file(connector *, int, char *, int);
+static void     reserve_response(connector *, uint32_t);
+static void     run_write_jobs(connector *, struct write_job *, uint32_t);
+static bool     same_server(connector *, connector *);
+static void     save_cached_pack(connector *, char *, bool);
+static void     save_cached_response(const char *, char *, uint32_t);
 static void     save_file(char *, int, char *, int, int, int);
 static void     save_objects(connector *);
+static void     save_remote_file(connector *, struct file_node *);
 static void     save_repairs(connector *);
-static void     scan_local_repository(connector *, char *);
+static void     save_session(connector *);
+static void     scan_local_repository(connector *, char *, int);
+static void     select_mirror(connector *);
 static void     send_command(connector *, char *);
+static char *   serve_cache_file(connector *, char *, uint32_t);
+static void     serve_client(connector *, connector *);
+static void     serve_failed(void);
+static void     serve_reply(connector *, const char *, const char *, char *, uint32_t);
+static void     serve_section(connector *);
+static void     serve_upstream(connector *, char *, char *);
+static void     set_host(connector *, const char *);
+static void     set_session_file(connector *);
 static void     setup_ssl(connector *);
+static void     share_connection(connector *, connector *);
+static void     show_progress(connector *, struct response_decoder *, char *, uint32_t);
+static char *   stage_file(int, char *, char *, char *, size_t);
+static pid_t    start_worker(connector *, int, int *, int *, int, FILE **);
 static void     store_object(connector *, int, char *, int, int, int, char *);
+static bool     transmit_command(connector *, char *, int);
+static void     trim_cache(const char *, uint64_t, const char *);
 static char *   trim_path(char *, int, bool *);
 static uint32_t unpack_delta_integer(char *, uint32_t *, int);
 static void     unpack_objects(connector *);
 static uint32_t unpack_variable_length_integer(char *, uint32_t *);
+static void     update_group(connector *, int, int *, int *, int);
+static void     update_section(connector *);
+static void     use_mirror(connector *, const char *);
 static void     usage(const char *);
+static void     write_file(int, char *, int, char *, int);
+static void *   write_worker(void *);
 
 
 /*
@@ -194,6 +364,15 @@ file_node_compare_hash(const struct file_node *a, const struct file_node *b)
 }
 
 
+static int
+file_node_compare_content(const struct file_node *a, const struct file_node *b)
+{
+	int result = strcmp(a->hash, b->hash);
+
+	return (result != 0 ? result : (int)a->mode - (int)b->mode);
+}
+
+
 static int
 object_node_compare(const struct object_node *a, const struct object_node *b)
 {
@@ -201,6 +380,13 @@ object_node_compare(const struct object_node *a, const struct object_node *b)
 }
 
 
+static int
+directory_node_compare(const struct directory_node *a, const struct directory_node *b)
+{
+	return (strcmp(a->path, b->path));
+}
+
+
 /*
  * node_free
  *
@@ -230,6 +416,14 @@ static RB_HEAD(Tree_Remote_Path, file_node) Remote_Path = RB_INITIALIZER(&Remote
 RB_PROTOTYPE(Tree_Remote_Path, file_node, link_path, file_node_compare_path)
 RB_GENERATE(Tree_Remote_Path,  file_node, link_path, file_node_compare_path)
 
+static RB_HEAD(Tree_Remote_Hash, file_node) Remote_Hash = RB_INITIALIZER(&Remote_Hash);
+RB_PROTOTYPE(Tree_Remote_Hash, file_node, link_hash, file_node_compare_hash)
+RB_GENERATE(Tree_Remote_Hash,  file_node, link_hash, file_node_compare_hash)
+
+static RB_HEAD(Tree_Pending_Path, file_node) Pending_Path = RB_INITIALIZER(&Pending_Path);
+RB_PROTOTYPE(Tree_Pending_Path, file_node, link_path, file_node_compare_path)
+RB_GENERATE(Tree_Pending_Path,  file_node, link_path, file_node_compare_path)
+
 static RB_HEAD(Tree_Local_Path, file_node) Local_Path = RB_INITIALIZER(&Local_Path);
 RB_PROTOTYPE(Tree_Local_Path, file_node, link_path, file_node_compare_path)
 RB_GENERATE(Tree_Local_Path,  file_node, link_path, file_node_compare_path)
@@ -246,6 +440,20 @@ static RB_HEAD(Tree_Trim_Path, file_node) Trim_Path = RB_INITIALIZER(&Trim_Path)
 RB_PROTOTYPE(Tree_Trim_Path, file_node, link_path, file_node_compare_path)
 RB_GENERATE(Tree_Trim_Path,  file_node, link_path, file_node_compare_path)
 
+static RB_HEAD(Tree_Written, file_node) Written = RB_INITIALIZER(&Written);
+RB_PROTOTYPE(Tree_Written, file_node, link_hash, file_node_compare_content)
+RB_GENERATE(Tree_Written,  file_node, link_hash, file_node_compare_content)
+
+static RB_HEAD(Tree_Directories, directory_node) Directories = RB_INITIALIZER(&Directories);
+RB_PROTOTYPE(Tree_Directories, directory_node, link, directory_node_compare)
+RB_GENERATE(Tree_Directories,  directory_node, link, directory_node_compare)
+
+static mode_t   File_Umask = 022;
+static int      Durability = DURABILITY_NONE;
+static uint32_t Directories_Open = 0;
+static bool     Remote_Hash_Built = false;
+static connector *Serve_Waiting = NULL;
+
 
 /*
  * release_buffer
@@ -365,6 +573,25 @@ ignore_file(connector *connection, char *path)
  }
 
 
+/*
+ * exclude_file
+ *
+ * Return true if path is in the set of "excludes" for the connection.
+ */
+
+static bool
+exclude_file(connector *connection, char *path)
+{
+	int x;
+
+	for (x = 0; x < connection->excludes; x++)
+		if (strncmp(path, connection->exclude[x], strlen(connection->exclude[x])) == 0)
+			return (true);
+
+	return (false);
+}
+
+
 /*
  * make_path
  *
@@ -408,67 +635,116 @@ make_path(char *path, mode_t mode)
 
 
 /*
- * prune_tree
+ * prune_directory
  *
- * Procedure that recursively removes a directory.
+ * Procedure that recursively removes a directory relative to the descriptor
+ * of its parent directory.
  */
 
 static void
-prune_tree(connector *connection, char *base_path)
+prune_directory(int parent, char *name, char *path)
 {
 	DIR           *directory = NULL;
 	struct dirent *entry = NULL;
 	struct stat    sb;
-	char           full_path[strlen(base_path) + 1 + MAXNAMLEN + 1];
-
-	/* Sanity check the directory to prune. */
-
-	if (strnstr(base_path, connection->path_target, strlen(connection->path_target)) != base_path)
-		errc(EXIT_FAILURE, EACCES,
-			"prune_tree: %s is not located in the %s tree",
-			base_path,
-			connection->path_target);
-
-	if (strnstr(base_path, "../", strlen(base_path)) != NULL)
-		errc(EXIT_FAILURE, EACCES,
-			"prune_tree: illegal path traverse in %s",
-			base_path);
+	char           full_path[strlen(path) + 1 + MAXNAMLEN + 1];
+	int            fd = -1;
+	bool           is_directory = false;
 
 	/* Remove the directory contents. */
 
-	if ((directory = opendir(base_path)) == NULL)
+	if ((fd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) == -1)
 		return;
 
+	if ((directory = fdopendir(fd)) == NULL)
+		err(EXIT_FAILURE, "prune_directory: cannot open %s", path);
+
 	while ((entry = readdir(directory)) != NULL) {
-		snprintf(full_path, sizeof(full_path),
-			"%s/%s",
-			base_path,
-			entry->d_name);
+		if ((entry->d_namlen == 1) && (strcmp(entry->d_name, "." ) == 0))
+			continue;
 
-		if (stat(full_path, &sb) != 0)
-			err(EXIT_FAILURE,
-				"prune_tree: cannot stat() %s",
-				full_path);
+		if ((entry->d_namlen == 2) && (strcmp(entry->d_name, "..") == 0))
+			continue;
 
-		if (S_ISDIR(sb.st_mode) != 0) {
-			if ((entry->d_namlen == 1) && (strcmp(entry->d_name, "." ) == 0))
-				continue;
+		/* Only stat the entries the file system did not type. */
 
-			if ((entry->d_namlen == 2) && (strcmp(entry->d_name, "..") == 0))
-				continue;
+		if (entry->d_type == DT_UNKNOWN) {
+			if (fstatat(fd, entry->d_name, &sb, AT_SYMLINK_NOFOLLOW) != 0)
+				err(EXIT_FAILURE,
+					"prune_directory: cannot stat() %s/%s",
+					path,
+					entry->d_name);
 
-			prune_tree(connection, full_path);
+			is_directory = S_ISDIR(sb.st_mode);
 		} else {
-			remove(full_path);
+			is_directory = (entry->d_type == DT_DIR);
+		}
+
+		if (is_directory) {
+			snprintf(full_path, sizeof(full_path),
+				"%s/%s",
+				path,
+				entry->d_name);
+
+			prune_directory(fd, entry->d_name, full_path);
+		} else if ((unlinkat(fd, entry->d_name, 0) != 0) && (errno != ENOENT)) {
+			fprintf(stderr,
+				" ! cannot remove %s/%s\n",
+				path,
+				entry->d_name);
 		}
 	}
 
 	closedir(directory);
 
-	if (rmdir(base_path) != 0)
+	if (unlinkat(parent, name, AT_REMOVEDIR) != 0)
 		fprintf(stderr,
 			" ! cannot remove %s\n",
+			path);
+}
+
+
+/*
+ * prune_tree
+ *
+ * Procedure that removes a directory in the local repository.
+ */
+
+static void
+prune_tree(connector *connection, int directory, char *base_path)
+{
+	/* Sanity check the directory to prune. */
+
+	if (strnstr(base_path, connection->path_target, strlen(connection->path_target)) != base_path)
+		errc(EXIT_FAILURE, EACCES,
+			"prune_tree: %s is not located in the %s tree",
+			base_path,
+			connection->path_target);
+
+	if (strnstr(base_path, "../", strlen(base_path)) != NULL)
+		errc(EXIT_FAILURE, EACCES,
+			"prune_tree: illegal path traverse in %s",
 			base_path);
+
+	prune_directory(directory, file_name(directory, base_path), base_path);
+}
+
+
+/*
+ * remove_file
+ *
+ * Procedure that removes a stale file or directory from the local repository.
+ */
+
+static void
+remove_file(connector *connection, int directory, char *path, int mode)
+{
+	if (S_ISDIR(mode))
+		prune_tree(connection, directory, path);
+	else if ((unlinkat(directory, file_name(directory, path), 0) != 0) && (errno != ENOENT))
+		fprintf(stderr,
+			" ! cannot remove %s\n",
+			path);
 }
 
 
@@ -574,3058 +850,6640 @@ trim_path(char *path, int display_depth, bool *just_added)
 
 
 /*
- * save_file
+ * open_directory
  *
- * Procedure that saves a blob/file.
+ * Function that returns a cached descriptor for a directory, creating the
+ * directory and any missing parent directories relative to their cached
+ * descriptors so each directory is only resolved once.
  */
 
-static void
-save_file(char *path, int mode, char *buffer, int buffer_size, int verbosity, int display_depth)
+static int
+open_directory(char *path)
 {
-	char temp_buffer[buffer_size + 1], *trim = NULL, *display_path = NULL;
-	int  fd;
-	bool exists = false, just_added = false;
+	struct directory_node *node = NULL, find;
+	char                  *name = NULL;
+	int                    parent = AT_FDCWD, fd = -1;
 
-	display_path = trim_path(path, display_depth, &just_added);
+	find.path = path;
 
-	if (display_depth > 0)
-		exists |= path_exists(display_path);
+	if ((node = RB_FIND(Tree_Directories, &Directories, &find)) != NULL)
+		return (node->fd);
 
-	/* Create the directory, if needed. */
+	/* Open the parent directory first. */
 
-	if ((trim = strrchr(path, '/')) != NULL) {
-		*trim = '\0';
+	if (((name = strrchr(path, '/')) != NULL) && (name != path)) {
+		*name = '\0';
+		parent = open_directory(path);
+		*name++ = '/';
+	} else {
+		name = path;
+	}
 
-		if (!path_exists(path))
-			make_path(path, 0755);
+	/* Open the directory, creating it if it does not exist. */
 
-		*trim = '/';
+	if ((fd = openat(parent, name, O_RDONLY | O_DIRECTORY)) == -1) {
+		if (errno != ENOENT)
+			err(EXIT_FAILURE, "open_directory: cannot open %s", path);
+
+		if ((mkdirat(parent, name, 0755) == -1) && (errno != EEXIST))
+			err(EXIT_FAILURE, "open_directory: cannot create %s", path);
+
+		if ((fd = openat(parent, name, O_RDONLY | O_DIRECTORY)) == -1)
+			err(EXIT_FAILURE, "open_directory: cannot open %s", path);
 	}
 
-	/* Print the file or trimmed path. */
+	if ((node = (struct directory_node *)malloc(sizeof(struct directory_node))) == NULL)
+		err(EXIT_FAILURE, "open_directory: malloc");
 
-	if (verbosity > 0) {
-		exists |= path_exists(path);
+	node->path = strdup(path);
+	node->fd   = fd;
 
-		if ((display_depth == 0) || (just_added))
-			printf(" %c %s\n", (exists ? '*' : '+'), display_path);
-	}
+	RB_INSERT(Tree_Directories, &Directories, node);
+	Directories_Open++;
 
-	free(display_path);
+	return (fd);
+}
 
-	if (S_ISLNK(mode)) {
-		/*
-		 * Make sure the buffer is null terminated, then save it as the
-		 * file to link to.
-		 */
 
-		memcpy(temp_buffer, buffer, buffer_size);
-		temp_buffer[buffer_size] = '\0';
+/*
+ * close_directories
+ *
+ * Procedure that flushes and closes all of the cached directory descriptors.
+ */
 
-		if (symlink(temp_buffer, path) == -1)
-			err(EXIT_FAILURE,
-				"save_file: symlink failure %s -> %s",
-				path,
-				temp_buffer);
-	} else {
-		/* If the file exists, make sure the permissions are intact. */
+static void
+close_directories(void)
+{
+	struct directory_node *node = NULL, *next_node = NULL;
 
-		if (path_exists(path))
-			chmod(path, mode);
+	RB_FOREACH_SAFE(node, Tree_Directories, &Directories, next_node) {
+		RB_REMOVE(Tree_Directories, &Directories, node);
 
-		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC);
+		/* Make sure the new directory entries are durable. */
 
-		if ((fd == -1) && (errno != EEXIST))
-			err(EXIT_FAILURE,
-				"save_file: write file failure %s",
-				path);
+		if (Durability != DURABILITY_NONE)
+			fsync(node->fd);
 
-		chmod(path, mode);
-		write(fd, buffer, buffer_size);
-		close(fd);
+		close(node->fd);
+		free(node->path);
+		free(node);
 	}
+
+	Directories_Open = 0;
 }
 
 
 /*
- * calculate_object_hash
+ * file_name
  *
- * Function that adds Git's "type file-size\0" header to a buffer and returns
- * the SHA checksum.
+ * Function that returns the name to use for a path relative to the directory
+ * descriptor returned by prepare_file.
  */
 
 static char *
-calculate_object_hash(char *buffer, uint32_t buffer_size, int type)
+file_name(int directory, char *path)
 {
-	int         digits = buffer_size, header_width = 0;
-	char       *hash = NULL, *hash_buffer = NULL, *temp_buffer = NULL;
-	const char *types[8] = { "", "commit", "tree", "blob", "tag", "", "ofs-delta", "ref-delta" };
-
-	if ((hash_buffer = (char *)malloc(20)) == NULL)
-		err(EXIT_FAILURE, "calculate_object_hash: malloc");
+	return (directory == AT_FDCWD ? path : strrchr(path, '/') + 1);
+}
 
-	if ((temp_buffer = (char *)malloc(buffer_size + 24)) == NULL)
-		err(EXIT_FAILURE, "calculate_object_hash: malloc");
 
-	/* Start with the git "type file-size\0" header. */
+/*
+ * prepare_file
+ *
+ * Function that displays the path of a file about to be saved, creates its
+ * directory, if needed, and returns the directory's descriptor.
+ */
 
-	header_width = strlen(types[type]) + 3;
+static int
+prepare_file(char *path, int verbosity, int display_depth)
+{
+	struct stat  check;
+	char        *trim = NULL, *display_path = NULL;
+	int          directory = AT_FDCWD;
+	bool         exists = false, just_added = false;
 
-	while ((digits /= 10) > 0)
-		header_width++;
+	display_path = trim_path(path, display_depth, &just_added);
 
-	snprintf(temp_buffer, header_width, "%s %u", types[type], buffer_size);
+	if (display_depth > 0)
+		exists |= path_exists(display_path);
 
-	/* Then add the buffer. */
+	/* Create the directory, if needed. */
 
-	memcpy(temp_buffer + header_width, buffer, buffer_size);
+	if (((trim = strrchr(path, '/')) != NULL) && (trim != path)) {
+		*trim = '\0';
+		directory = open_directory(path);
+		*trim = '/';
+	}
 
-	/* Calculate the SHA checksum. */
+	/* Print the file or trimmed path. */
 
-	SHA1((uint8_t *)temp_buffer, buffer_size + header_width, (uint8_t *)hash_buffer);
+	if (verbosity > 0) {
+		exists |= (fstatat(directory, file_name(directory, path), &check, 0) == 0);
 
-	hash = legible_hash(hash_buffer);
+		if ((display_depth == 0) || (just_added))
+			printf(" %c %s\n", (exists ? '*' : '+'), display_path);
+	}
 
-	free(hash_buffer);
-	free(temp_buffer);
+	free(display_path);
 
-	return (hash);
+	return (directory);
 }
 
 
 /*
- * calculate_file_hash
+ * stage_file
  *
- * Function that loads a local file and returns the SHA checksum.
+ * Function that returns the temporary name used to write a file before it is
+ * renamed into place, removing any copy left behind by an interrupted run.
+ * The temporary name is made from the checksum of the path, so it has the
+ * same short length however long the file's own name is.
  */
 
 static char *
-calculate_file_hash(char *path, int file_mode)
+stage_file(int directory, char *path, char *name, char *temp_name, size_t temp_name_size)
 {
-	char     *buffer = NULL, *hash = NULL, temp_path[BUFFER_UNIT_SMALL];
-	uint32_t  buffer_size = 0, bytes_read = 0;
+	char  hash[20], *legible = NULL, *base = NULL;
+	int   prefix = 0;
 
-	if (S_ISLNK(file_mode)) {
-		bytes_read = readlink(path, temp_path, BUFFER_UNIT_SMALL);
-		temp_path[bytes_read] = '\0';
+	/* Without a directory descriptor, keep the name's directory part. */
 
-		hash = calculate_object_hash(temp_path, strlen(temp_path), 3);
-	} else {
-		load_file(path, &buffer, &buffer_size);
-		hash = calculate_object_hash(buffer, buffer_size, 3);
-		free(buffer);
-	}
+	if ((base = strrchr(name, '/')) != NULL)
+		prefix = base - name + 1;
 
-	return (hash);
+	SHA1((uint8_t *)path, strlen(path), (uint8_t *)hash);
+	legible = legible_hash(hash);
+
+	if (snprintf(temp_name, temp_name_size, "%.*s.%s.gitup", prefix, name, legible) >= (int)temp_name_size)
+		errc(EXIT_FAILURE, ENAMETOOLONG,
+			"stage_file: %s",
+			path);
+
+	free(legible);
+
+	if ((unlinkat(directory, temp_name, 0) == -1) && (errno != ENOENT))
+		err(EXIT_FAILURE,
+			"stage_file: cannot remove %s.gitup",
+			path);
+
+	return (temp_name);
 }
 
 
 /*
- * append
+ * create_file
  *
- * Procedure that appends one string to another.
+ * Function that opens a file for writing.  New files are created with their
+ * final permissions, existing files are replaced by a new file under the
+ * temporary name, which is returned in stage.
  */
 
-static void
-append(char **buffer, unsigned int *buffer_size, const char *addendum, size_t addendum_size)
+static int
+create_file(int directory, char *path, int mode, char **stage, char *temp_name)
 {
-	*buffer = (char *)realloc(*buffer, *buffer_size + addendum_size + 1);
+	char *name = NULL;
+	int   fd;
 
-	if (*buffer == NULL)
-		err(EXIT_FAILURE, "append: realloc");
+	name = file_name(directory, path);
 
-	memcpy(*buffer + *buffer_size, addendum, addendum_size);
-	*buffer_size += addendum_size;
-	*(*buffer + *buffer_size) = '\0';
+	/*
+	 * Try to create the file first, which only needs its mode set when the
+	 * umask strips permissions from it.  If the file exists, write its
+	 * replacement under the temporary name.
+	 */
+
+	if ((fd = openat(directory, *stage, O_WRONLY | O_CREAT | O_EXCL, mode & ALLPERMS)) != -1) {
+		if ((mode & File_Umask) != 0)
+			fchmod(fd, mode & ALLPERMS);
+	} else if (errno == EEXIST) {
+		if (*stage == name)
+			*stage = stage_file(directory, path, name, temp_name, MAXNAMLEN + 1);
+
+		if ((fd = openat(directory, *stage, O_WRONLY | O_CREAT | O_TRUNC, mode & ALLPERMS)) == -1)
+			err(EXIT_FAILURE,
+				"create_file: write file failure %s",
+				path);
+
+		fchmod(fd, mode & ALLPERMS);
+	} else {
+		err(EXIT_FAILURE,
+			"create_file: write file failure %s",
+			path);
+	}
+
+	return (fd);
 }
 
 
 /*
- * extend_updating_list
+ * commit_file
  *
- * Procedure that adds the path of an UPDATING file to a string.
+ * Procedure that flushes and closes a file opened by create_file (if any) and
+ * renames it into place if it was staged under a temporary name.
  */
 
 static void
-extend_updating_list(connector *connection, char *path)
+commit_file(int directory, char *path, int fd, char *stage)
 {
-	unsigned int size;
-	char         temp[BUFFER_UNIT_SMALL];
+	if (fd != -1) {
+		if ((Durability != DURABILITY_NONE) && (fsync(fd) == -1))
+			err(EXIT_FAILURE, "commit_file: fsync failure %s", path);
 
-	size = (connection->updating ? strlen(connection->updating) : 0);
+		close(fd);
+	}
 
-	snprintf(temp, sizeof(temp), "#\t%s\n", path);
-	append(&connection->updating, &size, temp, strlen(temp));
+	if ((stage != file_name(directory, path)) && (renameat(directory, stage, directory, file_name(directory, path)) == -1))
+		err(EXIT_FAILURE, "commit_file: cannot rename %s.gitup", path);
 }
 
 
 /*
- * load_remote_data
+ * write_file
  *
- * Procedure that loads the list of remote data and checksums, if it exists.
+ * Procedure that writes a blob/file into an existing directory.  Existing
+ * files are replaced by renaming a complete copy over them, so they are never
+ * seen truncated.  It does not touch any shared state, so it is safe to call
+ * from the writer threads.
  */
 
 static void
-load_remote_data(connector *connection)
+write_file(int directory, char *path, int mode, char *buffer, int buffer_size)
 {
-	struct file_node *file = NULL;
-	char     *buffer = NULL, *hash = NULL, *temp_hash = NULL;
-	char     *line = NULL, *raw = NULL, *path = NULL, *data = NULL;
-	char      temp[BUFFER_UNIT_SMALL], base_path[BUFFER_UNIT_SMALL];
-	char      item[BUFFER_UNIT_SMALL];
-	uint32_t  count = 0, data_size = 0, buffer_size = 0, item_length = 0;
+	char    *link_path = NULL, *name = NULL, *stage = NULL;
+	char     temp_name[MAXNAMLEN + 1];
+	int      fd = -1;
+	ssize_t  bytes_written = 0;
 
-	load_file(connection->remote_data_file, &data, &data_size);
-	raw = data;
+	name  = file_name(directory, path);
+	stage = name;
 
-	while ((line = strsep(&raw, "\n"))) {
-		/* The first line stores the "have". */
+	/* In atomic mode, stage every file, not just the replacements. */
 
-		if (count++ == 0) {
-			connection->have = strdup(line);
-			continue;
-		}
+	if (Durability == DURABILITY_ATOMIC)
+		stage = stage_file(directory, path, name, temp_name, sizeof(temp_name));
 
+	if (S_ISLNK(mode)) {
 		/*
-		 * Empty lines signify the end of a directory entry, so create
-		 * an obj_tree for what has been read.
+		 * Make sure the buffer is null terminated, then save it as the
+		 * file to link to.
 		 */
 
-		if (strlen(line) == 0) {
-			if (buffer != NULL) {
-				if (connection->clone == false)
-					store_object(connection,
-						2,
-						buffer,
-						buffer_size,
-						0,
-						0,
-						NULL);
+		if ((link_path = strndup(buffer, buffer_size)) == NULL)
+			err(EXIT_FAILURE, "write_file: malloc");
 
-				buffer = NULL;
-				buffer_size = 0;
-			}
+		if (symlinkat(link_path, directory, stage) == -1) {
+			if ((errno != EEXIST) || (stage != name))
+				err(EXIT_FAILURE,
+					"write_file: symlink failure %s -> %s",
+					path,
+					link_path);
 
-			continue;
+			/* Replace the existing link. */
+
+			stage = stage_file(directory, path, name, temp_name, sizeof(temp_name));
+
+			if (symlinkat(link_path, directory, stage) == -1)
+				err(EXIT_FAILURE,
+					"write_file: symlink failure %s -> %s",
+					path,
+					link_path);
 		}
 
-		/* Split the line. */
+		free(link_path);
+	} else {
+		fd = create_file(directory, path, mode, &stage, temp_name);
 
-		hash = strchr(line,     '\t');
-		path = strchr(hash + 1, '\t');
+		while (buffer_size > 0) {
+			if ((bytes_written = write(fd, buffer, buffer_size)) == -1) {
+				if (errno == EINTR)
+					continue;
 
-		if ((hash == NULL) || (path == NULL)) {
-			fprintf(stderr,
-				" ! Malformed line '%s' in %s.  Skipping...\n",
-				line,
-				connection->remote_data_file);
+				err(EXIT_FAILURE,
+					"write_file: write failure %s",
+					path);
+			}
 
-			continue;
-		} else {
-			hash++;
-			path++;
+			buffer      += bytes_written;
+			buffer_size -= bytes_written;
 		}
+	}
 
-		*(hash -  1) = '\0';
-		*(hash + 40) = '\0';
+	commit_file(directory, path, fd, stage);
+}
 
-		/* Store the file data. */
 
-		file = (struct file_node *)malloc(sizeof(struct file_node));
+/*
+ * link_file
+ *
+ * Procedure that saves a file by hard linking or copying an identical file
+ * that has already been written, falling back to writing the blob.
+ */
 
-		if (file == NULL)
-			err(EXIT_FAILURE, "load_remote_data: malloc");
+static void
+link_file(int method, int directory, char *path, int mode, char *source, char *buffer, int buffer_size)
+{
+	char    *name = NULL, *stage = NULL, temp_name[MAXNAMLEN + 1];
+	int      error = 0, fd = -1;
+#ifdef HAVE_COPY_FILE_RANGE
+	int      source_fd = -1;
+	ssize_t  bytes_copied = 0;
+#endif
 
-		file->mode = strtol(line, (char **)NULL, 8);
-		file->hash = strdup(hash);
-		file->save = 0;
+	name  = file_name(directory, path);
+	stage = name;
 
-		if (path[strlen(path) - 1] == '/') {
-			snprintf(base_path, sizeof(base_path), "%s", path);
-			snprintf(temp, sizeof(temp), "%s", path);
-			temp[strlen(path) - 1] = '\0';
+	if (Durability == DURABILITY_ATOMIC)
+		stage = stage_file(directory, path, name, temp_name, sizeof(temp_name));
+
+	if (method == DEDUPLICATE_HARDLINK) {
+		error = linkat(AT_FDCWD, source, directory, stage, 0);
+
+		/* Replace an existing file through the temporary name. */
+
+		if ((error == -1) && (errno == EEXIST) && (stage == name)) {
+			stage = stage_file(directory, path, name, temp_name, sizeof(temp_name));
+
+			error = linkat(AT_FDCWD, source, directory, stage, 0);
+		}
+	} else {
+#ifdef HAVE_COPY_FILE_RANGE
+		/* Let the file system share or copy the blocks itself. */
+
+		if ((source_fd = open(source, O_RDONLY)) == -1) {
+			error = -1;
 		} else {
-			snprintf(temp, sizeof(temp), "%s%s", base_path, path);
+			fd = create_file(directory, path, mode, &stage, temp_name);
 
-			temp_hash = illegible_hash(hash);
+			while ((bytes_copied = copy_file_range(source_fd, NULL, fd, NULL, SSIZE_MAX, 0)) > 0)
+				continue;
 
-			/*
-			 * Build the item and add it to the buffer that will
-			 * become the obj_tree for this directory.
-			 */
+			/* Discard a partial copy, the blob is written below. */
 
-			snprintf(item, sizeof(item) - 22, "%s %s", line, path);
-			item_length = strlen(item);
-			memcpy(item + item_length + 1, temp_hash, 20);
-			item_length += 21;
-			item[item_length] = '\0';
+			if (bytes_copied == -1) {
+				close(fd);
+				unlinkat(directory, stage, 0);
 
-			append(&buffer, &buffer_size, item, item_length);
+				fd    = -1;
+				stage = name;
+				error = -1;
+			}
 
-			free(temp_hash);
+			close(source_fd);
 		}
+#else
+		error = -1;
+#endif
+	}
 
-		file->path = strdup(temp);
+	/*
+	 * Links cannot cross file systems (and older systems or some file
+	 * systems cannot copy in the kernel), so write the blob instead.
+	 */
 
-		RB_INSERT(Tree_Remote_Path, &Remote_Path, file);
+	if (error == -1) {
+		if (stage != name)
+			unlinkat(directory, stage, 0);
+
+		write_file(directory, path, mode, buffer, buffer_size);
+		return;
 	}
 
-	free(data);
+	commit_file(directory, path, fd, stage);
 }
 
 
 /*
- * scan_local_repository
+ * save_file
  *
- * Procedure that recursively finds and adds local files and directories to
- * separate red-black trees.
+ * Procedure that saves a blob/file.
  */
 
 static void
-scan_local_repository(connector *connection, char *base_path)
+save_file(char *path, int mode, char *buffer, int buffer_size, int verbosity, int display_depth)
 {
-	DIR              *directory = NULL;
-	struct stat       file;
-	struct dirent    *entry = NULL;
-	struct file_node *new_node = NULL, find, *found = NULL;
-	char             *full_path = NULL, file_hash[20];
-	int               full_path_size = 0;
-
-	/* Make sure the base path exists in the remote data list. */
-
-	find.path = base_path;
-	found     = RB_FIND(Tree_Remote_Path, &Remote_Path, &find);
-
-	/* Add the base path to the local trees. */
+	int directory;
 
-	if ((new_node = (struct file_node *)malloc(sizeof(struct file_node))) == NULL)
-		err(EXIT_FAILURE, "scan_local_repository: malloc");
+	if (Directories_Open >= DIRECTORY_CACHE_SIZE)
+		close_directories();
 
-	new_node->mode = (found ? found->mode : 040000);
-	new_node->hash = (found ? strdup(found->hash) : NULL);
-	new_node->path = strdup(base_path);
-	new_node->keep = (strlen(base_path) == strlen(connection->path_target) ? true : false);
-	new_node->save = false;
+	directory = prepare_file(path, verbosity, display_depth);
+	write_file(directory, path, mode, buffer, buffer_size);
+}
 
-	RB_INSERT(Tree_Local_Path, &Local_Path, new_node);
 
-	if (found)
-		RB_INSERT(Tree_Local_Hash, &Local_Hash, new_node);
+/*
+ * write_worker
+ *
+ * Thread procedure that writes queued files until the queue is empty.
+ */
 
-	/* Process the directory's contents. */
+static void *
+write_worker(void *arg)
+{
+	connector        *connection = (connector *)arg;
+	struct write_job *job = NULL;
 
-	if ((stat(base_path, &file) != -1) && ((directory = opendir(base_path)) != NULL)) {
-		while ((entry = readdir(directory)) != NULL) {
-			if ((entry->d_namlen == 1) && (strcmp(entry->d_name, "." ) == 0))
-				continue;
+	while (true) {
+		pthread_mutex_lock(&connection->write_lock);
 
-			if ((entry->d_namlen == 2) && (strcmp(entry->d_name, "..") == 0))
-				continue;
+		if (connection->job_next < connection->jobs)
+			job = &connection->job[connection->job_next++];
+		else
+			job = NULL;
 
-			if ((entry->d_namlen == 4) && (strcmp(entry->d_name, ".git") == 0)) {
-				fprintf(stderr,
-					" ! A .git directory was found -- "
-					"gitup does not update this directory "
-					"which will cause problems for the "
-					"official Git client.\n ! If you wish "
-					"to use gitup, please remove %s/%s and "
-					"rerun gitup.\n",
-					base_path,
-					entry->d_name);
+		pthread_mutex_unlock(&connection->write_lock);
 
-				exit(EXIT_FAILURE);
-				}
+		if (job == NULL)
+			break;
 
-			full_path_size = strlen(base_path) + entry->d_namlen + 2;
-			full_path      = (char *)malloc(full_path_size + 1);
+		if (job->remove)
+			remove_file(connection, job->directory, job->path, job->mode);
+		else if (job->source)
+			link_file(connection->deduplicate,
+				job->directory,
+				job->path,
+				job->mode,
+				job->source,
+				job->buffer,
+				job->buffer_size);
+		else
+			write_file(job->directory, job->path, job->mode, job->buffer, job->buffer_size);
+	}
 
-			if (full_path == NULL)
-				err(EXIT_FAILURE,
-					"scan_local_repository: malloc");
+	return (NULL);
+}
 
-			snprintf(full_path,
-				full_path_size,
-				"%s/%s",
-				base_path,
-				entry->d_name);
 
-			if (lstat(full_path, &file) == -1)
-				err(EXIT_FAILURE,
-					"scan_local_repository: cannot read %s",
-					full_path);
+/*
+ * run_write_jobs
+ *
+ * Procedure that hands a list of jobs to the writer threads and waits for
+ * them to finish.
+ */
 
-			if (S_ISDIR(file.st_mode)) {
-				scan_local_repository(connection, full_path);
-				free(full_path);
-			} else {
-				if ((new_node = (struct file_node *)malloc(sizeof(struct file_node))) == NULL)
-					err(EXIT_FAILURE,
-						"scan_local_repository: malloc");
+static void
+run_write_jobs(connector *connection, struct write_job *job, uint32_t jobs)
+{
+	pthread_t thread[connection->write_threads];
+	int       x = 0, threads = 0, error = 0;
 
-				new_node->mode = file.st_mode;
-				new_node->path = full_path;
-				new_node->keep = (strnstr(full_path, ".gituprevision", strlen(full_path)) != NULL ? true : false);
-				new_node->save = false;
+	if (jobs == 0)
+		return;
 
-				if (ignore_file(connection, full_path)) {
-					new_node->hash = (char *)malloc(20);
+	threads = connection->write_threads;
 
-					if (new_node->hash == NULL)
-						err(EXIT_FAILURE,
-							"scan_local_repository: malloc");
+	if ((uint32_t)threads > jobs)
+		threads = jobs;
 
-					SHA1((uint8_t *)full_path, strlen(full_path), (uint8_t *)file_hash);
-					memcpy(new_node->hash, file_hash, 20);
-				} else
-					new_node->hash = calculate_file_hash(full_path, file.st_mode);
+	connection->job      = job;
+	connection->jobs     = jobs;
+	connection->job_next = 0;
 
-				RB_INSERT(Tree_Local_Hash, &Local_Hash, new_node);
-				RB_INSERT(Tree_Local_Path, &Local_Path, new_node);
-			}
-		}
+	for (x = 0; x < threads; x++)
+		if ((error = pthread_create(&thread[x], NULL, write_worker, connection)) != 0)
+			errc(EXIT_FAILURE, error, "run_write_jobs: pthread_create");
 
-		closedir(directory);
-	}
+	for (x = 0; x < threads; x++)
+		pthread_join(thread[x], NULL);
 }
 
 
 /*
- * load_object
+ * flush_write_jobs
  *
- * Procedure that loads a local file and adds it to the array/tree of pack
- * file objects.
+ * Procedure that writes all of the queued files using the writer threads.
+ * Duplicates are linked only after the files they point to are written.
  */
 
 static void
-load_object(connector *connection, char *hash, char *path)
+flush_write_jobs(connector *connection)
 {
-	struct object_node *object = NULL, lookup_object;
-	struct file_node   *find = NULL, lookup_file;
-	char               *buffer = NULL;
-	uint32_t            buffer_size = 0;
-
-	lookup_object.hash = hash;
-	lookup_file.hash   = hash;
-	lookup_file.path   = path;
-
-	/*
-	 * If the object doesn't exist, look for it first by hash, then by path
-	 * and if it is found and the SHA checksum references a file, load it
-	 * and store it.
-	 */
-
-	if ((object = RB_FIND(Tree_Objects, &Objects, &lookup_object)) != NULL)
-		return;
-
-	find = RB_FIND(Tree_Local_Hash, &Local_Hash, &lookup_file);
+	run_write_jobs(connection, connection->write_job, connection->write_jobs);
+	run_write_jobs(connection, connection->link_job, connection->link_jobs);
 
-	if (find == NULL)
-		find = RB_FIND(Tree_Local_Path, &Local_Path, &lookup_file);
-
-	if (find) {
-		if (!S_ISDIR(find->mode)) {
-			load_file(find->path, &buffer, &buffer_size);
-
-			store_object(connection,
-				3,
-				buffer,
-				buffer_size,
-				0,
-				0,
-				NULL);
-		}
-	} else {
-		errc(EXIT_FAILURE, ENOENT,
-			"load_object: local file for object %s -- %s not found",
-			hash,
-			path);
-	}
+	connection->write_jobs = 0;
+	connection->link_jobs  = 0;
 }
 
 
 /*
- * create_tunnel
+ * flush_worker
  *
- * Procedure that sends a CONNECT command to create a proxy tunnel.
+ * Thread procedure that flushes the queued files in the background.
  */
 
-static void
-create_tunnel(connector *connection)
+static void *
+flush_worker(void *arg)
 {
-	char command[BUFFER_UNIT_SMALL];
-
-	snprintf(command,
-		BUFFER_UNIT_SMALL,
-		"CONNECT %s:%d HTTP/1.1\r\n"
-		"Host: %s:%d\r\n"
-		"%s"
-		"\r\n",
-		connection->host_bracketed,
-		connection->port,
-		connection->host_bracketed,
-		connection->port,
-		connection->proxy_credentials);
+	flush_write_jobs((connector *)arg);
 
-		process_command(connection, command);
+	return (NULL);
 }
 
 
 /*
- * connect_server
+ * move_file
  *
- * Procedure that (re)establishes a connection with the server.
+ * Function that looks for a stale local copy of a file that is about to be
+ * saved and, if one is found, renames it into place instead.
  */
 
-static void
-connect_server(connector *connection)
+static bool
+move_file(connector *connection, struct file_node *file)
 {
-	struct addrinfo hints, *start, *temp;
-	struct timeval  timeout;
-	int             error = 0, option = 1;
-	char            type[10];
-	char           *host = (connection->proxy_host ? connection->proxy_host : connection->host);
+	struct file_node *local = NULL, *found = NULL, find;
+	int               directory;
 
-	snprintf(type, sizeof(type), "%d", (connection->proxy_host ? connection->proxy_port : connection->port));
+	find.hash = file->hash;
+	local     = RB_FIND(Tree_Local_Hash, &Local_Hash, &find);
 
-	bzero(&hints, sizeof(struct addrinfo));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_protocol = IPPROTO_TCP;
+	if ((local == NULL) || (local->keep) || (!S_ISREG(local->mode)) || (!S_ISREG(file->mode)))
+		return (false);
 
-	if ((error = getaddrinfo(host, type, &hints, &start)))
-		errx(EXIT_FAILURE, "%s", gai_strerror(error));
+	if (ignore_file(connection, local->path))
+		return (false);
 
-	for (temp = start; temp != NULL; temp = temp->ai_next) {
-		if ((connection->socket_descriptor = socket(temp->ai_family, temp->ai_socktype, temp->ai_protocol)) < 0)
-			/* trying each addr returned, cont. with next in list */
-			continue;
-
-		if (connect(connection->socket_descriptor, temp->ai_addr, temp->ai_addrlen) != -1)
-			break;
-
-		close(connection->socket_descriptor);
-	}
+	/*
+	 * Leave the copy alone if something else is also saved to its path (the
+	 * previous tree's entry for the old path is there, but is not saved).
+	 */
 
-	freeaddrinfo(start);
+	find.path = local->path;
+	found     = RB_FIND(Tree_Remote_Path, &Remote_Path, &find);
 
-	if (temp == NULL)
-		err(EXIT_FAILURE,
-			"connect_server: connect failure (%d)",
-			errno);
+	if ((found != NULL) && (found->save))
+		return (false);
 
-	if (setsockopt(connection->socket_descriptor, SOL_SOCKET, SO_KEEPALIVE, &option, sizeof(int)))
-		err(EXIT_FAILURE,
-			"setup_ssl: setsockopt SO_KEEPALIVE error");
+	if (Directories_Open >= DIRECTORY_CACHE_SIZE) {
+		flush_write_jobs(connection);
+		close_directories();
+	}
 
-	option = BUFFER_UNIT_LARGE;
+	directory = prepare_file(file->path, connection->verbosity, connection->display_depth);
 
-	if (setsockopt(connection->socket_descriptor, SOL_SOCKET, SO_SNDBUF, &option, sizeof(int)))
-		err(EXIT_FAILURE,
-			"setup_ssl: setsockopt SO_SNDBUF error");
+	if (renameat(AT_FDCWD, local->path, directory, file_name(directory, file->path)) == -1)
+		return (false);
 
-	if (setsockopt(connection->socket_descriptor, SOL_SOCKET, SO_RCVBUF, &option, sizeof(int)))
-		err(EXIT_FAILURE,
-			"setup_ssl: setsockopt SO_RCVBUF error");
+	if ((local->mode & ALLPERMS) != (file->mode & ALLPERMS))
+		fchmodat(directory, file_name(directory, file->path), file->mode & ALLPERMS, 0);
 
-	bzero(&timeout, sizeof(struct timeval));
-	timeout.tv_sec = 300;
+	/* The copy is gone, so keep the cleanup from looking for it. */
 
-	if (setsockopt(connection->socket_descriptor, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(struct timeval)))
-		err(EXIT_FAILURE,
-			"setup_ssl: setsockopt SO_RCVTIMEO error");
+	RB_REMOVE(Tree_Local_Hash, &Local_Hash, local);
+	local->keep = true;
 
-	if (setsockopt(connection->socket_descriptor, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(struct timeval)))
-		err(EXIT_FAILURE,
-			"setup_ssl: setsockopt SO_SNDTIMEO error");
+	return (true);
 }
 
 
 /*
- * setup_ssl
+ * queue_file
  *
- * Procedure that sends a command to the server and processes the response.
+ * Procedure that prepares a blob/file and queues it for the writer threads.
+ * If source is set, the file is linked to (or copied from) that identical
+ * file instead.  The path and buffer must remain valid until the queue is
+ * flushed.
  */
 
 static void
-setup_ssl(connector *connection)
+queue_file(connector *connection, char *path, int mode, char *buffer, int buffer_size, char *source)
 {
-	int error = 0;
+	struct write_job **list = NULL, *job = NULL;
+	uint32_t          *jobs = NULL;
+	int                directory;
 
-	SSL_library_init();
-	SSL_load_error_strings();
-	connection->ctx = SSL_CTX_new(SSLv23_client_method());
-	SSL_CTX_set_mode(connection->ctx, SSL_MODE_AUTO_RETRY);
-	SSL_CTX_set_options(connection->ctx, SSL_OP_ALL | SSL_OP_NO_TICKET);
+	/*
+	 * Before closing the cached directory descriptors, make sure none of
+	 * the queued files still need them.
+	 */
 
-	if ((connection->ssl = SSL_new(connection->ctx)) == NULL)
-		err(EXIT_FAILURE, "setup_ssl: SSL_new");
+	if (Directories_Open >= DIRECTORY_CACHE_SIZE) {
+		flush_write_jobs(connection);
+		close_directories();
+	}
 
-	SSL_set_fd(connection->ssl, connection->socket_descriptor);
+	directory = prepare_file(path, connection->verbosity, connection->display_depth);
 
-	while ((error = SSL_connect(connection->ssl)) == -1)
-		fprintf(stderr,
-			"setup_ssl: SSL_connect error: %d\n",
-			SSL_get_error(connection->ssl, error));
-}
+	/* Without helper threads, save the file right away. */
 
+	if ((connection->write_threads < 2) || (connection->low_memory)) {
+		if (source)
+			link_file(connection->deduplicate, directory, path, mode, source, buffer, buffer_size);
+		else
+			write_file(directory, path, mode, buffer, buffer_size);
 
-/*
- * process_command
- *
- * Procedure that sends a command to the server and processes the response.
- */
+		return;
+	}
 
-static void
-process_command(connector *connection, char *command)
-{
-	char  read_buffer[BUFFER_UNIT_SMALL];
-	char *marker_start = NULL, *marker_end = NULL, *data_start = NULL;
-	int   chunk_size = -1, bytes_expected = 0;
-	int   marker_offset = 0, data_start_offset = 0;
-	int   bytes_read = 0, total_bytes_read = 0, bytes_to_move = 0;
-	int   bytes_sent = 0, total_bytes_sent = 0, check_bytes = 0;
-	int   bytes_to_write = 0, response_code = 0, error = 0, outlen = 0;
-	bool  ok = false, chunked_transfer = true;
-	char *temp = NULL;
+	list = (source ? &connection->link_job : &connection->write_job);
+	jobs = (source ? &connection->link_jobs : &connection->write_jobs);
 
-	bytes_to_write = strlen(command);
+	if (*list == NULL)
+		if ((*list = (struct write_job *)malloc(BUFFER_UNIT_SMALL * sizeof(struct write_job))) == NULL)
+			err(EXIT_FAILURE, "queue_file: malloc");
 
-	if (connection->verbosity > 1)
-		fprintf(stderr, "%s\n\n", command);
+	job = &(*list)[(*jobs)++];
 
-	/* Transmit the command to the server. */
+	job->directory   = directory;
+	job->path        = path;
+	job->mode        = mode;
+	job->buffer      = buffer;
+	job->buffer_size = buffer_size;
+	job->source      = source;
+	job->remove      = false;
 
-	while (total_bytes_sent < bytes_to_write) {
-		if (connection->ssl)
-			bytes_sent = SSL_write(
-				connection->ssl,
-				command + total_bytes_sent,
-				bytes_to_write - total_bytes_sent);
-		else
-			bytes_sent = write(
-				connection->socket_descriptor,
-				command + total_bytes_sent,
-				bytes_to_write - total_bytes_sent);
+	if (*jobs == BUFFER_UNIT_SMALL)
+		flush_write_jobs(connection);
+}
 
-		if (bytes_sent <= 0) {
-			if ((bytes_sent < 0) && ((errno == EINTR) || (errno == 0)))
-				continue;
-			else
-				err(EXIT_FAILURE, "process_command: send");
-		}
 
-		total_bytes_sent += bytes_sent;
+/*
+ * queue_removal
+ *
+ * Procedure that queues a stale file or directory for removal by the writer
+ * threads.  The path must remain valid until the queue is flushed.
+ */
 
-		if (connection->verbosity > 1)
-			fprintf(stderr,
-				"\r==> bytes sent: %d",
-				total_bytes_sent);
+static void
+queue_removal(connector *connection, char *path, int mode)
+{
+	struct write_job *job = NULL;
+	char             *trim = NULL;
+	int               directory = AT_FDCWD;
+
+	if (Directories_Open >= DIRECTORY_CACHE_SIZE) {
+		flush_write_jobs(connection);
+		close_directories();
 	}
 
-	if (connection->verbosity > 1)
-		fprintf(stderr, "\n");
+	if (((trim = strrchr(path, '/')) != NULL) && (trim != path)) {
+		*trim = '\0';
+		directory = open_directory(path);
+		*trim = '/';
+	}
 
-	/* Process the response. */
+	if (connection->write_threads < 2) {
+		remove_file(connection, directory, path, mode);
+		return;
+	}
 
-	while (chunk_size) {
-		if (connection->ssl)
-			bytes_read = SSL_read(
-				connection->ssl,
-				read_buffer,
-				BUFFER_UNIT_SMALL);
-		else
-			bytes_read = read(
-				connection->socket_descriptor,
-				read_buffer,
-				BUFFER_UNIT_SMALL);
+	if (connection->write_job == NULL)
+		if ((connection->write_job = (struct write_job *)malloc(BUFFER_UNIT_SMALL * sizeof(struct write_job))) == NULL)
+			err(EXIT_FAILURE, "queue_removal: malloc");
 
-		if (bytes_read == 0)
-			break;
+	job = &connection->write_job[connection->write_jobs++];
 
-		if (bytes_read < 0)
-			err(EXIT_FAILURE,
-				"process_command: SSL_read error: %d",
-				SSL_get_error(connection->ssl, error));
+	job->directory   = directory;
+	job->path        = path;
+	job->mode        = mode;
+	job->buffer      = NULL;
+	job->buffer_size = 0;
+	job->source      = NULL;
+	job->remove      = true;
 
-		/*
-		 * Expand the buffer if needed, preserving the position and
-		 * data_start if the buffer moves.
-		 */
+	if (connection->write_jobs == BUFFER_UNIT_SMALL)
+		flush_write_jobs(connection);
+}
 
-		if (total_bytes_read + bytes_read + 1 > connection->response_blocks * BUFFER_UNIT_LARGE) {
-			marker_offset     = marker_start - connection->response;
-			data_start_offset = data_start   - connection->response;
 
-			if ((connection->response = (char *)realloc(connection->response, ++connection->response_blocks * BUFFER_UNIT_LARGE)) == NULL)
-				err(EXIT_FAILURE, "process_command: realloc");
+/*
+ * calculate_object_hash
+ *
+ * Function that adds Git's "type file-size\0" header to a buffer and returns
+ * the SHA checksum.
+ */
 
-			marker_start = connection->response + marker_offset;
-			data_start   = connection->response + data_start_offset;
-		}
+static char *
+calculate_object_hash(char *buffer, uint32_t buffer_size, int type)
+{
+	int         digits = buffer_size, header_width = 0;
+	char       *hash = NULL, *hash_buffer = NULL, *temp_buffer = NULL;
+	const char *types[8] = { "", "commit", "tree", "blob", "tag", "", "ofs-delta", "ref-delta" };
 
-		/* Add the bytes received to the buffer. */
+	if ((hash_buffer = (char *)malloc(20)) == NULL)
+		err(EXIT_FAILURE, "calculate_object_hash: malloc");
 
-		memcpy(connection->response + total_bytes_read, read_buffer, bytes_read);
-		total_bytes_read += bytes_read;
-		connection->response[total_bytes_read] = '\0';
+	if ((temp_buffer = (char *)malloc(buffer_size + 24)) == NULL)
+		err(EXIT_FAILURE, "calculate_object_hash: malloc");
 
-		if (connection->verbosity > 1)
-			fprintf(stderr, "\r==> "
-				"bytes read: %d\t"
-				"bytes_expected: %d\t"
-				"total_bytes_read: %d",
-				bytes_read,
-				bytes_expected,
-				total_bytes_read);
+	/* Start with the git "type file-size\0" header. */
 
-		while ((connection->verbosity == 1) && (isatty(STDERR_FILENO))) {
-			struct timespec now;
-			static struct timespec then;
-			char buf[80];
-			char htotalb[7];
-			char persec[8];
-			static int last_total;
-			static double sum;
-			double secs;
-			int64_t throughput;
+	header_width = strlen(types[type]) + 3;
 
-			if (clock_gettime(CLOCK_MONOTONIC_FAST, &now) == -1)
-				err(EXIT_FAILURE,
-					"process_command: clock_gettime");
+	while ((digits /= 10) > 0)
+		header_width++;
 
-			if (then.tv_sec == 0)
-				then = now, secs = 1, sum = 1;
-			else {
-				secs = now.tv_sec - then.tv_sec +
-					(now.tv_nsec - then.tv_nsec) * 1e-9;
+	snprintf(temp_buffer, header_width, "%s %u", types[type], buffer_size);
 
-				if (1 > secs)
-					break;
-				else
-					sum += secs;
-			}
+	/* Then add the buffer. */
 
-			throughput = ((total_bytes_read - last_total) / secs);
+	memcpy(temp_buffer + header_width, buffer, buffer_size);
 
-			humanize_number(htotalb, sizeof(htotalb),
-				(int64_t)total_bytes_read,
-				"B",
-				HN_AUTOSCALE,
-				HN_DECIMAL | HN_DIVISOR_1000);
+	/* Calculate the SHA checksum. */
 
-			humanize_number(persec, sizeof(persec),
-				throughput,
-				"B",
-				HN_AUTOSCALE,
-				HN_DECIMAL | HN_DIVISOR_1000);
+	SHA1((uint8_t *)temp_buffer, buffer_size + header_width, (uint8_t *)hash_buffer);
 
-			snprintf(buf, sizeof(buf) - 1,
-				"  %s in %dm%02ds, %s/s now",
-				htotalb,
-				(int)(sum / 60),
-				(int)sum % 60,
-				persec);
+	hash = legible_hash(hash_buffer);
 
-			if (isatty(STDERR_FILENO))
-				outlen = fprintf(stderr, "%-*s\r", outlen, buf) - 1;
+	free(hash_buffer);
+	free(temp_buffer);
 
-			last_total = total_bytes_read;
-			then = now;
-			break;
-		}
+	return (hash);
+}
 
-		/* Find the boundary between the header and the data. */
 
-		if (chunk_size == -1) {
-			if ((marker_start = strnstr(connection->response, "\r\n\r\n", total_bytes_read)) == NULL) {
-				continue;
-			} else {
-				bytes_expected = marker_start - connection->response + 4;
-				marker_start += 2;
-				data_start = marker_start;
+/*
+ * calculate_file_hash
+ *
+ * Function that loads a local file and returns the SHA checksum.
+ */
 
-				/* Check the response code. */
+static char *
+calculate_file_hash(char *path, int file_mode)
+{
+	char     *buffer = NULL, *hash = NULL, temp_path[BUFFER_UNIT_SMALL];
+	uint32_t  buffer_size = 0, bytes_read = 0;
 
-				if (strstr(connection->response, "HTTP/1.") == connection->response) {
-					response_code = strtol(strchr(connection->response, ' ') + 1, (char **)NULL, 10);
+	if (S_ISLNK(file_mode)) {
+		bytes_read = readlink(path, temp_path, BUFFER_UNIT_SMALL);
+		temp_path[bytes_read] = '\0';
 
-					if (response_code == 200)
-						ok = true;
+		hash = calculate_object_hash(temp_path, strlen(temp_path), 3);
+	} else {
+		load_file(path, &buffer, &buffer_size);
+		hash = calculate_object_hash(buffer, buffer_size, 3);
+		free(buffer);
+	}
 
-					if ((connection->proxy_host) && (response_code >= 200) && (response_code < 300))
-						ok = true;
-				}
+	return (hash);
+}
 
-				temp = strstr(connection->response, "Content-Length: ");
 
-				if (temp != NULL) {
-					bytes_expected += strtol(temp + 16, (char **)NULL, 10);
-					chunk_size = -2;
-					chunked_transfer = false;
-				}
-			}
-		}
+/*
+ * append
+ *
+ * Procedure that appends one string to another.
+ */
 
-		/* Successful CONNECT responses do not contain a body. */
+static void
+append(char **buffer, unsigned int *buffer_size, const char *addendum, size_t addendum_size)
+{
+	*buffer = (char *)realloc(*buffer, *buffer_size + addendum_size + 1);
 
-		if ((strstr(command, "CONNECT ") == command) && (ok))
-			break;
+	if (*buffer == NULL)
+		err(EXIT_FAILURE, "append: realloc");
 
-		if ((!chunked_transfer) && (total_bytes_read < bytes_expected))
-			continue;
+	memcpy(*buffer + *buffer_size, addendum, addendum_size);
+	*buffer_size += addendum_size;
+	*(*buffer + *buffer_size) = '\0';
+}
 
-		while ((chunked_transfer) && (total_bytes_read + chunk_size > bytes_expected)) {
-			/* Make sure the whole chunk marker has been read. */
 
-			check_bytes = total_bytes_read - (marker_start + 2 - connection->response);
+/*
+ * extend_updating_list
+ *
+ * Procedure that adds the path of an UPDATING file to a string.
+ */
 
-			if (check_bytes < 0)
-				break;
+static void
+extend_updating_list(connector *connection, char *path)
+{
+	unsigned int size;
+	char         temp[BUFFER_UNIT_SMALL];
 
-			marker_end = strnstr(marker_start + 2, "\r\n", check_bytes);
+	size = (connection->updating ? strlen(connection->updating) : 0);
 
-			if (marker_end == NULL)
-				break;
-
-			/* Remove the chunk length marker. */
-
-			chunk_size    = strtol(marker_start, (char **)NULL, 16);
-			bytes_to_move = total_bytes_read - (marker_end + 2 - connection->response) + 1;
-
-			if (bytes_to_move < 0)
-				break;
-
-			memmove(marker_start, marker_end + 2, bytes_to_move);
-			total_bytes_read -= (marker_end + 2 - marker_start);
-
-			if (chunk_size == 0)
-				break;
-
-			marker_start += chunk_size;
-			bytes_expected += chunk_size;
-		}
-	}
-
-	if ((connection->verbosity) && (isatty(STDERR_FILENO)))
-		fprintf(stderr, "\r\e[0K\r");
-
-	if (!ok)
-		errc(EXIT_FAILURE, EINVAL,
-			"process_command: read failure:\n%s\n",
-			connection->response);
-
-	/* Remove the header. */
-
-	connection->response_size = total_bytes_read - (data_start - connection->response);
-	memmove(connection->response, data_start, connection->response_size);
-	connection->response[connection->response_size] = '\0';
-}
+	snprintf(temp, sizeof(temp), "#\t%s\n", path);
+	append(&connection->updating, &size, temp, strlen(temp));
+}
 
 
 /*
- * send_command
+ * load_remote_data
  *
- * Function that constructs the command to the fetch the full pack data.
+ * Procedure that loads the list of remote data and checksums, if it exists.
+ * A pending list, left behind by an interrupted run, holds the full tree that
+ * run was writing, and is only used to recognize the files it already wrote.
  */
 
 static void
-send_command(connector *connection, char *want)
+load_remote_data(connector *connection, const char *data_file, bool pending)
 {
-	char   *command = NULL;
-	size_t  want_size = 0;
-
-	want_size = strlen(want);
+	struct file_node *file = NULL;
+	char     *buffer = NULL, *hash = NULL, *temp_hash = NULL;
+	char     *line = NULL, *raw = NULL, *path = NULL, *data = NULL;
+	char      temp[BUFFER_UNIT_SMALL], base_path[BUFFER_UNIT_SMALL];
+	char      item[BUFFER_UNIT_SMALL];
+	uint32_t  count = 0, data_size = 0, buffer_size = 0, item_length = 0;
 
-	if ((command = (char *)malloc(BUFFER_UNIT_SMALL + want_size)) == NULL)
-		err(EXIT_FAILURE, "send_command: malloc");
+	load_file(data_file, &data, &data_size);
+	raw = data;
 
-	snprintf(command,
-		BUFFER_UNIT_SMALL + want_size,
-		"POST %s/git-upload-pack HTTP/1.1\r\n"
-		"Host: %s:%d\r\n"
-		"User-Agent: gitup/%s\r\n"
-		"Accept-encoding: deflate, gzip\r\n"
-		"Content-type: application/x-git-upload-pack-request\r\n"
-		"Accept: application/x-git-upload-pack-result\r\n"
-		"Git-Protocol: version=2\r\n"
-		"Content-length: %zu\r\n"
-		"\r\n"
-		"%s",
-		connection->repository_path,
-		connection->host_bracketed,
-		connection->port,
-		GITUP_VERSION,
-		want_size,
-		want);
+	while ((line = strsep(&raw, "\n"))) {
+		/* The first line stores the "have". */
 
-	process_command(connection, command);
+		if (count++ == 0) {
+			if (!pending)
+				connection->have = strdup(line);
 
-	free(command);
-}
+			continue;
+		}
 
+		/*
+		 * Empty lines signify the end of a directory entry, so create
+		 * an obj_tree for what has been read.
+		 */
 
-/*
- * build_clone_command
- *
- * Function that constructs and executes the command to the fetch the shallow
- * pack data.
- */
+		if (strlen(line) == 0) {
+			if (buffer != NULL) {
+				if ((connection->clone == false) && (!pending))
+					store_object(connection,
+						2,
+						buffer,
+						buffer_size,
+						0,
+						0,
+						NULL);
+				else
+					free(buffer);
 
-static char *
-build_clone_command(connector *connection)
-{
-	char *command = NULL;
+				buffer = NULL;
+				buffer_size = 0;
+			}
 
-	if ((command = (char *)malloc(BUFFER_UNIT_SMALL)) == NULL)
-		err(EXIT_FAILURE, "build_clone_command: malloc");
+			continue;
+		}
 
-	snprintf(command,
-		BUFFER_UNIT_SMALL,
-		"0011command=fetch0001"
-		"000fno-progress"
-		"000dofs-delta"
-		"0034shallow %s"
-		"0032want %s\n"
-		"0009done\n0000",
-		connection->want,
-		connection->want);
+		/* Split the line. */
 
-	return (command);
-}
+		hash = strchr(line,     '\t');
+		path = strchr(hash + 1, '\t');
 
+		if ((hash == NULL) || (path == NULL)) {
+			fprintf(stderr,
+				" ! Malformed line '%s' in %s.  Skipping...\n",
+				line,
+				data_file);
 
-/*
- * build_pull_command
- *
- * Function that constructs and executes the command to the fetch the
- * incremental pack data.
- */
+			continue;
+		} else {
+			hash++;
+			path++;
+		}
 
-static char *
-build_pull_command(connector *connection)
-{
-	char *command = NULL;
+		*(hash -  1) = '\0';
+		*(hash + 40) = '\0';
 
-	if ((command = (char *)malloc(BUFFER_UNIT_SMALL)) == NULL)
-		err(EXIT_FAILURE, "build_pull_command: malloc");
+		/* Store the file data. */
 
-	snprintf(command,
-		BUFFER_UNIT_SMALL,
-		"0011command=fetch0001"
-		"000dthin-pack"
-		"000fno-progress"
-		"000dofs-delta"
-		"0034shallow %s"
-		"0034shallow %s"
-		"000cdeepen 1"
-		"0032want %s\n"
-		"0032have %s\n"
-		"0009done\n0000",
-		connection->want,
-		connection->have,
-		connection->want,
-		connection->have);
+		file = (struct file_node *)malloc(sizeof(struct file_node));
 
-	return (command);
-}
+		if (file == NULL)
+			err(EXIT_FAILURE, "load_remote_data: malloc");
 
+		file->mode = strtol(line, (char **)NULL, 8);
+		file->hash = strdup(hash);
+		file->save = 0;
 
-/*
- * build_repair_command
- *
- * Procedure that compares the local repository tree with the data saved from
- * the last run to see if anything has been modified.
- */
+		if (path[strlen(path) - 1] == '/') {
+			snprintf(base_path, sizeof(base_path), "%s", path);
+			snprintf(temp, sizeof(temp), "%s", path);
+			temp[strlen(path) - 1] = '\0';
+		} else {
+			snprintf(temp, sizeof(temp), "%s%s", base_path, path);
 
-static char *
-build_repair_command(connector *connection)
-{
-	struct file_node *find = NULL, *found = NULL;
-	char             *command = NULL, *want = NULL, line[BUFFER_UNIT_SMALL];
-	const char       *message[2] = { "is missing.", "has been modified." };
-	uint32_t          want_size = 0;
+			temp_hash = illegible_hash(hash);
 
-	RB_FOREACH(find, Tree_Remote_Path, &Remote_Path) {
-		found = RB_FIND(Tree_Local_Path, &Local_Path, find);
+			/*
+			 * Build the item and add it to the buffer that will
+			 * become the obj_tree for this directory.
+			 */
 
-		if ((found == NULL) || ((strncmp(found->hash, find->hash, 40) != 0) && (!ignore_file(connection, find->path)))) {
-			if (connection->verbosity)
-				fprintf(stderr,
-					" ! %s %s\n",
-					find->path,
-					message[found ? 1 : 0]);
+			snprintf(item, sizeof(item) - 22, "%s %s", line, path);
+			item_length = strlen(item);
+			memcpy(item + item_length + 1, temp_hash, 20);
+			item_length += 21;
+			item[item_length] = '\0';
 
-			snprintf(line, sizeof(line),
-				"0032want %s\n",
-				find->hash);
+			append(&buffer, &buffer_size, item, item_length);
 
-			append(&want, &want_size, line, strlen(line));
+			free(temp_hash);
 		}
-	}
-
-	if (want_size == 0)
-		return (NULL);
-
-	if (want_size > 3276800)
-		errc(EXIT_FAILURE, E2BIG,
-			"build_repair_command: There are too many files to "
-			"repair -- please re-clone the repository");
 
-	if ((command = (char *)malloc(BUFFER_UNIT_SMALL + want_size)) == NULL)
-		err(EXIT_FAILURE, "build_repair_command: malloc");
+		file->path = strdup(temp);
 
-	snprintf(command,
-		BUFFER_UNIT_SMALL + want_size,
-		"0011command=fetch0001"
-		"000dthin-pack"
-		"000fno-progress"
-		"000dofs-delta"
-		"%s"
-		"000cdeepen 1"
-		"0009done\n0000",
-		want);
+		if (!pending)
+			RB_INSERT(Tree_Remote_Path, &Remote_Path, file);
+		else if (RB_INSERT(Tree_Pending_Path, &Pending_Path, file) != NULL)
+			file_node_free(file);
+	}
 
-	return (command);
+	free(buffer);
+	free(data);
 }
 
 
 /*
- * get_commit_details
+ * scan_local_repository
+ *
+ * Procedure that recursively finds and adds local files and directories to
+ * separate red-black trees.  A negative depth scans the entire tree, a depth
+ * of zero only adds the base path.
  */
 
 static void
-get_commit_details(connector *connection)
+scan_local_repository(connector *connection, char *base_path, int depth)
 {
-	char       command[BUFFER_UNIT_SMALL], ref[BUFFER_UNIT_SMALL], want[41];
-	char       peeled[BUFFER_UNIT_SMALL];
-	char      *position = NULL;
-	time_t     current;
-	struct tm  now;
-	int        tries = 2, year = 0, quarter = 0;
-	uint16_t   length = 0;
-	bool       detached = (connection->want != NULL ? true : false);
+	DIR              *directory = NULL;
+	struct stat       file;
+	struct dirent    *entry = NULL;
+	struct file_node *new_node = NULL, find, *found = NULL;
+	char             *full_path = NULL, file_hash[20];
+	int               full_path_size = 0;
 
-	/* Send the initial info/refs command. */
+	/* Make sure the base path exists in the remote data list. */
 
-	snprintf(command,
-		BUFFER_UNIT_SMALL,
-		"GET %s/info/refs?service=git-upload-pack HTTP/1.1\r\n"
-		"Host: %s:%d\r\n"
-		"User-Agent: gitup/%s\r\n"
-		"Git-Protocol: version=2\r\n"
-		"\r\n",
-		connection->repository_path,
-		connection->host_bracketed,
-		connection->port,
-		GITUP_VERSION);
+	find.path = base_path;
+	found     = RB_FIND(Tree_Remote_Path, &Remote_Path, &find);
 
-	process_command(connection, command);
+	/*
+	 * Add the base path to the local trees, unless a shallower scan of the
+	 * parent directory has already added it.
+	 */
 
-	if (connection->verbosity > 1)
-		printf("%s\n", connection->response);
+	if (RB_FIND(Tree_Local_Path, &Local_Path, &find) == NULL) {
+		if ((new_node = (struct file_node *)malloc(sizeof(struct file_node))) == NULL)
+			err(EXIT_FAILURE, "scan_local_repository: malloc");
 
-	/* Make sure the server supports the version 2 protocol. */
+		new_node->mode = (found ? found->mode : 040000);
+		new_node->hash = (found ? strdup(found->hash) : NULL);
+		new_node->path = strdup(base_path);
+		new_node->keep = (strlen(base_path) == strlen(connection->path_target) ? true : false);
+		new_node->save = false;
 
-	if (strnstr(connection->response, "version 2", connection->response_size) == NULL)
-		errc(EXIT_FAILURE, EPROTONOSUPPORT,
-			"%s does not support the version 2 wire protocol",
-			connection->host);
+		RB_INSERT(Tree_Local_Path, &Local_Path, new_node);
 
-	/* Fetch the list of refs. */
+		if (found)
+			RB_INSERT(Tree_Local_Hash, &Local_Hash, new_node);
+	}
 
-	snprintf(command,
-		BUFFER_UNIT_SMALL,
-		"0014command=ls-refs\n"
-		"0016object-format=sha1"
-		"0001"
-		"0009peel\n"
-		"000csymrefs\n"
-		"0014ref-prefix HEAD\n"
-		"001bref-prefix refs/heads/\n"
-		"001aref-prefix refs/tags/\n"
-		"0000");
+	if (depth == 0)
+		return;
 
-	send_command(connection, command);
+	/* Process the directory's contents. */
 
-	if (connection->verbosity > 1)
-		printf("%s\n", connection->response);
+	if ((stat(base_path, &file) != -1) && ((directory = opendir(base_path)) != NULL)) {
+		while ((entry = readdir(directory)) != NULL) {
+			if ((entry->d_namlen == 1) && (strcmp(entry->d_name, "." ) == 0))
+				continue;
 
-	/* Extract the "want" checksum. */
+			if ((entry->d_namlen == 2) && (strcmp(entry->d_name, "..") == 0))
+				continue;
 
-	want[0] = '\0';
+			if ((entry->d_namlen == 4) && (strcmp(entry->d_name, ".git") == 0)) {
+				fprintf(stderr,
+					" ! A .git directory was found -- "
+					"gitup does not update this directory "
+					"which will cause problems for the "
+					"official Git client.\n ! If you wish "
+					"to use gitup, please remove %s/%s and "
+					"rerun gitup.\n",
+					base_path,
+					entry->d_name);
+
+				exit(EXIT_FAILURE);
+				}
+
+			full_path_size = strlen(base_path) + entry->d_namlen + 2;
+			full_path      = (char *)malloc(full_path_size + 1);
+
+			if (full_path == NULL)
+				err(EXIT_FAILURE,
+					"scan_local_repository: malloc");
+
+			snprintf(full_path,
+				full_path_size,
+				"%s/%s",
+				base_path,
+				entry->d_name);
 
-	while ((tries-- > 0) && (want[0] == '\0') && (detached == false)) {
-		if (strncmp(connection->branch, "quarterly", 9) == 0) {
 			/*
-			 * If the current calendar quarter doesn't exist, try
-			 * the previous one.
+			 * Remove any file an interrupted run was staging, leaving
+			 * the ignored directories alone.
 			 */
 
-			current = time(NULL);
-			now     = *localtime(&current);
-			year    = 1900 + now.tm_year + ((tries == 0) && (now.tm_mon < 3) ? -1 : 0);
-			quarter = ((now.tm_mon / 3) + (tries == 0 ? 3 : 0)) % 4 + 1;
+			find.path = full_path;
 
-			snprintf(ref, BUFFER_UNIT_SMALL, " refs/heads/%04dQ%d", year, quarter);
-		} else if (connection->tag != NULL) {
-			snprintf(ref, BUFFER_UNIT_SMALL, " refs/tags/%s", connection->tag);
-		} else {
-			snprintf(ref, BUFFER_UNIT_SMALL, " refs/heads/%s", connection->branch);
-		}
+			if ((entry->d_name[0] == '.') && (entry->d_namlen > 7) && (strcmp(entry->d_name + entry->d_namlen - 6, ".gitup") == 0) && (RB_FIND(Tree_Remote_Path, &Remote_Path, &find) == NULL) && (!ignore_file(connection, full_path))) {
+				unlink(full_path);
+				free(full_path);
+				continue;
+			}
 
-		/*
-		 * Look for the "want" in peeled references first, then look
-		 * before the ref.
-		 */
+			if (lstat(full_path, &file) == -1)
+				err(EXIT_FAILURE,
+					"scan_local_repository: cannot read %s",
+					full_path);
 
-		snprintf(peeled, sizeof(peeled), "%s peeled:", ref);
+			if (S_ISDIR(file.st_mode)) {
+				scan_local_repository(connection,
+					full_path,
+					(depth > 0 ? depth - 1 : depth));
+				free(full_path);
+			} else {
+				if ((new_node = (struct file_node *)malloc(sizeof(struct file_node))) == NULL)
+					err(EXIT_FAILURE,
+						"scan_local_repository: malloc");
 
-		if ((position = strstr(connection->response, peeled)) != NULL)
-			memcpy(want, position + strlen(peeled), 40);
-		else if ((position = strstr(connection->response, ref)) != NULL)
-			memcpy(want, position - 40, 40);
-		else if (tries == 0)
-			errc(EXIT_FAILURE, EINVAL,
-				"get_commit_details:%s doesn't exist in %s",
-				ref,
-				connection->repository_path);
-	}
+				new_node->mode = file.st_mode;
+				new_node->path = full_path;
+				new_node->keep = (strnstr(full_path, ".gituprevision", strlen(full_path)) != NULL ? true : false);
+				new_node->save = false;
 
-	/* Retain the name of the quarterly branch being used. */
+				if (ignore_file(connection, full_path)) {
+					new_node->hash = (char *)malloc(20);
 
-	if (strncmp(connection->branch, "quarterly", 9) == 0) {
-		free(connection->branch);
-		connection->branch = strdup(ref + 12);
-	}
+					if (new_node->hash == NULL)
+						err(EXIT_FAILURE,
+							"scan_local_repository: malloc");
 
-	if (want[0] != '\0') {
-		if (connection->want == NULL)
-			if ((connection->want = (char *)malloc(41)) == NULL)
-				err(EXIT_FAILURE, "get_commit_details: malloc");
+					SHA1((uint8_t *)full_path, strlen(full_path), (uint8_t *)file_hash);
+					memcpy(new_node->hash, file_hash, 20);
+				} else
+					new_node->hash = calculate_file_hash(full_path, file.st_mode);
 
-		memcpy(connection->want, want, 40);
-		connection->want[40] = '\0';
+				RB_INSERT(Tree_Local_Hash, &Local_Hash, new_node);
+				RB_INSERT(Tree_Local_Path, &Local_Path, new_node);
+			}
+		}
 
-		if (connection->verbosity)
-			fprintf(stderr, "# Want: %s\n", connection->want);
+		closedir(directory);
 	}
+}
+
+
+/*
+ * load_object
+ *
+ * Procedure that loads a local file and adds it to the array/tree of pack
+ * file objects.  Callers check the object tree to see if it was found.
+ */
+
+static void
+load_object(connector *connection, char *hash, char *path)
+{
+	struct object_node *object = NULL, lookup_object;
+	struct file_node   *find = NULL, *remote = NULL, *copy = NULL, lookup_file;
+	char               *buffer = NULL, *check_hash = NULL;
+	uint32_t            buffer_size = 0;
+	bool                found_hash = false;
+
+	lookup_object.hash = hash;
+	lookup_file.hash   = hash;
+	lookup_file.path   = path;
 
 	/*
-	 * Because there is no way to lookup commit history, if a want commit
-	 * is specified, change the branch to (detached).
+	 * If the object doesn't exist, look for it first by hash, then by path
+	 * and if it is found and the SHA checksum references a file, load it
+	 * and store it.
 	 */
 
-	if (detached == true) {
-		free(connection->branch);
-		connection->branch = strdup("(detached)");
-	}
+	if ((object = RB_FIND(Tree_Objects, &Objects, &lookup_object)) != NULL)
+		return;
 
-	if ((connection->verbosity) && (connection->tag == NULL))
-		fprintf(stderr, "# Branch: %s\n", connection->branch);
+	find = RB_FIND(Tree_Local_Hash, &Local_Hash, &lookup_file);
 
-	/* Create the pack file name. */
+	if (find == NULL)
+		find = RB_FIND(Tree_Local_Path, &Local_Path, &lookup_file);
 
-	if (connection->keep_pack_file == true) {
-		length = strlen(connection->section) + 47;
+	/*
+	 * Incremental scans only hash the directories that changed, so fall
+	 * back to any unmodified file the remote data list places elsewhere.
+	 */
 
-		connection->pack_data_file = (char *)malloc(length + 1);
+	if ((find == NULL) && (connection->incremental)) {
+		/*
+		 * Index the unmodified files by checksum the first time one is
+		 * needed.  The copies keep the checksums the files had on disk.
+		 */
 
-		if (connection->pack_data_file == NULL)
-			err(EXIT_FAILURE, "get_commit_details: malloc");
+		if (!Remote_Hash_Built) {
+			RB_FOREACH(remote, Tree_Remote_Path, &Remote_Path) {
+				if ((remote->save) || (S_ISDIR(remote->mode)))
+					continue;
 
-		snprintf(connection->pack_data_file, length,
-			"%s-%s.pack",
-			connection->section,
-			connection->want);
+				if ((copy = (struct file_node *)malloc(sizeof(struct file_node))) == NULL)
+					err(EXIT_FAILURE, "load_object: malloc");
 
-		if (connection->verbosity)
-			fprintf(stderr,
-				"# Saving pack file: %s\n",
-				connection->pack_data_file);
+				copy->mode = remote->mode;
+				copy->hash = strdup(remote->hash);
+				copy->path = strdup(remote->path);
+				copy->keep = false;
+				copy->save = false;
+
+				if (RB_INSERT(Tree_Remote_Hash, &Remote_Hash, copy) != NULL)
+					file_node_free(copy);
+			}
+
+			Remote_Hash_Built = true;
+		}
+
+		remote = RB_FIND(Tree_Remote_Hash, &Remote_Hash, &lookup_file);
+
+		if ((remote != NULL) && (path_exists(remote->path))) {
+			check_hash = calculate_file_hash(remote->path, remote->mode);
+			found_hash = (strncmp(check_hash, hash, 40) == 0);
+			free(check_hash);
+
+			if (found_hash)
+				find = remote;
+		}
+	}
+
+	if (find) {
+		if (!S_ISDIR(find->mode)) {
+			load_file(find->path, &buffer, &buffer_size);
+
+			store_object(connection,
+				3,
+				buffer,
+				buffer_size,
+				0,
+				0,
+				NULL);
+		}
 	}
 }
 
 
 /*
- * load_pack
+ * create_tunnel
  *
- * Procedure that loads a local copy of the pack data or fetches it from
- * the server.
+ * Procedure that sends a CONNECT command to create a proxy tunnel.
  */
 
 static void
-load_pack(connector *connection)
+create_tunnel(connector *connection)
 {
-	char hash[20];
-	int  pack_size = 0;
+	char command[BUFFER_UNIT_SMALL];
 
-	load_file(connection->pack_data_file,
-		&connection->response,
-		&connection->response_size);
+	snprintf(command,
+		BUFFER_UNIT_SMALL,
+		"CONNECT %s:%d HTTP/1.1\r\n"
+		"Host: %s:%d\r\n"
+		"%s"
+		"\r\n",
+		connection->host_bracketed,
+		connection->port,
+		connection->host_bracketed,
+		connection->port,
+		connection->proxy_credentials);
 
-	pack_size = connection->response_size - 20;
+		process_command(connection, command, strlen(command));
+}
 
-	/* Verify the pack data checksum. */
 
-	SHA1((uint8_t *)connection->response, pack_size, (uint8_t *)hash);
+/*
+ * set_host
+ *
+ * Procedure that sets the server's host name, bracketing IPv6 addresses for
+ * use in URLs.
+ */
 
-	if (memcmp(connection->response + pack_size, hash, 20) != 0)
-		errc(EXIT_FAILURE, EAUTH,
-			"load_pack: pack checksum mismatch -- "
-			"expected: %s, received: %s",
-			legible_hash(connection->response + pack_size),
-			legible_hash(hash));
+static void
+set_host(connector *connection, const char *host)
+{
+	size_t length = strlen(host) + 3;
 
-	/* Process the pack data. */
+	free(connection->host);
+	connection->host = strdup(host);
 
-	unpack_objects(connection);
+	if ((connection->host_bracketed = (char *)realloc(connection->host_bracketed, length)) == NULL)
+		err(EXIT_FAILURE, "set_host: malloc");
 
-	free(connection->response);
-	connection->response        = NULL;
-	connection->response_size   = 0;
-	connection->response_blocks = 0;
+	if ((strchr(connection->host, ':')) && (strchr(connection->host, '[') == NULL))
+		snprintf(connection->host_bracketed,
+			length,
+			"[%s]",
+			connection->host);
+	else
+		snprintf(connection->host_bracketed,
+			length,
+			"%s",
+			connection->host);
 }
 
 
 /*
- * fetch_pack
+ * set_session_file
  *
- * Procedure that fetches pack data from the server.
+ * Procedure that builds the path of the file the server's TLS session is
+ * saved in.
  */
 
 static void
-fetch_pack(connector *connection, char *command)
+set_session_file(connector *connection)
 {
-	char *pack_start = NULL, hash[20];
-	int   chunk_size = 1, pack_size = 0, source = 0, target = 0;
+	size_t length = strlen(connection->path_work) + strlen(connection->host) + 20;
 
-	/* Request the pack data. */
+	free(connection->session_file);
 
-	send_command(connection, command);
+	if ((connection->session_file = (char *)malloc(length)) == NULL)
+		err(EXIT_FAILURE, "set_session_file: malloc");
 
-	/* Find the start of the pack data and remove the header. */
+	snprintf(connection->session_file, length,
+		"%s/.tls.%s.%d",
+		connection->path_work,
+		connection->host,
+		connection->port);
+}
 
-	if ((pack_start = strstr(connection->response, "PACK")) == NULL)
-		errc(EXIT_FAILURE, EFTYPE,
-			"fetch_pack: malformed pack data:\n%s",
-			connection->response);
 
-	pack_start -= 5;
-	connection->response_size -= (pack_start - connection->response + 11);
-	memmove(connection->response, connection->response + 8, 4);
+/*
+ * use_mirror
+ *
+ * Procedure that switches the connection to a mirror, given as host, host:port
+ * or [IPv6 address]:port.
+ */
 
-	/* Remove the chunk size markers from the pack data. */
+static void
+use_mirror(connector *connection, const char *mirror)
+{
+	char *copy = strdup(mirror), *host = copy, *temp = NULL;
+	int   port = connection->port;
 
-	source = pack_start - connection->response;
+	if ((copy[0] == '[') && ((temp = strchr(copy, ']')) != NULL)) {
+		*temp = '\0';
+		host  = copy + 1;
 
-	while (chunk_size > 0) {
-		chunk_size = strtol(connection->response + source, (char **)NULL, 16);
+		if (temp[1] == ':')
+			port = strtol(temp + 2, (char **)NULL, 10);
+	} else if (((temp = strchr(copy, ':')) != NULL) && (strchr(temp + 1, ':') == NULL)) {
+		*temp = '\0';
+		port  = strtol(temp + 1, (char **)NULL, 10);
+	}
 
-		if (chunk_size == 0)
-			break;
+	set_host(connection, host);
+	connection->port = port;
 
-		memmove(connection->response + target,
-			connection->response + source + 5,
-			chunk_size - 5);
+	/* The saved TLS session belongs to the last server. */
 
-		target += chunk_size - 5;
-		source += chunk_size;
-		connection->response_size -= 5;
+	if (connection->session) {
+		SSL_SESSION_free(connection->session);
+		connection->session = NULL;
 	}
 
-	connection->response_size += 5;
-	pack_size = connection->response_size - 20;
+	if (connection->session_file)
+		set_session_file(connection);
 
-	/* Verify the pack data checksum. */
+	free(copy);
+}
 
-	SHA1((uint8_t *)connection->response, pack_size, (uint8_t *)hash);
 
-	if (memcmp(connection->response + pack_size, hash, 20) != 0)
-		errc(EXIT_FAILURE, EAUTH,
-			"fetch_pack: pack checksum mismatch -- "
-			"expected: %s, received: %s",
-			legible_hash(connection->response + pack_size),
-			legible_hash(hash));
+/*
+ * select_mirror
+ *
+ * Procedure that probes the server and its mirrors at the same time, each in
+ * its own process, and picks the first one to complete a TLS handshake and an
+ * ls-refs round trip that finds the wanted branch or tag.  The others are kept
+ * in order as fallbacks.
+ */
 
-	/* Save the pack data. */
+static void
+select_mirror(connector *connection)
+{
+	connector   probe;
+	char      **candidate = NULL, address[BUFFER_UNIT_SMALL];
+	pid_t      *prober = NULL, child = 0;
+	int         candidates = connection->mirrors + 1, chosen = -1;
+	int         x = 0, y = 0, status = 0, null = -1, running = 0;
 
-	if (connection->keep_pack_file == true)
-		save_file(connection->pack_data_file,
-			0644,
-			connection->response,
-			connection->response_size,
-			0,
-			0);
+	if (((candidate = (char **)malloc(candidates * sizeof(char *))) == NULL) || ((prober = (pid_t *)calloc(candidates, sizeof(pid_t))) == NULL))
+		err(EXIT_FAILURE, "select_mirror: malloc");
 
-	/* Process the pack data. */
+	snprintf(address, sizeof(address),
+		"%s:%d",
+		connection->host_bracketed,
+		connection->port);
 
-	unpack_objects(connection);
+	candidate[0] = strdup(address);
 
-	free(command);
-}
+	for (x = 0; x < connection->mirrors; x++)
+		candidate[x + 1] = connection->mirror[x];
 
+	if (connection->verbosity)
+		fprintf(stderr, "# Probing %d mirrors\n", candidates);
 
-/*
- * store_object
- *
- * Procedure that creates a new object and stores it in the array and
- * lookup tree.
- */
+	fflush(stdout);
+	fflush(stderr);
 
-static void
-store_object(connector *connection, int type, char *buffer, int buffer_size, int pack_offset, int index_delta, char *ref_delta_hash)
-{
-	struct object_node *object = NULL, find;
-	char               *hash = NULL;
+	for (x = 0; x < candidates; x++) {
+		if ((prober[x] = fork()) == -1)
+			err(EXIT_FAILURE, "select_mirror: fork");
 
-	hash = calculate_object_hash(buffer, buffer_size, type);
+		if (prober[x] == 0) {
+			if ((null = open("/dev/null", O_WRONLY)) != -1) {
+				dup2(null, STDOUT_FILENO);
+				dup2(null, STDERR_FILENO);
+			}
 
-	/* Check to make sure the object doesn't already exist. */
+			probe                 = *connection;
+			probe.ssl             = NULL;
+			probe.mirrors         = 0;
+			probe.refs            = NULL;
+			probe.response        = NULL;
+			probe.response_blocks = 0;
+			probe.response_size   = 0;
 
-	find.hash = hash;
-	object    = RB_FIND(Tree_Objects, &Objects, &find);
+			use_mirror(&probe, candidate[x]);
+			connect_server(&probe);
 
-	if ((object != NULL) && (connection->repair == false)) {
-		free(hash);
-	} else {
-		/* Extend the array if needed, create a new node and add it. */
+			if (probe.proxy_host)
+				create_tunnel(&probe);
 
-		if (connection->objects % BUFFER_UNIT_SMALL == 0)
-			if ((connection->object = (struct object_node **)realloc(connection->object, (connection->objects + BUFFER_UNIT_SMALL) * sizeof(struct object_node *))) == NULL)
-				err(EXIT_FAILURE, "store_object: realloc");
+			setup_ssl(&probe);
+			get_commit_details(&probe);
 
-		object = (struct object_node *)malloc(sizeof(struct object_node));
+			_exit(EXIT_SUCCESS);
+		}
 
-		if (object == NULL)
-			err(EXIT_FAILURE, "store_object: malloc");
+		running++;
+	}
 
-		object->index          = connection->objects;
-		object->type           = type;
-		object->hash           = hash;
-		object->pack_offset    = pack_offset;
-		object->index_delta    = index_delta;
-		object->ref_delta_hash = (ref_delta_hash ? legible_hash(ref_delta_hash) : NULL);
-		object->buffer         = buffer;
-		object->buffer_size    = buffer_size;
-		object->can_free       = true;
-		object->file_offset    = -1;
+	/* The probes finish in order of latency, so use the first to succeed. */
 
-		if (connection->verbosity > 1)
-			fprintf(stdout,
-				"###### %05d-%d\t%d\t%u\t%s\t%d\t%s\n",
-				object->index,
-				object->type,
-				object->pack_offset,
-				object->buffer_size,
-				object->hash,
-				object->index_delta,
-				object->ref_delta_hash);
+	while ((running > 0) && (chosen == -1)) {
+		if ((child = wait(&status)) == -1)
+			err(EXIT_FAILURE, "select_mirror: wait");
 
-		if (type < 6)
-			RB_INSERT(Tree_Objects, &Objects, object);
+		for (x = 0; (x < candidates) && (prober[x] != child); x++);
 
-		connection->object[connection->objects++] = object;
+		if (x == candidates)
+			continue;
+
+		prober[x] = 0;
+		running--;
+
+		if ((WIFEXITED(status)) && (WEXITSTATUS(status) == EXIT_SUCCESS))
+			chosen = x;
 	}
+
+	for (x = 0; x < candidates; x++)
+		if (prober[x] > 0) {
+			kill(prober[x], SIGTERM);
+			waitpid(prober[x], NULL, 0);
+		}
+
+	if (chosen == -1)
+		errc(EXIT_FAILURE, EHOSTUNREACH,
+			"select_mirror: none of the mirrors is usable");
+
+	if (connection->verbosity)
+		fprintf(stderr, "# Using mirror: %s\n", candidate[chosen]);
+
+	/* Keep the other candidates, in their configured order, to fail over to. */
+
+	if ((connection->mirror = (char **)realloc(connection->mirror, candidates * sizeof(char *))) == NULL)
+		err(EXIT_FAILURE, "select_mirror: realloc");
+
+	connection->mirror[0] = candidate[chosen];
+
+	for (x = 0, y = 1; x < candidates; x++)
+		if (x != chosen)
+			connection->mirror[y++] = candidate[x];
+
+	connection->mirrors     = candidates;
+	connection->mirror_next = 1;
+
+	use_mirror(connection, connection->mirror[0]);
+
+	free(candidate);
+	free(prober);
 }
 
 
 /*
- * unpack_objects
+ * connect_server
  *
- * Procedure that extracts all of the objects from the pack data.
+ * Procedure that (re)establishes a connection with the server.
  */
 
 static void
-unpack_objects(connector *connection)
+connect_server(connector *connection)
 {
-	int            buffer_size = 0, total_objects = 0, object_type = 0;
-	int            index_delta = 0, stream_code = 0, version = 0;
-	int            stream_bytes = 0, x = 0, tot_len = 0;
-	char          *buffer = NULL, *ref_delta_hash = NULL;
-	char           remote_files_tmp[BUFFER_UNIT_SMALL];
-	uint32_t       file_size = 0, file_bits = 0, pack_offset = 0;
-	uint32_t       lookup_offset = 0, position = 4, nobj_old = 0;
-	unsigned char  zlib_out[16384];
+	struct addrinfo  hints, *start, *temp, *first, *other, **address = NULL;
+	struct pollfd   *attempt = NULL;
+	struct timespec  started, now;
+	struct timeval   timeout;
+	socklen_t        length = sizeof(int);
+	int              error = 0, option = 1, addresses = 0, next = 0, active = 0;
+	int              x = 0, wait = 0, elapsed = 0, last_error = ETIMEDOUT;
+	char             type[10];
+	char            *host = (connection->proxy_host ? connection->proxy_host : connection->host);
 
-	/* Setup the temporary object store file. */
+	snprintf(type, sizeof(type), "%d", (connection->proxy_host ? connection->proxy_port : connection->port));
 
-	if (connection->low_memory) {
-		snprintf(remote_files_tmp, BUFFER_UNIT_SMALL,
-			"%s.tmp",
-			connection->remote_data_file);
+	bzero(&hints, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
 
-		connection->back_store = open(remote_files_tmp,
-			O_WRONLY | O_CREAT | O_TRUNC);
+	if ((error = getaddrinfo(host, type, &hints, &start)))
+		errx(EXIT_FAILURE, "%s", gai_strerror(error));
 
-		if (connection->back_store == -1)
-			err(EXIT_FAILURE,
-				"unpack_objects: object file write failure %s",
-				remote_files_tmp);
+	for (temp = start; temp != NULL; temp = temp->ai_next)
+		addresses++;
+
+	if ((address = (struct addrinfo **)calloc(addresses, sizeof(struct addrinfo *))) == NULL)
+		err(EXIT_FAILURE, "connect_server: calloc");
+
+	if ((attempt = (struct pollfd *)calloc(addresses, sizeof(struct pollfd))) == NULL)
+		err(EXIT_FAILURE, "connect_server: calloc");
 
-		chmod(remote_files_tmp, 0644);
+	/*
+	 * Alternate between the address families, starting with the family of
+	 * the first address (RFC 8305).
+	 */
+
+	for (x = 0, first = start, other = start; x < addresses; x++) {
+		while ((first) && (first->ai_family != start->ai_family))
+			first = first->ai_next;
+
+		while ((other) && (other->ai_family == start->ai_family))
+			other = other->ai_next;
+
+		if ((other == NULL) || ((x % 2 == 0) && (first != NULL))) {
+			address[x] = first;
+			first = first->ai_next;
+		} else {
+			address[x] = other;
+			other = other->ai_next;
+		}
 	}
 
-	/* Check the pack version number. */
+	/*
+	 * Start a connection attempt to each address in turn, giving each one
+	 * CONNECT_ATTEMPT_DELAY milliseconds before starting the next, and use
+	 * whichever connects first.
+	 */
 
-	version   = (unsigned char)connection->response[position + 3];
-	position += 4;
+	for (x = 0; x < addresses; x++)
+		attempt[x].fd = -1;
 
-	if (version != 2)
-		errc(EXIT_FAILURE, EFTYPE,
-			"unpack_objects: pack version %d not supported",
-			version);
+	connection->socket_descriptor = -1;
+	clock_gettime(CLOCK_MONOTONIC_FAST, &started);
 
-	/* Determine the number of objects in the pack data. */
+	while (connection->socket_descriptor == -1) {
+		if (next < addresses) {
+			temp = address[next];
 
-	for (x = 0; x < 4; x++, position++)
-		total_objects = (total_objects << 8) + (unsigned char)connection->response[position];
+			if ((attempt[next].fd = socket(temp->ai_family, temp->ai_socktype, temp->ai_protocol)) != -1) {
+				fcntl(attempt[next].fd, F_SETFL, fcntl(attempt[next].fd, F_GETFL) | O_NONBLOCK);
+				attempt[next].events = POLLOUT;
 
-	if (connection->verbosity > 1)
-		fprintf(stderr,
-			"\npack version: %d, total_objects: %d, pack_size: %d\n\n",
-			version,
-			total_objects,
-			connection->response_size);
+				if (connect(attempt[next].fd, temp->ai_addr, temp->ai_addrlen) == 0) {
+					connection->socket_descriptor = attempt[next].fd;
+					attempt[next++].fd = -1;
+					break;
+				}
 
-	/* Unpack the objects. */
+				if (errno == EINPROGRESS) {
+					active++;
+				} else {
+					last_error = errno;
+					close(attempt[next].fd);
+					attempt[next].fd = -1;
+				}
+			} else {
+				last_error = errno;
+			}
 
-	while ((position < connection->response_size) && (total_objects-- > 0)) {
-		object_type    = (unsigned char)connection->response[position] >> 4 & 0x07;
-		pack_offset    = position;
-		index_delta    = 0;
-		file_size      = 0;
-		stream_bytes   = 0;
-		ref_delta_hash = NULL;
+			next++;
+		}
 
-		/* Extract the file size. */
+		if (active == 0) {
+			if (next < addresses)
+				continue;
 
-		do {
-			file_bits  = connection->response[position] & (stream_bytes == 0 ? 0x0F : 0x7F);
-			file_size += (stream_bytes == 0 ? file_bits : file_bits << (4 + 7 * (stream_bytes - 1)));
-			stream_bytes++;
+			break;
 		}
-		while (connection->response[position++] & 0x80);
 
-		/* Find the object->index referred to by the ofs-delta. */
+		clock_gettime(CLOCK_MONOTONIC_FAST, &now);
+		elapsed = (now.tv_sec - started.tv_sec) * 1000 + (now.tv_nsec - started.tv_nsec) / 1000000;
+		wait    = connection->connect_timeout * 1000 - elapsed;
 
-		if (object_type == 6) {
-			lookup_offset = 0;
-			index_delta   = connection->objects;
+		if (wait <= 0)
+			break;
 
-			do lookup_offset = (lookup_offset << 7) + (connection->response[position] & 0x7F) + 1;
-			while (connection->response[position++] & 0x80);
+		if ((next < addresses) && (wait > CONNECT_ATTEMPT_DELAY))
+			wait = CONNECT_ATTEMPT_DELAY;
 
-			while (--index_delta > 0)
-				if (pack_offset - lookup_offset + 1 == connection->object[index_delta]->pack_offset)
-					break;
+		if (poll(attempt, next, wait) == -1) {
+			if (errno == EINTR)
+				continue;
 
-			if (index_delta == 0)
-				errc(EXIT_FAILURE, EINVAL,
-					"unpack_objects: cannot find ofs-delta "
-					"base object");
+			err(EXIT_FAILURE, "connect_server: poll");
 		}
 
-		/* Extract the ref-delta checksum. */
+		for (x = 0; x < next; x++) {
+			if ((attempt[x].fd == -1) || (attempt[x].revents == 0))
+				continue;
 
-		if (object_type == 7) {
-			if ((ref_delta_hash = (char *)malloc(20)) == NULL)
-				err(EXIT_FAILURE, "unpack_objects: malloc");
+			if ((getsockopt(attempt[x].fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0) && (error == 0)) {
+				connection->socket_descriptor = attempt[x].fd;
+				attempt[x].fd = -1;
+				break;
+			}
 
-			memcpy(ref_delta_hash, connection->response + position, 20);
-			position += 20;
+			last_error = error;
+			close(attempt[x].fd);
+			attempt[x].fd = -1;
+			active--;
 		}
+	}
 
-		/* Inflate and store the object. */
+	/* Abandon the attempts that lost. */
 
-		buffer      = NULL;
-		buffer_size = 0;
+	for (x = 0; x < next; x++)
+		if (attempt[x].fd != -1)
+			close(attempt[x].fd);
 
-		z_stream stream = {
-			.zalloc   = Z_NULL,
-			.zfree    = Z_NULL,
-			.opaque   = Z_NULL,
-			.avail_in = connection->response_size - position,
-			.next_in  = (unsigned char *)(connection->response + position),
-			};
+	freeaddrinfo(start);
+	free(address);
+	free(attempt);
 
-		stream_code = inflateInit(&stream);
+	/* Fail over to the next mirror if the server cannot be reached. */
 
-		if (stream_code == Z_DATA_ERROR)
-			errc(EXIT_FAILURE, EILSEQ,
-				"unpack_objects: zlib data stream failure");
+	if ((connection->socket_descriptor == -1) && (connection->proxy_host == NULL) && (connection->mirror_next < connection->mirrors)) {
+		if (connection->verbosity)
+			fprintf(stderr,
+				"# Cannot connect to %s, switching to %s\n",
+				host,
+				connection->mirror[connection->mirror_next]);
 
-		do {
-			stream.avail_out = 16384,
-			stream.next_out  = zlib_out;
-			stream_code      = inflate(&stream, Z_NO_FLUSH);
-			stream_bytes     = 16384 - stream.avail_out;
+		use_mirror(connection, connection->mirror[connection->mirror_next++]);
+		connect_server(connection);
 
-			if ((buffer = (char *)realloc(buffer, buffer_size + stream_bytes)) == NULL)
-				err(EXIT_FAILURE, "unpack_objects: realloc");
+		return;
+	}
 
-			memcpy(buffer + buffer_size, zlib_out, stream_bytes);
-			buffer_size += stream_bytes;
-		}
-		while (stream.avail_out == 0);
+	if (connection->socket_descriptor == -1)
+		errc(EXIT_FAILURE, last_error,
+			"connect_server: cannot connect to %s",
+			host);
 
-		inflateEnd(&stream);
-		position += stream.total_in;
+	fcntl(connection->socket_descriptor, F_SETFL, fcntl(connection->socket_descriptor, F_GETFL) & ~O_NONBLOCK);
 
-		if (connection->low_memory) {
-			write(connection->back_store, buffer, buffer_size);
-			nobj_old = connection->objects;
-		}
+	if (setsockopt(connection->socket_descriptor, SOL_SOCKET, SO_KEEPALIVE, &option, sizeof(int)))
+		err(EXIT_FAILURE,
+			"setup_ssl: setsockopt SO_KEEPALIVE error");
 
-		store_object(connection,
-			object_type,
-			buffer,
-			buffer_size,
-			pack_offset,
-			index_delta,
-			ref_delta_hash);
+	/* Let writes to a connection the server closed fail with EPIPE. */
+
+	if (setsockopt(connection->socket_descriptor, SOL_SOCKET, SO_NOSIGPIPE, &option, sizeof(int)))
+		err(EXIT_FAILURE,
+			"setup_ssl: setsockopt SO_NOSIGPIPE error");
+
+	option = BUFFER_UNIT_LARGE;
+
+	if (setsockopt(connection->socket_descriptor, SOL_SOCKET, SO_SNDBUF, &option, sizeof(int)))
+		err(EXIT_FAILURE,
+			"setup_ssl: setsockopt SO_SNDBUF error");
+
+	if (setsockopt(connection->socket_descriptor, SOL_SOCKET, SO_RCVBUF, &option, sizeof(int)))
+		err(EXIT_FAILURE,
+			"setup_ssl: setsockopt SO_RCVBUF error");
+
+	bzero(&timeout, sizeof(struct timeval));
+	timeout.tv_sec = 300;
+
+	if (setsockopt(connection->socket_descriptor, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(struct timeval)))
+		err(EXIT_FAILURE,
+			"setup_ssl: setsockopt SO_RCVTIMEO error");
+
+	if (setsockopt(connection->socket_descriptor, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(struct timeval)))
+		err(EXIT_FAILURE,
+			"setup_ssl: setsockopt SO_SNDTIMEO error");
+}
+
+
+/*
+ * setup_ssl
+ *
+ * Procedure that sends a command to the server and processes the response.
+ */
+
+static void
+setup_ssl(connector *connection)
+{
+	FILE *session_file = NULL;
+	int   error = 0;
+
+	if (connection->ctx == NULL) {
+		SSL_library_init();
+		SSL_load_error_strings();
+		connection->ctx = SSL_CTX_new(SSLv23_client_method());
+		SSL_CTX_set_mode(connection->ctx, SSL_MODE_AUTO_RETRY);
+		SSL_CTX_set_options(connection->ctx, SSL_OP_ALL);
+		SSL_CTX_set_session_cache_mode(connection->ctx, SSL_SESS_CACHE_CLIENT);
+
+		/* Pull in as many records as the socket has with each read. */
+
+		SSL_CTX_set_read_ahead(connection->ctx, 1);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		SSL_CTX_set_default_read_buffer_len(connection->ctx, BUFFER_UNIT_LARGE);
+#endif
+	}
+
+	if ((connection->ssl = SSL_new(connection->ctx)) == NULL)
+		err(EXIT_FAILURE, "setup_ssl: SSL_new");
+
+	SSL_set_fd(connection->ssl, connection->socket_descriptor);
+
+	/* Pick up the session saved by the last run, if there is one. */
+
+	if ((connection->session == NULL) && (connection->session_file) && ((session_file = fopen(connection->session_file, "r")) != NULL)) {
+		connection->session = PEM_read_SSL_SESSION(session_file, NULL, NULL, NULL);
+		fclose(session_file);
+	}
+
+	/* Try to resume the last session instead of a full handshake. */
+
+	if (connection->session)
+		SSL_set_session(connection->ssl, connection->session);
+
+	while ((error = SSL_connect(connection->ssl)) == -1)
+		fprintf(stderr,
+			"setup_ssl: SSL_connect error: %d\n",
+			SSL_get_error(connection->ssl, error));
+
+	if ((connection->verbosity > 1) && (SSL_session_reused(connection->ssl)))
+		fprintf(stderr, "# Resumed TLS session with %s\n", connection->host);
+}
+
+
+/*
+ * keep_session
+ *
+ * Procedure that holds on to the current TLS session so the next connection
+ * can resume it.
+ */
+
+static void
+keep_session(connector *connection)
+{
+	SSL_SESSION *session = NULL;
+
+	if ((connection->ssl == NULL) || ((session = SSL_get1_session(connection->ssl)) == NULL))
+		return;
+
+	if (connection->session)
+		SSL_SESSION_free(connection->session);
+
+	connection->session = session;
+}
+
+
+/*
+ * save_session
+ *
+ * Procedure that saves the TLS session in the work directory, readable only
+ * by its owner, so the next run can resume it.
+ */
+
+static void
+save_session(connector *connection)
+{
+	FILE *session_file = NULL;
+	int   fd = -1;
+
+	keep_session(connection);
+
+	if ((connection->session == NULL) || (connection->session_file == NULL))
+		return;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	if (!SSL_SESSION_is_resumable(connection->session)) {
+		unlink(connection->session_file);
+		return;
+	}
+#endif
+
+	if ((fd = open(connection->session_file, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1)
+		return;
+
+	if ((session_file = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		return;
+	}
+
+	PEM_write_SSL_SESSION(session_file, connection->session);
+	fclose(session_file);
+}
+
+
+/*
+ * reconnect_server
+ *
+ * Procedure that replaces a connection the server has closed with a new one,
+ * resuming the TLS session.
+ */
+
+static void
+reconnect_server(connector *connection)
+{
+	if (connection->verbosity > 1)
+		fprintf(stderr, "# Reconnecting to %s\n", connection->host);
+
+	if (connection->ssl) {
+		keep_session(connection);
+		SSL_free(connection->ssl);
+		connection->ssl = NULL;
+	}
+
+	close(connection->socket_descriptor);
+	connection->reconnect = false;
+
+	connect_server(connection);
+
+	if (connection->proxy_host)
+		create_tunnel(connection);
+
+	setup_ssl(connection);
+}
+
+
+/*
+ * reserve_response
+ *
+ * Procedure that makes sure the response buffer can hold the specified number
+ * of bytes, at least doubling its capacity each time it grows so a large
+ * response is only copied a handful of times.
+ */
+
+static void
+reserve_response(connector *connection, uint32_t size)
+{
+	uint64_t blocks = connection->response_blocks;
+
+	if (size <= blocks * BUFFER_UNIT_LARGE)
+		return;
+
+	blocks = (blocks ? blocks * 2 : 1);
+
+	if (size > blocks * BUFFER_UNIT_LARGE)
+		blocks = (size + BUFFER_UNIT_LARGE - 1) / BUFFER_UNIT_LARGE;
+
+	if ((connection->response = (char *)realloc(connection->response, blocks * BUFFER_UNIT_LARGE)) == NULL)
+		err(EXIT_FAILURE, "reserve_response: realloc");
+
+	connection->response_blocks = blocks;
+}
+
+
+/*
+ * receive_data
+ *
+ * Function that reads up to size bytes from the server, continuing with the
+ * TLS records that have already arrived so a large slice fills in one call.
+ */
+
+static int
+receive_data(connector *connection, char *buffer, int size)
+{
+	int bytes_read = 0, total_bytes_read = 0;
+
+	if (connection->ssl == NULL)
+		return (read(connection->socket_descriptor, buffer, size));
+
+	do {
+		bytes_read = SSL_read(connection->ssl,
+			buffer + total_bytes_read,
+			size - total_bytes_read);
+
+		if (bytes_read <= 0)
+			return (total_bytes_read > 0 ? total_bytes_read : bytes_read);
+
+		total_bytes_read += bytes_read;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	} while ((total_bytes_read < size) && (SSL_pending(connection->ssl) > 0));
+#else
+	} while ((total_bytes_read < size) && (SSL_has_pending(connection->ssl)));
+#endif
+
+	return (total_bytes_read);
+}
+
+
+/*
+ * transmit_command
+ *
+ * Function that sends a command to the server and returns false if the
+ * connection failed.
+ */
+
+static bool
+transmit_command(connector *connection, char *command, int bytes_to_write)
+{
+	int bytes_sent = 0, total_bytes_sent = 0;
+
+	while (total_bytes_sent < bytes_to_write) {
+		if (connection->ssl)
+			bytes_sent = SSL_write(
+				connection->ssl,
+				command + total_bytes_sent,
+				bytes_to_write - total_bytes_sent);
+		else
+			bytes_sent = write(
+				connection->socket_descriptor,
+				command + total_bytes_sent,
+				bytes_to_write - total_bytes_sent);
+
+		if (bytes_sent <= 0) {
+			if ((bytes_sent < 0) && ((errno == EINTR) || (errno == 0)))
+				continue;
+			else
+				return (false);
+		}
+
+		total_bytes_sent += bytes_sent;
+
+		if (connection->verbosity > 1)
+			fprintf(stderr,
+				"\r==> bytes sent: %d",
+				total_bytes_sent);
+	}
+
+	if (connection->verbosity > 1)
+		fprintf(stderr, "\n");
+
+	return (true);
+}
+
+
+/*
+ * find_header
+ *
+ * Function that returns the value of an HTTP header (matched regardless of
+ * case), or NULL if the header is missing.
+ */
+
+static char *
+find_header(const char *header, int header_size, const char *name)
+{
+	const char *line = header, *end = header + header_size, *value = NULL;
+	size_t      name_length = strlen(name);
+
+	while ((line = memchr(line, '\n', end - line)) != NULL) {
+		line++;
+
+		if ((end - line > (int)name_length) && (strncasecmp(line, name, name_length) == 0) && (line[name_length] == ':')) {
+			for (value = line + name_length + 1; (value < end) && (*value == ' '); value++);
+
+			return ((char *)value);
+		}
+	}
+
+	return (NULL);
+}
+
+
+/*
+ * header_value
+ *
+ * Function that checks whether an HTTP header (matched regardless of case)
+ * holds either of two values.
+ */
+
+static bool
+header_value(const char *header, int header_size, const char *name, const char *value1, const char *value2)
+{
+	const char *value = find_header(header, header_size, name);
+
+	if (value == NULL)
+		return (false);
+
+	return ((strncasecmp(value, value1, strlen(value1)) == 0) || (strncasecmp(value, value2, strlen(value2)) == 0));
+}
+
+
+/*
+ * end_packet
+ *
+ * Procedure that finishes a pkt-line once its payload has been decoded,
+ * keeping it only if it carries pack data.
+ */
+
+static void
+end_packet(connector *connection, struct response_decoder *decoder)
+{
+	char     message[BUFFER_UNIT_SMALL];
+	uint32_t length = decoder->decoded - decoder->packet_start;
+	char    *line = connection->response + decoder->packet_start;
+
+	if (decoder->band == 1)
+		return;
+
+	decoder->decoded = decoder->packet_start;
+
+	if (decoder->band == 2)
+		show_progress(connection, decoder, line, length);
+
+	/* Lines before the packfile section are only checked for its start. */
+
+	if (decoder->band == 0) {
+		if ((length >= 8) && (strncmp(line, "packfile", 8) == 0))
+			decoder->packfile = true;
+		else if ((length >= 4) && (strncmp(line, "ERR ", 4) == 0))
+			decoder->band = 3;
+	}
+
+	if (decoder->band == 3) {
+		snprintf(message, sizeof(message), "%.*s", (int)length, line);
+
+		errc(EXIT_FAILURE, EINVAL,
+			"process_command: server error: %s",
+			message);
+	}
+}
+
+
+/*
+ * show_progress
+ *
+ * Procedure that displays the progress messages the server sends while it
+ * prepares the pack, timing each phase (counting objects, compressing them,
+ * etc.) as it finishes.
+ */
+
+static void
+show_progress(connector *connection, struct response_decoder *decoder, char *message, uint32_t length)
+{
+	struct timespec now;
+	char            update[BUFFER_UNIT_SMALL];
+	uint32_t        start = 0, end = 0, phase_length = 0;
+	double          seconds = 0;
+	bool            tty = isatty(STDERR_FILENO);
+
+	if (connection->verbosity == 0)
+		return;
+
+	/* Each message holds one or more updates ending in \r or \n. */
+
+	for (start = 0; start < length; start = end + 1) {
+		for (end = start; (end < length) && (message[end] != '\r') && (message[end] != '\n'); end++);
+
+		if (end == start)
+			continue;
+
+		snprintf(update, sizeof(update), "%.*s", (int)(end - start), message + start);
+
+		/* Note when a new phase starts. */
+
+		for (phase_length = 0; (update[phase_length]) && (update[phase_length] != ':'); phase_length++);
+
+		if ((strlen(decoder->phase) != phase_length) || (strncmp(decoder->phase, update, phase_length) != 0)) {
+			snprintf(decoder->phase, sizeof(decoder->phase), "%.*s", (int)phase_length, update);
+			clock_gettime(CLOCK_MONOTONIC_FAST, &decoder->phase_start);
+		}
+
+		/* Show finished phases with their times and the rest in place. */
+
+		if ((end < length) && (message[end] == '\n')) {
+			clock_gettime(CLOCK_MONOTONIC_FAST, &now);
+
+			seconds = now.tv_sec - decoder->phase_start.tv_sec +
+				(now.tv_nsec - decoder->phase_start.tv_nsec) * 1e-9;
+
+			fprintf(stderr, "%s# Server: %s (%.1fs)\n",
+				(tty ? "\r\e[0K" : ""),
+				update,
+				seconds);
+
+			decoder->phase[0] = '\0';
+		} else if ((tty) && (connection->verbosity == 1)) {
+			fprintf(stderr, "\r\e[0K# Server: %s\r", update);
+		} else if (connection->verbosity > 1) {
+			fprintf(stderr, "# Server: %s\n", update);
+		}
+	}
+}
+
+
+/*
+ * demux_packets
+ *
+ * Procedure that strips the pkt-line and sideband framing from a span of the
+ * response body, moving the pack data to the end of the decoded data.
+ */
+
+static void
+demux_packets(connector *connection, struct response_decoder *decoder, uint32_t offset, uint32_t size)
+{
+	uint32_t length = 0, bytes = 0;
+
+	while ((size > 0) && (!decoder->flushed)) {
+		/* Collect the length of the next pkt-line. */
+
+		if ((decoder->packet_left == 0) && (decoder->band != -1)) {
+			bytes = 4 - decoder->packet_header_size;
+
+			if (bytes > size)
+				bytes = size;
+
+			memcpy(decoder->packet_header + decoder->packet_header_size,
+				connection->response + offset,
+				bytes);
+
+			decoder->packet_header_size += bytes;
+			offset += bytes;
+			size   -= bytes;
+
+			if (decoder->packet_header_size < 4)
+				break;
+
+			decoder->packet_header[4]   = '\0';
+			decoder->packet_header_size = 0;
+			length = strtol(decoder->packet_header, (char **)NULL, 16);
+
+			/* A flush packet after the pack data ends the response. */
+
+			if (length < 4) {
+				if ((length == 0) && (decoder->packfile))
+					decoder->flushed = true;
+
+				continue;
+			}
+
+			decoder->packet_left  = length - 4;
+			decoder->packet_start = decoder->decoded;
+			decoder->band         = (decoder->packfile ? -1 : 0);
+
+			if (decoder->packet_left == 0) {
+				decoder->band = 0;
+				end_packet(connection, decoder);
+			}
+
+			continue;
+		}
+
+		/* Packets in the packfile section start with their band. */
+
+		if (decoder->band == -1) {
+			decoder->band = (unsigned char)connection->response[offset];
+			offset++;
+			size--;
+
+			if (--decoder->packet_left == 0)
+				end_packet(connection, decoder);
+
+			continue;
+		}
+
+		bytes = (decoder->packet_left < size ? decoder->packet_left : size);
+
+		if (decoder->decoded != offset)
+			memmove(connection->response + decoder->decoded,
+				connection->response + offset,
+				bytes);
+
+		decoder->decoded     += bytes;
+		decoder->packet_left -= bytes;
+		offset += bytes;
+		size   -= bytes;
+
+		if (decoder->packet_left == 0)
+			end_packet(connection, decoder);
+	}
+}
+
+
+/*
+ * decode_response
+ *
+ * Procedure that strips the HTTP chunk markers (and, if requested, the
+ * pkt-line framing) from the bytes received since the last call, moving each
+ * byte of the body straight to its final position.
+ */
+
+static void
+decode_response(connector *connection, struct response_decoder *decoder, uint32_t received)
+{
+	char     *line_end = NULL;
+	uint32_t  bytes = 0;
+
+	while ((decoder->parsed < received) && (!decoder->done)) {
+		bytes = received - decoder->parsed;
+
+		if (decoder->chunked) {
+			/* Skip the line break that ends a chunk (or the body). */
+
+			if (decoder->chunk_end) {
+				if (bytes < 2)
+					break;
+
+				decoder->parsed += 2;
+				decoder->chunk_end = false;
+				decoder->done      = decoder->last_chunk;
+				continue;
+			}
+
+			/* Read the size of the next chunk once its line is complete. */
+
+			if (decoder->chunk_left == 0) {
+				line_end = memchr(connection->response + decoder->parsed, '\n', bytes);
+
+				if (line_end == NULL)
+					break;
+
+				decoder->chunk_left = strtol(connection->response + decoder->parsed, (char **)NULL, 16);
+				decoder->parsed = line_end + 1 - connection->response;
+
+				/* The last chunk is followed by an empty line. */
+
+				if (decoder->chunk_left == 0) {
+					decoder->last_chunk = true;
+					decoder->chunk_end  = true;
+				}
+
+				continue;
+			}
+
+			if (bytes > decoder->chunk_left)
+				bytes = decoder->chunk_left;
+
+			decoder->chunk_left -= bytes;
+			decoder->chunk_end   = (decoder->chunk_left == 0);
+		}
+
+		if (decoder->demux) {
+			demux_packets(connection, decoder, decoder->parsed, bytes);
+		} else {
+			if (decoder->decoded != decoder->parsed)
+				memmove(connection->response + decoder->decoded,
+					connection->response + decoder->parsed,
+					bytes);
+
+			decoder->decoded += bytes;
+		}
+
+		decoder->parsed += bytes;
+	}
+}
+
+
+/*
+ * inflate_response
+ *
+ * Procedure that replaces a gzip or deflate encoded response body with its
+ * decompressed contents.
+ */
+
+static void
+inflate_response(connector *connection, uint32_t size)
+{
+	z_stream  stream;
+	char     *inflated = NULL;
+	uint64_t  capacity = 0;
+	int       result = 0;
+	bool      raw = false;
+
+	capacity = ((uint64_t)size * 4 / BUFFER_UNIT_LARGE + 1) * BUFFER_UNIT_LARGE;
+
+	if ((inflated = (char *)malloc(capacity)) == NULL)
+		err(EXIT_FAILURE, "inflate_response: malloc");
+
+	/*
+	 * Accept zlib and gzip streams, falling back to raw deflate data, which
+	 * some servers send for "deflate".
+	 */
+
+	while (true) {
+		memset(&stream, 0, sizeof(stream));
+
+		if (inflateInit2(&stream, (raw ? -15 : 15 + 32)) != Z_OK)
+			errc(EXIT_FAILURE, EINVAL, "inflate_response: inflateInit2");
+
+		stream.next_in  = (Bytef *)connection->response;
+		stream.avail_in = size;
+
+		do {
+			/* Grow the buffer geometrically as the data expands. */
+
+			if (stream.total_out + 1 >= capacity) {
+				capacity *= 2;
+
+				if ((inflated = (char *)realloc(inflated, capacity)) == NULL)
+					err(EXIT_FAILURE, "inflate_response: realloc");
+			}
+
+			stream.next_out  = (Bytef *)inflated + stream.total_out;
+			stream.avail_out = capacity - stream.total_out - 1;
+
+			result = inflate(&stream, Z_NO_FLUSH);
+		} while (result == Z_OK);
+
+		if ((result == Z_DATA_ERROR) && (!raw) && (stream.total_out == 0)) {
+			inflateEnd(&stream);
+			raw = true;
+			continue;
+		}
+
+		break;
+	}
+
+	if (result != Z_STREAM_END)
+		errc(EXIT_FAILURE, EINVAL,
+			"inflate_response: cannot decompress the response (%d)",
+			result);
+
+	free(connection->response);
+
+	connection->response        = inflated;
+	connection->response_size   = stream.total_out;
+	connection->response_blocks = capacity / BUFFER_UNIT_LARGE;
+	connection->response[connection->response_size] = '\0';
+
+	inflateEnd(&stream);
+}
+
+
+/*
+ * address_command
+ *
+ * Procedure that rebuilds the Host line of a request about to be sent again
+ * after the connection has failed over to a mirror.  The rebuilt request
+ * replaces any previously rebuilt one.
+ */
+
+static void
+address_command(connector *connection, char **command, int *bytes_to_write, char **rebuilt)
+{
+	char *header_end = NULL, *host = NULL, *end = NULL, *request = NULL;
+	char  line[BUFFER_UNIT_SMALL];
+	int   line_size = 0, request_size = 0;
+
+	if ((connection->host_bracketed == NULL) || (strstr(*command, "CONNECT ") == *command))
+		return;
+
+	if ((header_end = strnstr(*command, "\r\n\r\n", *bytes_to_write)) == NULL)
+		return;
+
+	if ((host = strnstr(*command, "\r\nHost: ", header_end - *command)) == NULL)
+		return;
+
+	end       = strstr(host + 2, "\r\n") + 2;
+	line_size = snprintf(line, sizeof(line),
+		"\r\nHost: %s:%d\r\n",
+		connection->host_bracketed,
+		connection->port);
+
+	if ((end - host == line_size) && (strncmp(host, line, line_size) == 0))
+		return;
+
+	request_size = *bytes_to_write - (end - host) + line_size;
+
+	if ((request = (char *)malloc(request_size + 1)) == NULL)
+		err(EXIT_FAILURE, "address_command: malloc");
+
+	memcpy(request, *command, host - *command);
+	memcpy(request + (host - *command), line, line_size);
+	memcpy(request + (host - *command) + line_size, end, *command + *bytes_to_write - end);
+	request[request_size] = '\0';
+
+	free(*rebuilt);
+
+	*command        = request;
+	*rebuilt        = request;
+	*bytes_to_write = request_size;
+}
+
+
+/*
+ * process_command
+ *
+ * Procedure that sends a command to the server and processes the response.
+ */
+
+static void
+process_command(connector *connection, char *command, int bytes_to_write)
+{
+	struct response_decoder decoder;
+	char *marker = NULL, *rebuilt = NULL, *value = NULL;
+	int   bytes_expected = 0, header_size = 0;
+	int   slice = BUFFER_UNIT_SMALL, read_size = 0;
+	int   bytes_read = 0, total_bytes_read = 0, response_code = 0;
+	int   error = 0, outlen = 0, attempt = 0, delay = 0;
+	bool  ok = false, retry = false;
+
+	memset(&decoder, 0, sizeof(decoder));
+
+	/* Leave out a compressed body, which is binary. */
+
+	if (connection->verbosity > 1) {
+		if (((marker = strnstr(command, "\r\n\r\n", bytes_to_write)) != NULL) && (header_value(command, marker - command, "Content-encoding", "gzip", "deflate")))
+			fprintf(stderr, "%.*s\n\n", (int)(marker - command), command);
+		else
+			fprintf(stderr, "%s\n\n", command);
+	}
+
+	/*
+	 * Commands sent through a kept-alive connection are retried once on a
+	 * new connection if the server has closed it in the meantime.  Tunnel
+	 * requests are part of reconnecting, so they are never retried.
+	 */
+
+	retry = (strstr(command, "CONNECT ") != command);
+
+	if ((connection->reconnect) && (retry)) {
+		reconnect_server(connection);
+		address_command(connection, &command, &bytes_to_write, &rebuilt);
+	}
+
+	/* Transmit the command to the server. */
+
+	if (!transmit_command(connection, command, bytes_to_write)) {
+		if (!retry)
+			err(EXIT_FAILURE, "process_command: send");
+
+		reconnect_server(connection);
+		address_command(connection, &command, &bytes_to_write, &rebuilt);
+		retry = false;
+
+		if (!transmit_command(connection, command, bytes_to_write))
+			err(EXIT_FAILURE, "process_command: send");
+	}
+
+	/* Process the response. */
+
+	while (!decoder.done) {
+		/* Don't read past the end of a body of known length. */
+
+		read_size = slice;
+
+		if ((!decoder.chunked) && (header_size) && (bytes_expected - total_bytes_read < read_size))
+			read_size = bytes_expected - total_bytes_read;
+
+		/* Expand the buffer to fit the next slice if needed. */
+
+		if ((uint64_t)total_bytes_read + read_size + 1 > (uint64_t)connection->response_blocks * BUFFER_UNIT_LARGE)
+			reserve_response(connection, total_bytes_read + read_size + 1);
+
+		/* Read the next slice straight into the buffer. */
+
+		bytes_read = receive_data(connection,
+			connection->response + total_bytes_read,
+			read_size);
+
+		/*
+		 * If the server closed the connection before responding, send
+		 * the command again on a new one.
+		 */
+
+		if ((bytes_read <= 0) && (total_bytes_read == 0) && (retry)) {
+			reconnect_server(connection);
+			address_command(connection, &command, &bytes_to_write, &rebuilt);
+			retry = false;
+
+			if (!transmit_command(connection, command, bytes_to_write))
+				err(EXIT_FAILURE, "process_command: send");
+
+			continue;
+		}
+
+		/*
+		 * If the connection drops partway through a response, wait and
+		 * request it again on a new connection, doubling the wait each
+		 * time.  The requests are POSTs, which cannot ask for a byte
+		 * range, so the response starts over from the beginning.
+		 */
+
+		if ((bytes_read <= 0) && (total_bytes_read > 0) && ((ok) || (header_size == 0)) && (attempt < connection->retries) && (strstr(command, "CONNECT ") != command)) {
+			if ((connection->proxy_host == NULL) && (connection->mirror_next < connection->mirrors)) {
+				/* Fail over to the next mirror instead of waiting. */
+
+				if (connection->verbosity)
+					fprintf(stderr,
+						"# Connection to %s lost after %d bytes, switching to %s\n",
+						connection->host,
+						total_bytes_read,
+						connection->mirror[connection->mirror_next]);
+
+				SSL_free(connection->ssl);
+				connection->ssl = NULL;
+
+				use_mirror(connection, connection->mirror[connection->mirror_next++]);
+			} else {
+				delay = (attempt < 6 ? 1 << attempt : 60);
+				attempt++;
+
+				if (connection->verbosity)
+					fprintf(stderr,
+						"# Connection lost after %d bytes, retrying in %d second%s\n",
+						total_bytes_read,
+						delay,
+						(delay == 1 ? "" : "s"));
+
+				sleep(delay);
+			}
+
+			reconnect_server(connection);
+			address_command(connection, &command, &bytes_to_write, &rebuilt);
+
+			if (!transmit_command(connection, command, bytes_to_write))
+				err(EXIT_FAILURE, "process_command: send");
+
+			memset(&decoder, 0, sizeof(decoder));
+			total_bytes_read = 0;
+			bytes_expected   = 0;
+			header_size      = 0;
+			ok               = false;
+
+			continue;
+		}
+
+		if (bytes_read == 0)
+			break;
+
+		if (bytes_read < 0)
+			err(EXIT_FAILURE,
+				"process_command: SSL_read error: %d",
+				SSL_get_error(connection->ssl, error));
+
+		total_bytes_read += bytes_read;
+		connection->response[total_bytes_read] = '\0';
+
+		/* Read larger slices while the data keeps filling them. */
+
+		if ((bytes_read == read_size) && (slice < BUFFER_UNIT_LARGE))
+			slice *= 2;
+
+		if (connection->verbosity > 1)
+			fprintf(stderr, "\r==> "
+				"bytes read: %d\t"
+				"bytes_expected: %d\t"
+				"total_bytes_read: %d",
+				bytes_read,
+				bytes_expected,
+				total_bytes_read);
+
+		while ((connection->verbosity == 1) && (isatty(STDERR_FILENO))) {
+			struct timespec now;
+			static struct timespec then;
+			char buf[80];
+			char htotalb[7];
+			char persec[8];
+			static int last_total;
+			static double sum;
+			double secs;
+			int64_t throughput;
+
+			if (clock_gettime(CLOCK_MONOTONIC_FAST, &now) == -1)
+				err(EXIT_FAILURE,
+					"process_command: clock_gettime");
+
+			if (then.tv_sec == 0)
+				then = now, secs = 1, sum = 1;
+			else {
+				secs = now.tv_sec - then.tv_sec +
+					(now.tv_nsec - then.tv_nsec) * 1e-9;
+
+				if (1 > secs)
+					break;
+				else
+					sum += secs;
+			}
+
+			throughput = ((total_bytes_read - last_total) / secs);
+
+			humanize_number(htotalb, sizeof(htotalb),
+				(int64_t)total_bytes_read,
+				"B",
+				HN_AUTOSCALE,
+				HN_DECIMAL | HN_DIVISOR_1000);
+
+			humanize_number(persec, sizeof(persec),
+				throughput,
+				"B",
+				HN_AUTOSCALE,
+				HN_DECIMAL | HN_DIVISOR_1000);
+
+			snprintf(buf, sizeof(buf) - 1,
+				"  %s in %dm%02ds, %s/s now",
+				htotalb,
+				(int)(sum / 60),
+				(int)sum % 60,
+				persec);
+
+			if (isatty(STDERR_FILENO))
+				outlen = fprintf(stderr, "%-*s\r", outlen, buf) - 1;
+
+			last_total = total_bytes_read;
+			then = now;
+			break;
+		}
+
+		/* Find the boundary between the header and the data. */
+
+		if (header_size == 0) {
+			if ((marker = strnstr(connection->response, "\r\n\r\n", total_bytes_read)) == NULL)
+				continue;
+
+			header_size    = marker - connection->response + 4;
+			bytes_expected = header_size;
+
+			/* Check the response code. */
+
+			if (strstr(connection->response, "HTTP/1.") == connection->response) {
+				response_code = strtol(strchr(connection->response, ' ') + 1, (char **)NULL, 10);
+
+				if (response_code == 200)
+					ok = true;
+
+				if ((connection->proxy_host) && (response_code >= 200) && (response_code < 300))
+					ok = true;
+			}
+
+			/* Reconnect before the next command if the server is closing. */
+
+			if (header_value(connection->response, header_size, "Connection", "close", "close"))
+				connection->reconnect = true;
+
+			/* Successful CONNECT responses do not contain a body. */
+
+			if ((strstr(command, "CONNECT ") == command) && (ok)) {
+				decoder.done = true;
+				break;
+			}
+
+			/*
+			 * Decode the body over the header, keeping the header in
+			 * front of the body of an error response.
+			 */
+
+			decoder.chunked    = true;
+			decoder.compressed = ((ok) && (header_value(connection->response, header_size, "Content-Encoding", "gzip", "deflate")));
+			decoder.demux      = ((ok) && (connection->demux) && (!decoder.compressed));
+			decoder.parsed  = header_size;
+			decoder.decoded = (ok ? 0 : header_size);
+
+			if ((value = find_header(connection->response, header_size, "Content-Length")) != NULL) {
+				bytes_expected += strtol(value, (char **)NULL, 10);
+				decoder.chunked = false;
+
+				/* Reserve room for the whole body up front. */
+
+				if ((uint64_t)bytes_expected + 1 > (uint64_t)connection->response_blocks * BUFFER_UNIT_LARGE)
+					reserve_response(connection, bytes_expected + 1);
+			}
+		}
+
+		/* Strip the framing from the bytes that have arrived. */
+
+		decode_response(connection, &decoder, total_bytes_read);
+
+		if ((!decoder.chunked) && (total_bytes_read >= bytes_expected))
+			decoder.done = true;
+	}
+
+	if ((connection->verbosity) && (isatty(STDERR_FILENO)))
+		fprintf(stderr, "\r\e[0K\r");
+
+	if (!ok)
+		errc(EXIT_FAILURE, EINVAL,
+			"process_command: read failure:\n%s\n",
+			connection->response);
+
+	if (!decoder.done)
+		errc(EXIT_FAILURE, EPIPE,
+			"process_command: connection closed after %d bytes of the response",
+			total_bytes_read);
+
+	connection->response_size = decoder.decoded;
+	connection->response[connection->response_size] = '\0';
+
+	/*
+	 * A compressed body can only be inflated once it is complete, then the
+	 * pack data is demultiplexed from the result.
+	 */
+
+	if (decoder.compressed) {
+		inflate_response(connection, decoder.decoded);
+
+		if (connection->demux) {
+			memset(&decoder, 0, sizeof(decoder));
+			decoder.demux = true;
+			decode_response(connection, &decoder, connection->response_size);
+
+			connection->response_size = decoder.decoded;
+		}
+	}
+
+	if ((connection->demux) && (!decoder.packfile))
+		errc(EXIT_FAILURE, EFTYPE,
+			"process_command: no pack data in the response");
+
+	free(rebuilt);
+}
+
+
+/*
+ * compress_request
+ *
+ * Function that gzips a request body.
+ */
+
+static char *
+compress_request(char *data, size_t data_size, size_t *compressed_size)
+{
+	z_stream  stream;
+	char     *compressed = NULL;
+	uLong     bound = 0;
+
+	memset(&stream, 0, sizeof(stream));
+
+	if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		errc(EXIT_FAILURE, EINVAL, "compress_request: deflateInit2");
+
+	bound = deflateBound(&stream, data_size);
+
+	if ((compressed = (char *)malloc(bound)) == NULL)
+		err(EXIT_FAILURE, "compress_request: malloc");
+
+	stream.next_in   = (Bytef *)data;
+	stream.avail_in  = data_size;
+	stream.next_out  = (Bytef *)compressed;
+	stream.avail_out = bound;
+
+	if (deflate(&stream, Z_FINISH) != Z_STREAM_END)
+		errc(EXIT_FAILURE, EINVAL, "compress_request: deflate");
+
+	*compressed_size = stream.total_out;
+	deflateEnd(&stream);
+
+	return (compressed);
+}
+
+
+/*
+ * send_command
+ *
+ * Function that constructs the command to the fetch the full pack data.
+ */
+
+static void
+send_command(connector *connection, char *want)
+{
+	char   *command = NULL, *body = NULL;
+	size_t  want_size = 0, body_size = 0;
+	int     header_size = 0;
+	bool    compressed = false;
+
+	want_size = strlen(want);
+	body      = want;
+	body_size = want_size;
+
+	/* Compress large requests, like a long list of files to repair. */
+
+	if (want_size > GZIP_REQUEST_SIZE) {
+		body       = compress_request(want, want_size, &body_size);
+		compressed = true;
+	}
+
+	if ((command = (char *)malloc(BUFFER_UNIT_SMALL + body_size)) == NULL)
+		err(EXIT_FAILURE, "send_command: malloc");
+
+	header_size = snprintf(command,
+		BUFFER_UNIT_SMALL,
+		"POST %s/git-upload-pack HTTP/1.1\r\n"
+		"Host: %s:%d\r\n"
+		"User-Agent: gitup/%s\r\n"
+		"Accept-encoding: deflate, gzip\r\n"
+		"Content-type: application/x-git-upload-pack-request\r\n"
+		"%s"
+		"Accept: application/x-git-upload-pack-result\r\n"
+		"Git-Protocol: version=2\r\n"
+		"Content-length: %zu\r\n"
+		"\r\n",
+		connection->repository_path,
+		connection->host_bracketed,
+		connection->port,
+		GITUP_VERSION,
+		(compressed ? "Content-encoding: gzip\r\n" : ""),
+		body_size);
+
+	memcpy(command + header_size, body, body_size);
+	command[header_size + body_size] = '\0';
+
+	process_command(connection, command, header_size + body_size);
+
+	if (compressed)
+		free(body);
+
+	free(command);
+}
+
+
+/*
+ * build_clone_command
+ *
+ * Function that constructs and executes the command to the fetch the shallow
+ * pack data.
+ */
+
+static char *
+build_clone_command(connector *connection)
+{
+	char *command = NULL;
+
+	if ((command = (char *)malloc(BUFFER_UNIT_SMALL)) == NULL)
+		err(EXIT_FAILURE, "build_clone_command: malloc");
+
+	snprintf(command,
+		BUFFER_UNIT_SMALL,
+		"0011command=fetch0001"
+		"%s"
+		"000dofs-delta"
+		"%s"
+		"0034shallow %s"
+		"0032want %s\n"
+		"0009done\n0000",
+		(connection->verbosity ? "" : "000fno-progress"),
+		(connection->filter ? "0014filter blob:none" : ""),
+		connection->want,
+		connection->want);
+
+	return (command);
+}
+
+
+/*
+ * build_pull_command
+ *
+ * Function that constructs and executes the command to the fetch the
+ * incremental pack data.
+ */
+
+static char *
+build_pull_command(connector *connection)
+{
+	char *command = NULL;
+
+	if ((command = (char *)malloc(BUFFER_UNIT_SMALL)) == NULL)
+		err(EXIT_FAILURE, "build_pull_command: malloc");
+
+	/*
+	 * When resuming an interrupted run, some of the files a thin pack
+	 * would use as delta bases may already have been replaced.
+	 */
+
+	snprintf(command,
+		BUFFER_UNIT_SMALL,
+		"0011command=fetch0001"
+		"%s"
+		"%s"
+		"000dofs-delta"
+		"%s"
+		"0034shallow %s"
+		"0034shallow %s"
+		"000cdeepen 1"
+		"0032want %s\n"
+		"0032have %s\n"
+		"0009done\n0000",
+		(connection->resume ? "" : "000dthin-pack"),
+		(connection->verbosity ? "" : "000fno-progress"),
+		(connection->filter ? "0014filter blob:none" : ""),
+		connection->want,
+		connection->have,
+		connection->want,
+		connection->have);
+
+	return (command);
+}
+
+
+/*
+ * build_repair_command
+ *
+ * Procedure that compares the local repository tree with the data saved from
+ * the last run to see if anything has been modified.  Blobs that are intact
+ * elsewhere in the local tree are loaded from there instead of requested.
+ */
+
+static char *
+build_repair_command(connector *connection)
+{
+	struct file_node *find = NULL, *found = NULL, *pending = NULL, *local = NULL;
+	char             *command = NULL, *want = NULL, line[BUFFER_UNIT_SMALL];
+	const char       *message[2] = { "is missing.", "has been modified." };
+	uint32_t          want_size = 0;
+
+	RB_FOREACH(find, Tree_Remote_Path, &Remote_Path) {
+		if (exclude_file(connection, find->path))
+			continue;
+
+		found = RB_FIND(Tree_Local_Path, &Local_Path, find);
+
+		/* Files written by an interrupted run are intact. */
+
+		if ((found != NULL) && (connection->resume)) {
+			pending = RB_FIND(Tree_Pending_Path, &Pending_Path, find);
+
+			if ((pending != NULL) && (strncmp(found->hash, pending->hash, 40) == 0))
+				continue;
+		}
+
+		if ((found == NULL) || ((strncmp(found->hash, find->hash, 40) != 0) && (!ignore_file(connection, find->path)))) {
+			if (connection->verbosity)
+				fprintf(stderr,
+					" ! %s %s\n",
+					find->path,
+					message[found ? 1 : 0]);
+
+			if (S_ISREG(find->mode)) {
+				local = RB_FIND(Tree_Local_Hash, &Local_Hash, find);
+
+				if ((local != NULL) && (S_ISREG(local->mode)) && (!ignore_file(connection, local->path))) {
+					load_object(connection, find->hash, local->path);
+					connection->local_repairs++;
+					continue;
+				}
+			}
+
+			snprintf(line, sizeof(line),
+				"0032want %s\n",
+				find->hash);
+
+			append(&want, &want_size, line, strlen(line));
+		}
+	}
+
+	if (want_size == 0)
+		return (NULL);
+
+	if (want_size > 3276800)
+		errc(EXIT_FAILURE, E2BIG,
+			"build_repair_command: There are too many files to "
+			"repair -- please re-clone the repository");
+
+	if ((command = (char *)malloc(BUFFER_UNIT_SMALL + want_size)) == NULL)
+		err(EXIT_FAILURE, "build_repair_command: malloc");
+
+	snprintf(command,
+		BUFFER_UNIT_SMALL + want_size,
+		"0011command=fetch0001"
+		"000dthin-pack"
+		"%s"
+		"000dofs-delta"
+		"%s"
+		"000cdeepen 1"
+		"0009done\n0000",
+		(connection->verbosity ? "" : "000fno-progress"),
+		want);
+
+	return (command);
+}
+
+
+/*
+ * get_commit_details
+ */
+
+static void
+get_commit_details(connector *connection)
+{
+	char       command[BUFFER_UNIT_SMALL], ref[BUFFER_UNIT_SMALL], want[41];
+	char       peeled[BUFFER_UNIT_SMALL];
+	char      *position = NULL;
+	time_t     current;
+	struct tm  now;
+	int        tries = 2, year = 0, quarter = 0;
+	uint16_t   length = 0;
+	bool       detached = (connection->want != NULL ? true : false);
+
+	/*
+	 * Sections that share a repository only need to list its refs once per
+	 * run.
+	 */
+
+	if ((connection->refs != NULL) && (strcmp(connection->refs_path, connection->repository_path) == 0)) {
+		reserve_response(connection, connection->refs_size + 1);
+
+		memcpy(connection->response, connection->refs, connection->refs_size);
+		connection->response_size = connection->refs_size;
+		connection->response[connection->response_size] = '\0';
+	} else {
+		/* Send the initial info/refs command. */
+
+		snprintf(command,
+			BUFFER_UNIT_SMALL,
+			"GET %s/info/refs?service=git-upload-pack HTTP/1.1\r\n"
+			"Host: %s:%d\r\n"
+			"User-Agent: gitup/%s\r\n"
+			"Accept-encoding: deflate, gzip\r\n"
+			"Git-Protocol: version=2\r\n"
+			"\r\n",
+			connection->repository_path,
+			connection->host_bracketed,
+			connection->port,
+			GITUP_VERSION);
+
+		process_command(connection, command, strlen(command));
+
+		if (connection->verbosity > 1)
+			printf("%s\n", connection->response);
+
+		/* Make sure the server supports the version 2 protocol. */
+
+		if (strnstr(connection->response, "version 2", connection->response_size) == NULL)
+			errc(EXIT_FAILURE, EPROTONOSUPPORT,
+				"%s does not support the version 2 wire protocol",
+				connection->host);
+
+		if ((position = strnstr(connection->response, "fetch=", connection->response_size)) != NULL)
+			connection->can_filter = (strnstr(position, "filter", strcspn(position, "\n")) != NULL);
+
+		/* Fetch the list of refs. */
+
+		snprintf(command,
+			BUFFER_UNIT_SMALL,
+			"0014command=ls-refs\n"
+			"0016object-format=sha1"
+			"0001"
+			"0009peel\n"
+			"000csymrefs\n"
+			"0014ref-prefix HEAD\n"
+			"001bref-prefix refs/heads/\n"
+			"001aref-prefix refs/tags/\n"
+			"0000");
+
+		send_command(connection, command);
+
+		if (connection->verbosity > 1)
+			printf("%s\n", connection->response);
+
+		free(connection->refs);
+		free(connection->refs_path);
+
+		if ((connection->refs = (char *)malloc(connection->response_size)) == NULL)
+			err(EXIT_FAILURE, "get_commit_details: malloc");
+
+		memcpy(connection->refs, connection->response, connection->response_size);
+		connection->refs_size = connection->response_size;
+		connection->refs_path = strdup(connection->repository_path);
+	}
+
+	/*
+	 * Have the server leave the blobs out of the pack in partial clone mode
+	 * or when some paths are excluded, so only the blobs that are needed
+	 * get requested.
+	 */
+
+	if ((connection->excludes > 0) || (connection->partial_clone)) {
+		connection->filter = connection->can_filter;
+
+		if ((connection->filter == false) && (connection->verbosity))
+			fprintf(stderr,
+				" ! %s does not support filtering, all blobs will be downloaded\n",
+				connection->host);
+	}
+
+	/* Extract the "want" checksum. */
+
+	want[0] = '\0';
+
+	while ((tries-- > 0) && (want[0] == '\0') && (detached == false)) {
+		if (strncmp(connection->branch, "quarterly", 9) == 0) {
+			/*
+			 * If the current calendar quarter doesn't exist, try
+			 * the previous one.
+			 */
+
+			current = time(NULL);
+			now     = *localtime(&current);
+			year    = 1900 + now.tm_year + ((tries == 0) && (now.tm_mon < 3) ? -1 : 0);
+			quarter = ((now.tm_mon / 3) + (tries == 0 ? 3 : 0)) % 4 + 1;
+
+			snprintf(ref, BUFFER_UNIT_SMALL, " refs/heads/%04dQ%d", year, quarter);
+		} else if (connection->tag != NULL) {
+			snprintf(ref, BUFFER_UNIT_SMALL, " refs/tags/%s", connection->tag);
+		} else {
+			snprintf(ref, BUFFER_UNIT_SMALL, " refs/heads/%s", connection->branch);
+		}
+
+		/*
+		 * Look for the "want" in peeled references first, then look
+		 * before the ref.
+		 */
+
+		snprintf(peeled, sizeof(peeled), "%s peeled:", ref);
+
+		if ((position = strstr(connection->response, peeled)) != NULL)
+			memcpy(want, position + strlen(peeled), 40);
+		else if ((position = strstr(connection->response, ref)) != NULL)
+			memcpy(want, position - 40, 40);
+		else if (tries == 0)
+			errc(EXIT_FAILURE, EINVAL,
+				"get_commit_details:%s doesn't exist in %s",
+				ref,
+				connection->repository_path);
+	}
+
+	/* Retain the name of the quarterly branch being used. */
+
+	if (strncmp(connection->branch, "quarterly", 9) == 0) {
+		free(connection->branch);
+		connection->branch = strdup(ref + 12);
+	}
+
+	if (want[0] != '\0') {
+		if (connection->want == NULL)
+			if ((connection->want = (char *)malloc(41)) == NULL)
+				err(EXIT_FAILURE, "get_commit_details: malloc");
+
+		memcpy(connection->want, want, 40);
+		connection->want[40] = '\0';
+
+		if (connection->verbosity)
+			fprintf(stderr, "# Want: %s\n", connection->want);
+	}
+
+	/*
+	 * Because there is no way to lookup commit history, if a want commit
+	 * is specified, change the branch to (detached).
+	 */
+
+	if (detached == true) {
+		free(connection->branch);
+		connection->branch = strdup("(detached)");
+	}
+
+	if ((connection->verbosity) && (connection->tag == NULL))
+		fprintf(stderr, "# Branch: %s\n", connection->branch);
+
+	/* Create the pack file name. */
+
+	if (connection->keep_pack_file == true) {
+		length = strlen(connection->section) + 47;
+
+		connection->pack_data_file = (char *)malloc(length + 1);
+
+		if (connection->pack_data_file == NULL)
+			err(EXIT_FAILURE, "get_commit_details: malloc");
+
+		snprintf(connection->pack_data_file, length,
+			"%s-%s.pack",
+			connection->section,
+			connection->want);
+
+		if (connection->verbosity)
+			fprintf(stderr,
+				"# Saving pack file: %s\n",
+				connection->pack_data_file);
+	}
+}
+
+
+/*
+ * load_pack
+ *
+ * Procedure that loads a local copy of the pack data or fetches it from
+ * the server.
+ */
+
+static void
+load_pack(connector *connection)
+{
+	char hash[20];
+	int  pack_size = 0;
+
+	load_file(connection->pack_data_file,
+		&connection->response,
+		&connection->response_size);
+
+	pack_size = connection->response_size - 20;
+
+	/* Verify the pack data checksum. */
+
+	SHA1((uint8_t *)connection->response, pack_size, (uint8_t *)hash);
+
+	if (memcmp(connection->response + pack_size, hash, 20) != 0)
+		errc(EXIT_FAILURE, EAUTH,
+			"load_pack: pack checksum mismatch -- "
+			"expected: %s, received: %s",
+			legible_hash(connection->response + pack_size),
+			legible_hash(hash));
+
+	/* Process the pack data. */
+
+	unpack_objects(connection);
+
+	free(connection->response);
+	connection->response        = NULL;
+	connection->response_size   = 0;
+	connection->response_blocks = 0;
+}
+
+
+/*
+ * fetch_blobs
+ *
+ * Procedure that requests the blobs a filtered pack left out and saves the
+ * new and modified files in batches, writing each batch while the next one
+ * is downloaded.
+ */
+
+static void
+fetch_blobs(connector *connection)
+{
+	struct object_node  find_object;
+	struct file_node   *file = NULL, *next_file = NULL, *batch = NULL;
+	char               *command = NULL, *want = NULL, line[BUFFER_UNIT_SMALL];
+	uint32_t            want_size = 0, wants = 0;
+	pthread_t           writer;
+	bool                keep_pack_file = connection->keep_pack_file, writing = false;
+	bool                resumable = connection->resumable;
+	int                 error = 0;
+
+	/* Only the filtered pack can be reused, so don't save the batches. */
+
+	connection->keep_pack_file = false;
+	connection->resumable      = false;
+	batch = RB_MIN(Tree_Remote_Path, &Remote_Path);
+
+	RB_FOREACH_SAFE(file, Tree_Remote_Path, &Remote_Path, next_file) {
+		find_object.hash = file->hash;
+
+		if ((file->save) && (!S_ISDIR(file->mode)) && (RB_FIND(Tree_Objects, &Objects, &find_object) == NULL)) {
+			snprintf(line, sizeof(line),
+				"0032want %s\n",
+				file->hash);
+
+			append(&want, &want_size, line, strlen(line));
+			wants++;
+		}
+
+		if ((wants < BLOB_BATCH_SIZE) && (next_file != NULL))
+			continue;
+
+		/* Request the batch while the last one is being written. */
+
+		if (want_size > 0) {
+			if ((command = (char *)malloc(BUFFER_UNIT_SMALL + want_size)) == NULL)
+				err(EXIT_FAILURE, "fetch_blobs: malloc");
+
+			snprintf(command,
+				BUFFER_UNIT_SMALL + want_size,
+				"0011command=fetch0001"
+				"%s"
+				"000dofs-delta"
+				"%s"
+				"0009done\n0000",
+				(connection->verbosity ? "" : "000fno-progress"),
+				want);
+
+			fetch_pack(connection, command);
+			apply_deltas(connection);
+
+			free(want);
+			want      = NULL;
+			want_size = 0;
+			wants     = 0;
+		}
+
+		if (writing) {
+			pthread_join(writer, NULL);
+			writing = false;
+		}
+
+		/* Queue the files in the batch and start writing them. */
+
+		for (; batch != next_file; batch = RB_NEXT(Tree_Remote_Path, &Remote_Path, batch))
+			if (batch->save)
+				save_remote_file(connection, batch);
+
+		if ((connection->write_jobs > 0) || (connection->link_jobs > 0)) {
+			if ((error = pthread_create(&writer, NULL, flush_worker, connection)) != 0)
+				errc(EXIT_FAILURE, error, "fetch_blobs: pthread_create");
+
+			writing = true;
+		}
+	}
+
+	if (writing)
+		pthread_join(writer, NULL);
+
+	connection->keep_pack_file = keep_pack_file;
+	connection->resumable      = resumable;
+}
+
+
+/*
+ * fetch_pack
+ *
+ * Procedure that fetches pack data from the server.
+ */
+
+static void
+fetch_pack(connector *connection, char *command)
+{
+	char *id = NULL, hash[20];
+	int   pack_size = 0;
+	bool  thin = false;
+
+	/* Use the pack data cached for the same request. */
+
+	if ((connection->resumable) && (connection->pack_cache_size > 0)) {
+		id = pack_cache_id(command, &thin);
+
+		if (load_cached_pack(connection, id)) {
+			unpack_objects(connection);
+			free(command);
+			free(id);
+
+			return;
+		}
+	}
+
+	/*
+	 * Request the pack data, which arrives with the pkt-line and sideband
+	 * framing already stripped.
+	 */
+
+	connection->demux = true;
+	send_command(connection, command);
+	connection->demux = false;
+
+	if ((connection->response_size < 32) || (memcmp(connection->response, "PACK", 4) != 0))
+		errc(EXIT_FAILURE, EFTYPE,
+			"fetch_pack: malformed pack data");
+
+	pack_size = connection->response_size - 20;
+
+	/* Verify the pack data checksum. */
+
+	SHA1((uint8_t *)connection->response, pack_size, (uint8_t *)hash);
+
+	if (memcmp(connection->response + pack_size, hash, 20) != 0)
+		errc(EXIT_FAILURE, EAUTH,
+			"fetch_pack: pack checksum mismatch -- "
+			"expected: %s, received: %s",
+			legible_hash(connection->response + pack_size),
+			legible_hash(hash));
+
+	/* Save the pack data. */
+
+	if (connection->keep_pack_file == true)
+		save_file(connection->pack_data_file,
+			0644,
+			connection->response,
+			connection->response_size,
+			0,
+			0);
+
+	if (id != NULL)
+		save_cached_pack(connection, id, thin);
+
+	/* Process the pack data. */
+
+	unpack_objects(connection);
+
+	free(command);
+	free(id);
+}
+
+
+/*
+ * pack_cache_id
+ *
+ * Function that returns the checksum identifying a fetch request by its have
+ * and want lines, leaving out the thin-pack capability so a resumed run (which
+ * never asks for one) can recognize its request, and the progress setting,
+ * which doesn't change the pack.
+ */
+
+static char *
+pack_cache_id(char *command, bool *thin)
+{
+	char *copy = NULL, *temp = NULL, hash[20];
+
+	copy = strdup(command);
+
+	if ((temp = strstr(copy, "000dthin-pack")) != NULL) {
+		memmove(temp, temp + 13, strlen(temp + 13) + 1);
+		*thin = true;
+	}
+
+	if ((temp = strstr(copy, "000fno-progress")) != NULL)
+		memmove(temp, temp + 15, strlen(temp + 15) + 1);
+
+	SHA1((uint8_t *)copy, strlen(copy), (uint8_t *)hash);
+	free(copy);
+
+	return (legible_hash(hash));
+}
+
+
+/*
+ * trim_cache
+ *
+ * Procedure that removes the least recently used files in a cache directory
+ * until the files it holds fit in the specified number of bytes.  The file
+ * just added (if any) is kept, as are the lock and temporary files.
+ */
+
+static void
+trim_cache(const char *path, uint64_t limit, const char *keep)
+{
+	struct dirent  *entry = NULL;
+	struct stat     file;
+	DIR            *directory = NULL;
+	char          **name = NULL, full_path[BUFFER_UNIT_SMALL];
+	time_t         *used = NULL;
+	off_t          *size = NULL;
+	uint64_t        total = 0;
+	int             entries = 0, x = 0, oldest = 0;
+
+	if ((directory = opendir(path)) == NULL)
+		return;
+
+	while ((entry = readdir(directory)) != NULL) {
+		if ((entry->d_name[0] == '.') || (strstr(entry->d_name, ".lock")) || (strstr(entry->d_name, ".new")))
+			continue;
+
+		snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
+
+		if ((stat(full_path, &file) == -1) || (!S_ISREG(file.st_mode)))
+			continue;
+
+		total += file.st_size;
+
+		if ((keep) && (strcmp(full_path, keep) == 0))
+			continue;
+
+		if (((name = (char **)realloc(name, (entries + 1) * sizeof(char *))) == NULL)
+			|| ((used = (time_t *)realloc(used, (entries + 1) * sizeof(time_t))) == NULL)
+			|| ((size = (off_t *)realloc(size, (entries + 1) * sizeof(off_t))) == NULL))
+			err(EXIT_FAILURE, "trim_cache: realloc");
+
+		name[entries] = strdup(full_path);
+		used[entries] = file.st_mtime;
+		size[entries] = file.st_size;
+		entries++;
+	}
+
+	closedir(directory);
+
+	/* Remove the file used longest ago until the rest fit. */
+
+	while (total > limit) {
+		for (oldest = -1, x = 0; x < entries; x++)
+			if ((name[x]) && ((oldest == -1) || (used[x] < used[oldest])))
+				oldest = x;
+
+		if (oldest == -1)
+			break;
+
+		unlink(name[oldest]);
+		total -= size[oldest];
+
+		free(name[oldest]);
+		name[oldest] = NULL;
+	}
+
+	for (x = 0; x < entries; x++)
+		free(name[x]);
+
+	free(name);
+	free(used);
+	free(size);
+}
+
+
+/*
+ * load_cached_pack
+ *
+ * Function that loads the pack data cached for a request, returning false if
+ * there is none (or it cannot be used).
+ */
+
+static bool
+load_cached_pack(connector *connection, char *id)
+{
+	char  pack_file[BUFFER_UNIT_SMALL], hash[20];
+	int   pack_size = 0;
+
+	/*
+	 * A thin pack's deltas are based on the files a resumed run may already
+	 * have replaced, so only a full pack can be used in that case.
+	 */
+
+	snprintf(pack_file, sizeof(pack_file), "%s/.packs/%s.pack", connection->path_work, id);
+
+	if ((!path_exists(pack_file)) && (!connection->resume))
+		snprintf(pack_file, sizeof(pack_file), "%s/.packs/%s.thin.pack", connection->path_work, id);
+
+	if (!path_exists(pack_file))
+		return (false);
+
+	free(connection->response);
+	connection->response        = NULL;
+	connection->response_size   = 0;
+	connection->response_blocks = 0;
+
+	load_file(pack_file, &connection->response, &connection->response_size);
+
+	pack_size = connection->response_size - 20;
+
+	if (pack_size > 0)
+		SHA1((uint8_t *)connection->response, pack_size, (uint8_t *)hash);
+
+	if ((pack_size <= 0) || (memcmp(connection->response + pack_size, hash, 20) != 0)) {
+		unlink(pack_file);
+		return (false);
+	}
+
+	/* Mark the pack as recently used. */
+
+	utimes(pack_file, NULL);
+
+	if (connection->verbosity)
+		fprintf(stderr, "# Using the cached pack data\n");
+
+	return (true);
+}
+
+
+/*
+ * save_cached_pack
+ *
+ * Procedure that adds the pack data to the cache in the work directory, so a
+ * repeated request (after an interrupted run, or from another section or host
+ * sharing the work directory) does not have to download it again.
+ */
+
+static void
+save_cached_pack(connector *connection, char *id, bool thin)
+{
+	char cache[BUFFER_UNIT_SMALL], pack_file[BUFFER_UNIT_SMALL];
+
+	snprintf(cache, sizeof(cache), "%s/.packs", connection->path_work);
+	snprintf(pack_file, sizeof(pack_file), "%s/%s%s.pack", cache, id, (thin ? ".thin" : ""));
+
+	if (!path_exists(cache))
+		make_path(cache, 0700);
+
+	save_cached_response(pack_file, connection->response, connection->response_size);
+	trim_cache(cache, (uint64_t)connection->pack_cache_size * 1048576, pack_file);
+}
+
+
+/*
+ * store_object
+ *
+ * Procedure that creates a new object and stores it in the array and
+ * lookup tree.
+ */
+
+static void
+store_object(connector *connection, int type, char *buffer, int buffer_size, int pack_offset, int index_delta, char *ref_delta_hash)
+{
+	struct object_node *object = NULL, find;
+	char               *hash = NULL;
+
+	hash = calculate_object_hash(buffer, buffer_size, type);
+
+	/* Check to make sure the object doesn't already exist. */
+
+	find.hash = hash;
+	object    = RB_FIND(Tree_Objects, &Objects, &find);
+
+	if ((object != NULL) && (connection->repair == false)) {
+		free(hash);
+	} else {
+		/* Extend the array if needed, create a new node and add it. */
+
+		if (connection->objects % BUFFER_UNIT_SMALL == 0)
+			if ((connection->object = (struct object_node **)realloc(connection->object, (connection->objects + BUFFER_UNIT_SMALL) * sizeof(struct object_node *))) == NULL)
+				err(EXIT_FAILURE, "store_object: realloc");
+
+		object = (struct object_node *)malloc(sizeof(struct object_node));
+
+		if (object == NULL)
+			err(EXIT_FAILURE, "store_object: malloc");
+
+		object->index          = connection->objects;
+		object->type           = type;
+		object->hash           = hash;
+		object->pack_offset    = pack_offset;
+		object->index_delta    = index_delta;
+		object->ref_delta_hash = (ref_delta_hash ? legible_hash(ref_delta_hash) : NULL);
+		object->buffer         = buffer;
+		object->buffer_size    = buffer_size;
+		object->can_free       = true;
+		object->file_offset    = -1;
+
+		if (connection->verbosity > 1)
+			fprintf(stdout,
+				"###### %05d-%d\t%d\t%u\t%s\t%d\t%s\n",
+				object->index,
+				object->type,
+				object->pack_offset,
+				object->buffer_size,
+				object->hash,
+				object->index_delta,
+				object->ref_delta_hash);
+
+		if (type < 6)
+			RB_INSERT(Tree_Objects, &Objects, object);
+
+		connection->object[connection->objects++] = object;
+	}
+}
+
+
+/*
+ * unpack_objects
+ *
+ * Procedure that extracts all of the objects from the pack data.
+ */
+
+static void
+unpack_objects(connector *connection)
+{
+	int            buffer_size = 0, total_objects = 0, object_type = 0;
+	int            index_delta = 0, stream_code = 0, version = 0;
+	int            stream_bytes = 0, x = 0;
+	char          *buffer = NULL, *ref_delta_hash = NULL;
+	char           remote_files_tmp[BUFFER_UNIT_SMALL];
+	uint32_t       file_size = 0, file_bits = 0, pack_offset = 0;
+	uint32_t       lookup_offset = 0, position = 4, nobj_old = 0;
+	unsigned char  zlib_out[16384];
+
+	/*
+	 * Setup the temporary object store file, once per run, since the
+	 * objects of every pack unpacked (repairs, blob batches) stay in it.
+	 */
+
+	if ((connection->low_memory) && (connection->back_store == -1)) {
+		snprintf(remote_files_tmp, BUFFER_UNIT_SMALL,
+			"%s.tmp",
+			connection->remote_data_file);
+
+		connection->back_store = open(remote_files_tmp,
+			O_RDWR | O_CREAT | O_TRUNC,
+			0600);
+
+		if (connection->back_store == -1)
+			err(EXIT_FAILURE,
+				"unpack_objects: object file write failure %s",
+				remote_files_tmp);
+
+		unlink(remote_files_tmp);   /* unlink now / dealocate when exit */
+		connection->back_store_size = 0;
+	}
+
+	/* Check the pack version number. */
+
+	version   = (unsigned char)connection->response[position + 3];
+	position += 4;
+
+	if (version != 2)
+		errc(EXIT_FAILURE, EFTYPE,
+			"unpack_objects: pack version %d not supported",
+			version);
+
+	/* Determine the number of objects in the pack data. */
+
+	for (x = 0; x < 4; x++, position++)
+		total_objects = (total_objects << 8) + (unsigned char)connection->response[position];
+
+	if (connection->verbosity > 1)
+		fprintf(stderr,
+			"\npack version: %d, total_objects: %d, pack_size: %d\n\n",
+			version,
+			total_objects,
+			connection->response_size);
+
+	/* Unpack the objects. */
+
+	while ((position < connection->response_size) && (total_objects-- > 0)) {
+		object_type    = (unsigned char)connection->response[position] >> 4 & 0x07;
+		pack_offset    = position;
+		index_delta    = 0;
+		file_size      = 0;
+		stream_bytes   = 0;
+		ref_delta_hash = NULL;
+
+		/* Extract the file size. */
+
+		do {
+			file_bits  = connection->response[position] & (stream_bytes == 0 ? 0x0F : 0x7F);
+			file_size += (stream_bytes == 0 ? file_bits : file_bits << (4 + 7 * (stream_bytes - 1)));
+			stream_bytes++;
+		}
+		while (connection->response[position++] & 0x80);
+
+		/* Find the object->index referred to by the ofs-delta. */
+
+		if (object_type == 6) {
+			lookup_offset = 0;
+			index_delta   = connection->objects;
+
+			do lookup_offset = (lookup_offset << 7) + (connection->response[position] & 0x7F) + 1;
+			while (connection->response[position++] & 0x80);
+
+			while (--index_delta > 0)
+				if (pack_offset - lookup_offset + 1 == connection->object[index_delta]->pack_offset)
+					break;
+
+			if (index_delta == 0)
+				errc(EXIT_FAILURE, EINVAL,
+					"unpack_objects: cannot find ofs-delta "
+					"base object");
+		}
+
+		/* Extract the ref-delta checksum. */
+
+		if (object_type == 7) {
+			if ((ref_delta_hash = (char *)malloc(20)) == NULL)
+				err(EXIT_FAILURE, "unpack_objects: malloc");
+
+			memcpy(ref_delta_hash, connection->response + position, 20);
+			position += 20;
+		}
+
+		/* Inflate and store the object. */
+
+		buffer      = NULL;
+		buffer_size = 0;
+
+		z_stream stream = {
+			.zalloc   = Z_NULL,
+			.zfree    = Z_NULL,
+			.opaque   = Z_NULL,
+			.avail_in = connection->response_size - position,
+			.next_in  = (unsigned char *)(connection->response + position),
+			};
+
+		stream_code = inflateInit(&stream);
+
+		if (stream_code == Z_DATA_ERROR)
+			errc(EXIT_FAILURE, EILSEQ,
+				"unpack_objects: zlib data stream failure");
+
+		do {
+			stream.avail_out = 16384,
+			stream.next_out  = zlib_out;
+			stream_code      = inflate(&stream, Z_NO_FLUSH);
+			stream_bytes     = 16384 - stream.avail_out;
+
+			if ((buffer = (char *)realloc(buffer, buffer_size + stream_bytes)) == NULL)
+				err(EXIT_FAILURE, "unpack_objects: realloc");
+
+			memcpy(buffer + buffer_size, zlib_out, stream_bytes);
+			buffer_size += stream_bytes;
+		}
+		while (stream.avail_out == 0);
+
+		inflateEnd(&stream);
+		position += stream.total_in;
+
+		if (connection->low_memory) {
+			if (pwrite(connection->back_store, buffer, buffer_size, connection->back_store_size) != buffer_size)
+				err(EXIT_FAILURE, "unpack_objects: object file write failure");
+
+			nobj_old = connection->objects;
+		}
+
+		store_object(connection,
+			object_type,
+			buffer,
+			buffer_size,
+			pack_offset,
+			index_delta,
+			ref_delta_hash);
+
+		if (connection->low_memory) {
+			if (nobj_old != connection->objects) {
+				connection->object[nobj_old]->buffer      = NULL;
+				connection->object[nobj_old]->can_free    = false;
+				connection->object[nobj_old]->file_offset = connection->back_store_size;
+			}
+
+			connection->back_store_size += buffer_size;
+
+			free(buffer);
+		}
+
+		free(ref_delta_hash);
+	}
+}
+
+
+/*
+ * unpack_delta_integer
+ *
+ * Function that reconstructs a 32 bit integer from the data stream.
+ */
+
+static uint32_t
+unpack_delta_integer(char *data, uint32_t *position, int bits)
+{
+	uint32_t result = 0, read_bytes = 0, temp = 0, mask = 8;
+
+	/* Determine how many bytes in the stream are needed. */
+
+	do if (bits & mask) read_bytes++;
+	while (mask >>= 1);
+
+	/*
+	 * Put the bytes in their proper position based on the bit field
+	 * passed in.
+	 */
+
+	if (read_bytes > 0) {
+		temp = read_bytes;
+		mask = 3;
+
+		do {
+			if (bits & (1 << mask))
+				result += ((unsigned char)data[*position + --temp] << (mask * 8));
+		}
+		while (mask-- > 0);
+
+		*position += read_bytes;
+	}
+
+	return (result);
+}
+
+
+/*
+ * unpack_variable_length_integer
+ *
+ * Function that reconstructs a variable length integer from the data stream.
+ */
+
+static uint32_t
+unpack_variable_length_integer(char *data, uint32_t *position)
+{
+	uint32_t result = 0, count = 0;
+
+	do result += (data[*position] & 0x7F) << (7 * count++);
+	while (data[(*position)++] & 0x80);
+
+	return (result);
+}
+
+
+/*
+ * apply_deltas
+ *
+ * Procedure that applies the changes in all of the delta objects to their
+ * base objects.
+ */
+
+static void
+apply_deltas(connector *connection)
+{
+	struct object_node *delta, *base, lookup;
+	int       x = 0, instruction = 0, length_bits = 0, offset_bits = 0;
+	int       o = 0, delta_count = -1, deltas[BUFFER_UNIT_SMALL];
+	char     *start, *merge_buffer = NULL, *layer_buffer = NULL;
+	uint32_t  offset = 0, position = 0, length = 0;
+	uint32_t  layer_buffer_size = 0, merge_buffer_size = 0;
+	uint32_t  old_file_size = 0, new_file_size = 0, new_position = 0;
+
+	/* Only resolve the deltas that arrived since the last call. */
+
+	for (o = connection->objects - 1; o >= (int)connection->resolved; o--) {
+		merge_buffer = NULL;
+		delta        = connection->object[o];
+		delta_count  = 0;
+
+		if (delta->type < 6)
+			continue;
+
+		/* Follow the chain of ofs-deltas down to the base object. */
+
+		while (delta->type == 6) {
+			deltas[delta_count++] = delta->index;
+			delta = connection->object[delta->index_delta];
+			lookup.hash = delta->hash;
+		}
+
+		/* Find the ref-delta base object. */
+
+		if (delta->type == 7) {
+			deltas[delta_count++] = delta->index;
+			lookup.hash = delta->ref_delta_hash;
+			load_object(connection, lookup.hash, NULL);
+		}
+
+		/* Lookup the base object and setup the merge buffer. */
+
+		if ((base = RB_FIND(Tree_Objects, &Objects, &lookup)) == NULL)
+			errc(EXIT_FAILURE, ENOENT,
+				"apply_deltas: cannot find %05d -> %d/%s",
+				delta->index,
+				delta->index_delta,
+				delta->ref_delta_hash);
+
+		if ((merge_buffer = (char *)malloc(base->buffer_size)) == NULL)
+			err(EXIT_FAILURE,
+				"apply_deltas: malloc");
+
+		load_buffer(connection, base);
+
+		memcpy(merge_buffer, base->buffer, base->buffer_size);
+		merge_buffer_size = base->buffer_size;
+
+		/* Loop though the deltas to be applied. */
+
+		for (x = delta_count - 1; x >= 0; x--) {
+			delta = connection->object[deltas[x]];
+			load_buffer(connection, delta);
+
+			position      = 0;
+			new_position  = 0;
+			old_file_size = unpack_variable_length_integer(delta->buffer, &position);
+			new_file_size = unpack_variable_length_integer(delta->buffer, &position);
+
+			/* Make sure the layer buffer is large enough. */
+
+			if (new_file_size > layer_buffer_size) {
+				layer_buffer_size = new_file_size;
+
+				if ((layer_buffer = (char *)realloc(layer_buffer, layer_buffer_size)) == NULL)
+					err(EXIT_FAILURE, "apply_deltas: realloc");
+			}
+
+			/* Loop through the copy/insert instructions and build up the layer buffer. */
+
+			while (position < delta->buffer_size) {
+				instruction = (unsigned char)delta->buffer[position++];
+
+				if (instruction & 0x80) {
+					length_bits = (instruction & 0x70) >> 4;
+					offset_bits = (instruction & 0x0F);
+
+					offset = unpack_delta_integer(delta->buffer, &position, offset_bits);
+					start  = merge_buffer + offset;
+					length = unpack_delta_integer(delta->buffer, &position, length_bits);
+
+					if (length == 0)
+						length = 65536;
+				} else {
+					offset    = position;
+					start     = delta->buffer + offset;
+					length    = instruction;
+					position += length;
+				}
+
+				if (new_position + length > new_file_size)
+					errc(EXIT_FAILURE, ERANGE,
+						"apply_deltas: position overflow -- %u + %u > %u",
+						new_position,
+						length,
+						new_file_size);
+
+				memcpy(layer_buffer + new_position, start, length);
+				new_position += length;
+			}
+
+			/* Make sure the merge buffer is large enough. */
+
+			if (new_file_size > merge_buffer_size) {
+				merge_buffer_size = new_file_size;
+				merge_buffer = (char *)realloc(merge_buffer, merge_buffer_size);
+
+				if (merge_buffer == NULL)
+					err(EXIT_FAILURE,
+						"apply_deltas: realloc");
+			}
+
+			/*
+			 * Store the layer buffer in the merge buffer for the
+			 * next loop iteration.
+			 */
+
+			memcpy(merge_buffer, layer_buffer, new_file_size);
+			release_buffer(connection, delta);
+		}
+
+		/* Store the completed object. */
+
+		release_buffer(connection, base);
+
+		store_object(connection,
+			base->type,
+			merge_buffer,
+			new_file_size,
+			0,
+			0,
+			NULL);
+	}
+
+	connection->resolved = connection->objects;
+}
+
+
+/*
+ * extract_tree_item
+ *
+ * Procedure that extracts mode/path/hash items in a tree and returns them in
+ * a new file_node.
+ */
+
+static void
+extract_tree_item(struct file_node *file, char **position)
+{
+	int x = 0, path_size = 0;
+
+	/* Extract the file mode. */
+
+	file->mode = strtol(*position, (char **)NULL, 8);
+	*position  = strchr(*position, ' ') + 1;
+
+	/* Extract the file path. */
+
+	path_size = strlen(*position) + 1;
+	snprintf(file->path, path_size, "%s", *position);
+	*position += path_size;
+
+	/* Extract the file SHA checksum. */
+
+	for (x = 0; x < 20; x++)
+		snprintf(&file->hash[x * 2],
+			3,
+			"%02x",
+			(uint8_t)*(*position)++);
+
+	file->hash[40] = '\0';
+}
+
+
+/*
+ * save_tree
+ *
+ * Procedure that processes all of the obj-trees and retains the current files.
+ */
+
+static void
+process_tree(connector *connection, int remote_descriptor, char *hash, char *base_path)
+{
+	struct object_node  object, *found_object = NULL, *tree = NULL;
+	struct file_node    file, *found_file = NULL;
+	struct file_node   *new_file_node = NULL, *remote_file = NULL;
+	char                full_path[BUFFER_UNIT_SMALL], *buffer = NULL;
+	char                line[BUFFER_UNIT_SMALL], *position = NULL;
+	unsigned int        buffer_size = 0;
+	bool                unchanged = false;
+
+	object.hash = hash;
+
+	if ((tree = RB_FIND(Tree_Objects, &Objects, &object)) == NULL)
+		errc(EXIT_FAILURE, ENOENT,
+			"process_tree: tree %s -- %s cannot be found",
+			base_path,
+			object.hash);
+
+	load_buffer(connection, tree);
+
+	/*
+	 * When scanning incrementally, a directory whose tree is the same as
+	 * the last run cannot contain changes, so only scan the local copies
+	 * of directories that differ.
+	 */
+
+	file.path = base_path;
+
+	if (connection->incremental) {
+		remote_file = RB_FIND(Tree_Remote_Path, &Remote_Path, &file);
+
+		if ((remote_file != NULL) && (remote_file->hash != NULL) && (strncmp(remote_file->hash, hash, 40) == 0))
+			unchanged = true;
+		else
+			scan_local_repository(connection, base_path, 1);
+	}
+
+	/* Remove the base path from the list of upcoming deletions. */
+
+	found_file = RB_FIND(Tree_Local_Path, &Local_Path, &file);
+
+	if (found_file != NULL) {
+		found_file->keep = true;
+		found_file->save = false;
+	}
+
+	/* Add the base path to the output. */
+
+	if ((file.path = (char *)malloc(BUFFER_UNIT_SMALL)) == NULL)
+		err(EXIT_FAILURE, "process_tree: malloc");
+
+	if ((file.hash = (char *)malloc(41)) == NULL)
+		err(EXIT_FAILURE, "process_tree: malloc");
+
+	snprintf(line, sizeof(line),
+		"%o\t%s\t%s/\n",
+		040000,
+		hash,
+		base_path);
+
+	append(&buffer, &buffer_size, line, strlen(line));
+
+	/* Process the tree items. */
+
+	position = tree->buffer;
+
+	while ((uint32_t)(position - tree->buffer) < tree->buffer_size) {
+		extract_tree_item(&file, &position);
+
+		snprintf(full_path, sizeof(full_path),
+			"%s/%s",
+			base_path,
+			file.path);
+
+		snprintf(line, sizeof(line),
+			"%o\t%s\t%s\n",
+			file.mode,
+			file.hash,
+			file.path);
+
+		append(&buffer, &buffer_size, line, strlen(line));
+
+		/* Recursively walk the trees and process the files/links. */
+
+		if (S_ISDIR(file.mode)) {
+			process_tree(connection, remote_descriptor, file.hash, full_path);
+		} else if (!unchanged) {
+			/*
+			 * Locate the pack file object and local copy of
+			 * the file.
+			 */
+
+			memcpy(object.hash, file.hash, 41);
+			memcpy(file.path, full_path, strlen(full_path) + 1);
+
+			/* Excluded files are never downloaded or saved. */
+
+			if (exclude_file(connection, full_path))
+				continue;
+
+			found_object = RB_FIND(Tree_Objects, &Objects, &object);
+			found_file   = RB_FIND(Tree_Local_Path, &Local_Path, &file);
+
+			/* If the local file hasn't changed, skip it. */
+
+			if (found_file != NULL) {
+				found_file->keep = true;
+				found_file->save = false;
+
+				if (strncmp(file.hash, found_file->hash, 40) == 0)
+					continue;
+			}
+
+			/*
+			 * Missing objects can sometimes be found by searching
+			 * the local tree.
+			 */
+
+			if (found_object == NULL) {
+				load_object(connection, file.hash, full_path);
+				found_object = RB_FIND(Tree_Objects, &Objects, &object);
+			}
+
+			/*
+			 * If the object is still missing, exit, unless the pack
+			 * was filtered, in which case fetch_blobs requests it.
+			 */
+
+			if ((found_object == NULL) && (connection->filter == false))
+				errc(EXIT_FAILURE, ENOENT,
+					"process_tree: file %s -- %s cannot be found",
+					full_path,
+					file.hash);
+
+			/* Otherwise retain it. */
+
+			if ((remote_file = RB_FIND(Tree_Remote_Path, &Remote_Path, &file)) == NULL) {
+				new_file_node = (struct file_node *)malloc(sizeof(struct file_node));
+
+				if (new_file_node == NULL)
+					err(EXIT_FAILURE,
+						"process_tree: malloc");
+
+				new_file_node->mode = file.mode;
+				new_file_node->hash = strdup(file.hash);
+				new_file_node->path = strdup(full_path);
+				new_file_node->keep = true;
+				new_file_node->save = true;
+
+				RB_INSERT(Tree_Remote_Path, &Remote_Path, new_file_node);
+			} else {
+				free(remote_file->hash);
+				remote_file->mode = file.mode;
+				remote_file->hash = strdup(file.hash);
+				remote_file->keep = true;
+				remote_file->save = true;
+			}
+		}
+	}
+
+	/* Add the tree data to the remote data list. */
+
+	release_buffer(connection, tree);
+	write(remote_descriptor, buffer, buffer_size);
+	write(remote_descriptor, "\n", 1);
+
+	free(buffer);
+	free(file.hash);
+	free(file.path);
+}
+
+
+/*
+ * save_repairs
+ *
+ * Procedure that saves the repaired files.
+ */
+
+static void
+save_repairs(connector *connection)
+{
+	struct object_node  find_object, *found_object;
+	struct file_node   *local_file, *remote_file, *found_file;
+	char               *check_hash = NULL, *buffer_hash = NULL;
+	bool                missing = false, update = false;
+
+	/*
+	 * Loop through the remote file list, looking for objects that arrived
+	 * in the pack data.
+	 */
+
+	RB_FOREACH(found_file, Tree_Remote_Path, &Remote_Path) {
+		find_object.hash = found_file->hash;
+
+		found_object = RB_FIND(Tree_Objects, &Objects, &find_object);
+
+		if (found_object == NULL)
+			continue;
+
+		/* Save the object. */
+
+		if (S_ISDIR(found_file->mode)) {
+			if ((mkdir(found_file->path, 0755) == -1) && (errno != EEXIST))
+				err(EXIT_FAILURE,
+					"save_repairs: cannot create %s",
+					found_file->path);
+		} else {
+			missing = !path_exists(found_file->path);
+			update  = true;
+
+			/*
+			 * Because identical files can exist in multiple places,
+			 * only update the altered files.
+			 */
+
+			if (missing == false) {
+				load_buffer(connection, found_object);
+
+				check_hash = calculate_file_hash(
+					found_file->path,
+					found_file->mode);
+
+				buffer_hash = calculate_object_hash(
+					found_object->buffer,
+					found_object->buffer_size,
+					3);
+
+				release_buffer(connection, found_object);
+
+				if (strncmp(check_hash, buffer_hash, 40) == 0)
+					update = false;
+			}
+
+			if (update == true) {
+				load_buffer(connection, found_object);
+
+				save_file(found_file->path,
+					found_file->mode,
+					found_object->buffer,
+					found_object->buffer_size,
+					connection->verbosity,
+					connection->display_depth);
+
+				release_buffer(connection, found_object);
+
+				if (strstr(found_file->path, "UPDATING"))
+					extend_updating_list(connection,
+						found_file->path);
+			}
+		}
+	}
+
+	/* Make sure no files are deleted. */
+
+	RB_FOREACH(remote_file, Tree_Remote_Path, &Remote_Path) {
+		local_file = RB_FIND(Tree_Local_Path, &Local_Path, remote_file);
+
+		if (local_file != NULL)
+			local_file->keep = true;
+	}
+
+	close_directories();
+}
+
+
+/*
+ * save_remote_file
+ *
+ * Procedure that saves a new or modified file from its pack object.
+ */
+
+static void
+save_remote_file(connector *connection, struct file_node *file)
+{
+	struct object_node *found_object = NULL, find_object;
+	struct file_node   *first_file = NULL;
+
+	find_object.hash = file->hash;
+	found_object     = RB_FIND(Tree_Objects, &Objects, &find_object);
+
+	if (found_object == NULL)
+		errc(EXIT_FAILURE, EINVAL,
+			"save_remote_file: cannot find %s",
+			file->hash);
+
+	/*
+	 * Identical blobs only need to be written once, later copies are
+	 * linked to (or copied from) the first one.
+	 */
+
+	if ((connection->deduplicate != DEDUPLICATE_NONE) && (!S_ISLNK(file->mode)))
+		first_file = RB_INSERT(Tree_Written, &Written, file);
+
+	if (strstr(file->path, "UPDATING"))
+		extend_updating_list(connection, file->path);
+
+	/* Files moved within the tree only need to be renamed. */
+
+	if ((first_file == NULL) && (move_file(connection, file)))
+		return;
+
+	load_buffer(connection, found_object);
+
+	queue_file(connection,
+		file->path,
+		file->mode,
+		found_object->buffer,
+		found_object->buffer_size,
+		(first_file ? first_file->path : NULL));
+
+	release_buffer(connection, found_object);
+}
+
+
+/*
+ * save_objects
+ *
+ * Procedure that commits the objects and trees to disk.
+ */
+
+static void
+save_objects(connector *connection)
+{
+	struct object_node *found_object = NULL, find_object;
+	struct file_node   *found_file = NULL;
+	char                tree[41], remote_data_file_new[BUFFER_UNIT_SMALL];
+	int                 fd;
+
+	/* Find the tree object referenced in the commit. */
+
+	find_object.hash = connection->want;
+	found_object     = RB_FIND(Tree_Objects, &Objects, &find_object);
+
+	if (found_object == NULL)
+		errc(EXIT_FAILURE, EINVAL,
+			"save_objects: cannot find %s",
+			connection->want);
+
+	load_buffer(connection, found_object);
+
+	if (memcmp(found_object->buffer, "tree ", 5) != 0)
+		errc(EXIT_FAILURE, EINVAL,
+			"save_objects: first object is not a commit");
+
+	memcpy(tree, found_object->buffer + 5, 40);
+	tree[40] = '\0';
+
+	release_buffer(connection, found_object);
+
+	/* Recursively start processing the tree. */
+
+	snprintf(remote_data_file_new, BUFFER_UNIT_SMALL,
+		"%s.new",
+		connection->remote_data_file);
+
+	fd = open(remote_data_file_new, O_WRONLY | O_CREAT | O_TRUNC);
+
+	if ((fd == -1) && (errno != EEXIST))
+		err(EXIT_FAILURE,
+			"save_objects: write file failure %s",
+			remote_data_file_new);
+
+	chmod(remote_data_file_new, 0644);
+	write(fd, connection->want, strlen(connection->want));
+	write(fd, "\n", 1);
+	process_tree(connection, fd, tree, connection->path_target);
+
+	if ((Durability != DURABILITY_NONE) && (fsync(fd) == -1))
+		err(EXIT_FAILURE,
+			"save_objects: fsync failure %s",
+			remote_data_file_new);
+
+	close(fd);
+
+	/*
+	 * Save all of the new and modified files, fetching their blobs first
+	 * if the pack was filtered.
+	 */
+
+	if (connection->filter)
+		fetch_blobs(connection);
+	else
+		RB_FOREACH(found_file, Tree_Remote_Path, &Remote_Path)
+			if (found_file->save)
+				save_remote_file(connection, found_file);
+
+	flush_write_jobs(connection);
+	close_directories();
+	RB_INIT(&Written);
+
+	/*
+	 * Only replace the remote data list once every file is in place (and
+	 * durable), so an interrupted run can be resumed by the next one.
+	 */
+
+	if ((rename(remote_data_file_new, connection->remote_data_file)) != 0)
+		err(EXIT_FAILURE,
+			"save_objects: cannot rename %s",
+			connection->remote_data_file);
+}
+
+
+/*
+ * extract_proxy_data
+ *
+ * Procedure that extracts username/password/host/port data from environment
+ * variables.
+ */
+
+static void
+extract_proxy_data(connector *connection, const char *data)
+{
+	char *copy = NULL, *temp = NULL, *server = NULL, *port = NULL;
+	int   offset = 0;
+
+	if ((data) && (strstr(data, "https://") == data))
+		offset = 8;
+
+	if ((data) && (strstr(data, "http://") == data))
+		offset = 7;
+
+	if (offset == 0)
+		return;
+
+	copy = strdup(data + offset);
+
+	/* Extract the username and password values. */
+
+	if ((temp = strchr(copy, '@')) != NULL) {
+		*temp  = '\0';
+		server = temp + 1;
+
+		if ((temp = strchr(copy, ':')) != NULL) {
+			*temp = '\0';
+
+			free(connection->proxy_username);
+			free(connection->proxy_password);
+
+			connection->proxy_username = strdup(copy);
+			connection->proxy_password = strdup(temp + 1);
+		}
+	} else {
+		server = copy;
+	}
+
+	/* If a trailing slash is present, remove it. */
+
+	if ((temp = strchr(server, '/')) != NULL)
+		*temp = '\0';
+
+	/* Extract the host and port values. */
+
+	if (*(server) == '[') {
+		server++;
+
+		if ((port = strchr(server, ']')) != NULL)
+			*(port++) = '\0';
+	} else if ((port = strchr(server, ':')) != NULL)
+		*port = '\0';
+
+	if ((server == NULL) || (port == NULL))
+		errc(EXIT_FAILURE, EFAULT,
+			"extract_proxy_data: malformed host/port %s", data);
+
+	free(connection->proxy_host);
+	connection->proxy_host = strdup(server);
+	connection->proxy_port = strtol(port + 1, (char **)NULL, 10);
+
+	free(copy);
+}
+
+
+/*
+ * open_configuration
+ *
+ * Function that parses gitup.conf and returns its top level object.
+ */
+
+static ucl_object_t *
+open_configuration(const char *configuration_file)
+{
+	struct ucl_parser *parser = NULL;
+	ucl_object_t      *object = NULL;
+	struct stat        check_file;
+
+	/* Check to make sure the configuration file is actually a file. */
+
+	stat(configuration_file, &check_file);
+
+	if (!S_ISREG(check_file.st_mode))
+		errc(EXIT_FAILURE, EFTYPE,
+			"load_configuration: cannot load %s",
+			configuration_file);
+
+	/* Load and process the configuration file. */
+
+	parser = ucl_parser_new(0);
+
+	if (ucl_parser_add_file(parser, configuration_file) == false) {
+		fprintf(stderr,
+			"load_configuration: %s\n",
+			ucl_parser_get_error(parser));
+
+		exit(EXIT_FAILURE);
+	}
+
+	object = ucl_parser_get_object(parser);
+	ucl_parser_free(parser);
+
+	return (object);
+}
+
+
+/*
+ * list_sections
+ *
+ * Function that returns the sections named in the command line arguments (or
+ * every section with --all), flagging the arguments that name sections.
+ */
+
+static char **
+list_sections(const char *configuration_file, char **argv, int argc, bool *section_argument, int *sections)
+{
+	ucl_object_t       *object = NULL;
+	const ucl_object_t *section = NULL;
+	ucl_object_iter_t   it = NULL;
+	const char         *config_section = NULL;
+	char              **list = NULL, *known = NULL, temp[BUFFER_UNIT_SMALL];
+	unsigned int        known_size = 0;
+	int                 x = 0;
+	bool                all = false, found = false;
+
+	for (x = 1; x < argc; x++)
+		if ((strcmp(argv[x], "-a") == 0) || (strcmp(argv[x], "--all") == 0))
+			all = true;
+
+	object    = open_configuration(configuration_file);
+	*sections = 0;
+
+	while ((section = ucl_iterate_object(object, &it, true))) {
+		config_section = ucl_object_key(section);
+
+		if (strncmp(config_section, "defaults", 8) == 0)
+			continue;
+
+		/*
+		 * Add the section to the list of known sections in case a
+		 * valid section is not found.
+		 */
+
+		snprintf(temp, sizeof(temp), "\t * %s\n", config_section);
+		append(&known, &known_size, temp, strlen(temp));
+
+		/*
+		 * Look for the section in the command line arguments, skipping
+		 * the values of options that take one.
+		 */
+
+		found = all;
+
+		for (x = 1; x < argc; x++)
+			if ((strcmp(argv[x], config_section) == 0) && ((argv[x - 1][0] != '-') || (strlen(argv[x - 1]) != 2) || (strchr("Cdhjtuvw", argv[x - 1][1]) == NULL))) {
+				section_argument[x] = true;
+				found = true;
+			}
+
+		if (found) {
+			if ((list = (char **)realloc(list, (*sections + 1) * sizeof(char *))) == NULL)
+				err(EXIT_FAILURE, "list_sections: realloc");
+
+			list[(*sections)++] = strdup(config_section);
+		}
+	}
+
+	ucl_object_unref(object);
+
+	if (*sections == 0)
+		errc(EXIT_FAILURE, EINVAL,
+			"\nCannot find a matching section in the command line "
+			"arguments.  These are the configured sections:\n%s",
+			known);
+
+	free(known);
+
+	return (list);
+}
+
+
+/*
+ * load_configuration
+ *
+ * Procedure that loads the section options from gitup.conf
+ */
+
+static void
+load_configuration(connector *connection, const char *configuration_file, const char *section_name)
+{
+	ucl_object_t       *object = NULL;
+	const ucl_object_t *section = NULL, *pair = NULL, *ignore = NULL, *exclude = NULL, *mirror = NULL;
+	ucl_object_iter_t   it = NULL, it_section = NULL, it_ignores = NULL, it_excludes = NULL, it_mirrors = NULL;
+	const char         *key = NULL, *config_section = NULL, *value = NULL;
+	char                temp[BUFFER_UNIT_SMALL];
+	uint8_t             length = 0;
+
+	object = open_configuration(configuration_file);
+
+	connection->section = strdup(section_name);
+
+	/* Apply the defaults, followed by the section's own options. */
+
+	while ((section = ucl_iterate_object(object, &it, true))) {
+		config_section = ucl_object_key(section);
+
+		if ((strncmp(config_section, "defaults", 8) != 0) && (strcmp(config_section, section_name) != 0))
+			continue;
+
+		/* Iterate through the section's configuration parameters. */
+
+		while ((pair = ucl_iterate_object(section, &it_section, true))) {
+			key = ucl_object_key(pair);
+
+			if (strnstr(key, "branch", 6) != NULL)
+				connection->branch = strdup(ucl_object_tostring(pair));
+
+			if (strnstr(key, "connect_timeout", 15) != NULL) {
+				if (ucl_object_type(pair) == UCL_INT)
+					connection->connect_timeout = ucl_object_toint(pair);
+				else
+					connection->connect_timeout = strtol(ucl_object_tostring(pair), (char **)NULL, 10);
+
+				if (connection->connect_timeout < 1)
+					errc(EXIT_FAILURE, EINVAL,
+						"connect_timeout must be at least 1 second in [%s]",
+						config_section);
+			}
+
+			if (strnstr(key, "display_depth", 16) != NULL) {
+				if (ucl_object_type(pair) == UCL_INT)
+					connection->display_depth = ucl_object_toint(pair);
+				else
+					connection->display_depth = strtol(ucl_object_tostring(pair), (char **)NULL, 10);
+			}
+
+			if (strnstr(key, "host", 4) != NULL)
+				set_host(connection, ucl_object_tostring(pair));
+
+			if (((strnstr(key, "ignore", 6) != NULL) || (strnstr(key, "ignores", 7) != NULL)) && (ucl_object_type(pair) == UCL_ARRAY))
+				while ((ignore = ucl_iterate_object(pair, &it_ignores, true))) {
+					if ((connection->ignore = (char **)realloc(connection->ignore, (connection->ignores + 1) * sizeof(char *))) == NULL)
+						err(EXIT_FAILURE, "set_configuration_parameters: malloc");
+
+					snprintf(temp, sizeof(temp), "%s", ucl_object_tostring(ignore));
+
+					if (temp[0] != '/')
+						snprintf(temp, sizeof(temp), "%s/%s", connection->path_target, ucl_object_tostring(ignore));
+
+					connection->ignore[connection->ignores++] = strdup(temp);
+				}
+
+			/*
+			 * Excluded paths are never downloaded, so they are also
+			 * ignored when deleting files.
+			 */
+
+			if ((strnstr(key, "excludes", 8) != NULL) && (ucl_object_type(pair) == UCL_ARRAY)) {
+				it_excludes = NULL;
+
+				while ((exclude = ucl_iterate_object(pair, &it_excludes, true))) {
+					if ((connection->exclude = (char **)realloc(connection->exclude, (connection->excludes + 1) * sizeof(char *))) == NULL)
+						err(EXIT_FAILURE, "set_configuration_parameters: malloc");
+
+					if ((connection->ignore = (char **)realloc(connection->ignore, (connection->ignores + 1) * sizeof(char *))) == NULL)
+						err(EXIT_FAILURE, "set_configuration_parameters: malloc");
+
+					snprintf(temp, sizeof(temp), "%s", ucl_object_tostring(exclude));
+
+					if (temp[0] != '/')
+						snprintf(temp, sizeof(temp), "%s/%s", connection->path_target, ucl_object_tostring(exclude));
+
+					connection->exclude[connection->excludes++] = strdup(temp);
+					connection->ignore[connection->ignores++]   = strdup(temp);
+				}
+			}
+
+			if (strnstr(key, "durability", 10) != NULL) {
+				value = ucl_object_tostring(pair);
+
+				if (strcmp(value, "none") == 0)
+					connection->durability = DURABILITY_NONE;
+				else if (strcmp(value, "files") == 0)
+					connection->durability = DURABILITY_FILES;
+				else if (strcmp(value, "atomic") == 0)
+					connection->durability = DURABILITY_ATOMIC;
+				else
+					errc(EXIT_FAILURE, EINVAL,
+						"load_configuration: unknown durability %s",
+						value);
+			}
+
+			if (strnstr(key, "deduplicate", 11) != NULL) {
+				value = ucl_object_tostring(pair);
+
+				if (strcmp(value, "none") == 0)
+					connection->deduplicate = DEDUPLICATE_NONE;
+				else if (strcmp(value, "hardlink") == 0)
+					connection->deduplicate = DEDUPLICATE_HARDLINK;
+				else if (strcmp(value, "copy") == 0)
+					connection->deduplicate = DEDUPLICATE_COPY;
+				else
+					errc(EXIT_FAILURE, EINVAL,
+						"load_configuration: unknown deduplicate %s",
+						value);
+			}
+
+			if (strnstr(key, "full_scan_interval", 18) != NULL) {
+				if (ucl_object_type(pair) == UCL_INT)
+					connection->scan_interval = ucl_object_toint(pair);
+				else
+					connection->scan_interval = strtol(ucl_object_tostring(pair), (char **)NULL, 10);
+			}
+
+			if (strnstr(key, "incremental_scan", 16) != NULL)
+				connection->incremental_scan = ucl_object_toboolean(pair);
+
+			if (strnstr(key, "low_memory", 10) != NULL)
+				connection->low_memory = ucl_object_toboolean(pair);
+
+			if ((strnstr(key, "mirrors", 7) != NULL) && (ucl_object_type(pair) == UCL_ARRAY)) {
+				it_mirrors = NULL;
+
+				while ((mirror = ucl_iterate_object(pair, &it_mirrors, true))) {
+					if ((connection->mirror = (char **)realloc(connection->mirror, (connection->mirrors + 1) * sizeof(char *))) == NULL)
+						err(EXIT_FAILURE, "set_configuration_parameters: malloc");
+
+					connection->mirror[connection->mirrors++] = strdup(ucl_object_tostring(mirror));
+				}
+			}
+
+			if (strnstr(key, "partial_clone", 13) != NULL)
+				connection->partial_clone = ucl_object_toboolean(pair);
+
+			if (strnstr(key, "port", 4) != NULL) {
+				if (ucl_object_type(pair) == UCL_INT)
+					connection->port = ucl_object_toint(pair);
+				else
+					connection->port = strtol(ucl_object_tostring(pair), (char **)NULL, 10);
+			}
+
+			if (strnstr(key, "pack_cache_size", 15) != NULL) {
+				if (ucl_object_type(pair) == UCL_INT)
+					connection->pack_cache_size = ucl_object_toint(pair);
+				else
+					connection->pack_cache_size = strtol(ucl_object_tostring(pair), (char **)NULL, 10);
+			}
+
+			if (strnstr(key, "proxy_host", 10) != NULL)
+				connection->proxy_host = strdup(ucl_object_tostring(pair));
+
+			if (strnstr(key, "proxy_port", 10) != NULL) {
+				if (ucl_object_type(pair) == UCL_INT)
+					connection->proxy_port = ucl_object_toint(pair);
+				else
+					connection->proxy_port = strtol(ucl_object_tostring(pair), (char **)NULL, 10);
+			}
+
+			if (strnstr(key, "proxy_password", 14) != NULL)
+				connection->proxy_password = strdup(ucl_object_tostring(pair));
+
+			if (strnstr(key, "proxy_username", 14) != NULL)
+				connection->proxy_username = strdup(ucl_object_tostring(pair));
+
+			if (strnstr(key, "retries", 7) != NULL) {
+				if (ucl_object_type(pair) == UCL_INT)
+					connection->retries = ucl_object_toint(pair);
+				else
+					connection->retries = strtol(ucl_object_tostring(pair), (char **)NULL, 10);
+			}
+
+			if ((strnstr(key, "repository_path", 15) != NULL) || (strnstr(key, "repository", 10) != NULL)) {
+				snprintf(temp, sizeof(temp), "%s", ucl_object_tostring(pair));
+
+				if (temp[0] != '/')
+					snprintf(temp, sizeof(temp), "/%s", ucl_object_tostring(pair));
+
+				connection->repository_path = strdup(temp);
+			}
+
+			if (strnstr(key, "serve_certificate", 17) != NULL)
+				connection->serve_certificate = strdup(ucl_object_tostring(pair));
+
+			if (strnstr(key, "serve_key", 9) != NULL)
+				connection->serve_key = strdup(ucl_object_tostring(pair));
+
+			if (strnstr(key, "serve_port", 10) != NULL) {
+				if (ucl_object_type(pair) == UCL_INT)
+					connection->serve_port = ucl_object_toint(pair);
+				else
+					connection->serve_port = strtol(ucl_object_tostring(pair), (char **)NULL, 10);
+			}
+
+			if (strnstr(key, "serve_refs_ttl", 14) != NULL) {
+				if (ucl_object_type(pair) == UCL_INT)
+					connection->serve_refs_ttl = ucl_object_toint(pair);
+				else
+					connection->serve_refs_ttl = strtol(ucl_object_tostring(pair), (char **)NULL, 10);
+			}
+
+			if ((strnstr(key, "target_directory", 16) != NULL) || (strnstr(key, "target", 6) != NULL)) {
+				connection->path_target = strdup(ucl_object_tostring(pair));
+
+				length = strlen(connection->path_target) - 1;
+
+				if (*(connection->path_target + length) == '/')
+					*(connection->path_target + length) = '\0';
+			}
+
+			if (strnstr(key, "verbosity", 9) != NULL) {
+				if (ucl_object_type(pair) == UCL_INT)
+					connection->verbosity = ucl_object_toint(pair);
+				else
+					connection->verbosity = strtol(ucl_object_tostring(pair), (char **)NULL, 10);
+			}
+
+			if (strnstr(key, "work_directory", 14) != NULL)
+				connection->path_work = strdup(ucl_object_tostring(pair));
+
+			if (strnstr(key, "write_threads", 13) != NULL) {
+				if (ucl_object_type(pair) == UCL_INT)
+					connection->write_threads = ucl_object_toint(pair);
+				else
+					connection->write_threads = strtol(ucl_object_tostring(pair), (char **)NULL, 10);
+			}
+		}
+
+		/* Defaults that follow the section do not apply to it. */
+
+		if (strcmp(config_section, section_name) == 0)
+			break;
+	}
+
+	ucl_object_unref(object);
+
+	/*
+	 * Check to make sure all of the required information was found in the
+	 * configuration file.
+	 */
+
+	if (connection->branch == NULL)
+		errc(EXIT_FAILURE, EINVAL,
+			"No branch found in [%s]",
+			connection->section);
+
+	if (connection->host == NULL)
+		errc(EXIT_FAILURE, EDESTADDRREQ,
+			"No host found in [%s]",
+			connection->section);
+
+	if (connection->path_target == NULL)
+		errc(EXIT_FAILURE, EINVAL,
+			"No target path found in [%s]",
+			connection->section);
+
+	if (connection->path_work == NULL)
+		errc(EXIT_FAILURE, EINVAL,
+			"No work directory found in [%s]",
+			connection->section);
+
+	if (connection->port == 0)
+		errc(EXIT_FAILURE, EDESTADDRREQ,
+			"No port found in [%s]",
+			connection->section);
+
+	if (connection->repository_path == NULL)
+		errc(EXIT_FAILURE, EINVAL,
+			"No repository found in [%s]",
+			connection->section);
+
+	/* Extract username/password/host/port from the environment variables. */
+
+	extract_proxy_data(connection, getenv("HTTP_PROXY"));
+	extract_proxy_data(connection, getenv("HTTPS_PROXY"));
+}
+
+
+/*
+ * extract_command_line_want
+ *
+ * Procedure that stores the pack data file from the command line argument,
+ * extracts the want and creates the pack commit data file name.
+ */
+
+static void
+extract_command_line_want(connector *connection, char *option)
+{
+	char *extension = NULL, *temp = NULL, *want = NULL, *start = NULL;
+	int   length = 0;
+
+	if (!path_exists(option))
+		err(EXIT_FAILURE,
+			"extract_command_line_want: %s",
+			option);
+
+	connection->use_pack_file  = true;
+	connection->pack_data_file = strdup(option);
+
+	length    = strlen(option);
+	start     = option;
+	temp      = option;
+	extension = strnstr(option, ".pack", length);
+
+	/* Try and extract the want from the file name. */
+
+	while ((temp = strchr(start, '/')) != NULL)
+		start = temp + 1;
+
+	want = strnstr(start, connection->section, length - (start - option));
+
+	if (want == NULL)
+		return;
+	else
+		want += strlen(connection->section) + 1;
+
+	if (extension != NULL)
+		*extension = '\0';
+
+	if (strlen(want) == 40)
+		connection->want = strdup(want);
+}
+
+
+/*
+ * usage
+ *
+ * Procedure that prints a summary of command line options and exits.
+ */
+
+static void
+usage(const char *configuration_file)
+{
+	fprintf(stderr,
+		"Usage: gitup <section> [<section> ...] [-acklrV] [-h checksum] [-j jobs] [-t tag] "
+		"[-u pack file] [-v verbosity] [-w checksum]\n"
+		"       gitup serve <section> [-C configuration file] [-v verbosity]\n"
+		"  Please see %s for the list of <section> options.\n\n"
+		"  Options:\n"
+		"    -a  Update every section (also --all).\n"
+		"    -C  Override the default configuration file.\n"
+		"    -c  Force gitup to clone the repository.\n"
+		"    -d  Limit the display of changes to the specified number of\n"
+		"          directory levels deep (0 = display the entire path).\n"
+		"    -h  Override the 'have' checksum (single section only).\n"
+		"    -j  How many servers to update sections from at once (default 4).\n"
+		"    -k  Save a copy of the pack data to the current working directory.\n"
+		"    -l  Low memory mode -- stores temporary object data to disk.\n"
+		"    -r  Repair all missing/modified files in the local repository.\n"
+		"    -t  Fetch the commit referenced by the specified tag.\n"
+		"    -u  Path to load a copy of the pack data, skipping the download.\n"
+		"    -v  How verbose the output should be (0 = no output, 1 = the default\n"
+		"          normal output, 2 = also show debugging information).\n"
+		"    -V  Display gitup's version number and exit.\n"
+		"    -w  Override the 'want' checksum.\n"
+		"\n", configuration_file);
+
+	exit(EXIT_FAILURE);
+}
+
+
+/*
+ * apply_options
+ *
+ * Procedure that applies the command line options, which override the
+ * section's configuration.
+ */
+
+static void
+apply_options(connector *connection, int argc, char **argv)
+{
+	int option = 0;
+
+	optreset = 1;
+	optind   = 1;
+
+	while ((option = getopt(argc, argv, "C:acd:h:j:klrt:u:v:w:")) != -1) {
+		switch (option) {
+			case 'C':
+				if (connection->verbosity)
+					fprintf(stderr,
+						"# Configuration file: %s\n",
+						optarg);
+				break;
+			case 'a':
+				break;
+			case 'c':
+				connection->clone = true;
+				break;
+			case 'd':
+				connection->display_depth = strtol(optarg, (char **)NULL, 10);
+				break;
+			case 'h':
+				connection->have = strdup(optarg);
+				break;
+			case 'j':
+				break;
+			case 'k':
+				connection->keep_pack_file = true;
+				break;
+			case 'l':
+				connection->low_memory = true;
+				break;
+			case 'r':
+				connection->repair = true;
+				break;
+			case 't':
+				connection->tag = strdup(optarg);
+				break;
+			case 'u':
+				extract_command_line_want(connection, optarg);
+				break;
+			case 'v':
+				connection->verbosity = strtol(optarg, (char **)NULL, 10);
+				break;
+			case 'w':
+				connection->want = strdup(optarg);
+				break;
+		}
+	}
+
+}
+
+
+/*
+ * update_section
+ *
+ * Procedure that clones/pulls/repairs the repository of a section.
+ */
+
+static void
+update_section(connector *connection)
+{
+	struct object_node *object = NULL, *next_object = NULL;
+	struct file_node   *file   = NULL, *next_file   = NULL;
+	struct file_node   *parent = NULL, find_file;
+	struct stat         scan_stamp;
+
+	char     *command = NULL, *display_path = NULL, *temp = NULL, *trim = NULL;
+	char      base64_credentials[BUFFER_UNIT_SMALL];
+	char      credentials[BUFFER_UNIT_SMALL];
+	char      section[BUFFER_UNIT_SMALL];
+	char      gitup_revision[BUFFER_UNIT_SMALL];
+	char      gitup_revision_path[BUFFER_UNIT_SMALL];
+	char      scan_stamp_path[BUFFER_UNIT_SMALL];
+	char      pending_data_file[BUFFER_UNIT_SMALL];
+	char      pack_cache[BUFFER_UNIT_SMALL];
+	int       x = 0, length = 0;
+	int       base64_credentials_length = 0;
+	uint32_t  o = 0;
+	bool      encoded = false, just_added = false;
+	bool      current_repository = false, path_target_exists = false;
+	bool      remote_data_exists = false, pack_data_exists = false;
 
-		if (connection->low_memory) {
-			if (nobj_old != connection->objects) {
-				connection->object[nobj_old]->buffer      = NULL;
-				connection->object[nobj_old]->can_free    = false;
-				connection->object[nobj_old]->file_offset = tot_len;
-			}
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	EVP_ENCODE_CTX      evp_ctx;
+#else
+	EVP_ENCODE_CTX     *evp_ctx;
+#endif
 
-			tot_len += buffer_size;
+	/* Build the proxy credentials string. */
 
-			free(buffer);
-		}
+	if (connection->proxy_username) {
+		snprintf(credentials, sizeof(credentials),
+			"%s:%s",
+			connection->proxy_username,
+			connection->proxy_password);
 
-		free(ref_delta_hash);
-	}
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+		EVP_EncodeInit(&evp_ctx);
 
-	if (connection->low_memory) {
-		close(connection->back_store);
+		EVP_EncodeUpdate(&evp_ctx,
+			(unsigned char *)base64_credentials,
+			&base64_credentials_length,
+			(unsigned char *)credentials,
+			strlen(credentials));
 
-		/* Reopen the temporary object store file for reading. */
+		EVP_EncodeFinal(&evp_ctx,
+			(unsigned char *)base64_credentials,
+			&base64_credentials_length);
+#else
+		evp_ctx = EVP_ENCODE_CTX_new();
 
-		connection->back_store = open(remote_files_tmp, O_RDONLY);
+		EVP_EncodeInit(evp_ctx);
 
-		if (connection->back_store == -1)
-			err(EXIT_FAILURE,
-				"unpack_objects: open tmp ro failure %s",
-				remote_files_tmp);
+		EVP_EncodeUpdate(evp_ctx,
+			(unsigned char *)base64_credentials,
+			&base64_credentials_length,
+			(unsigned char *)credentials,
+			strlen(credentials));
 
-		unlink(remote_files_tmp);   /* unlink now / dealocate when exit */
-	}
-}
+		EVP_EncodeFinal(evp_ctx,
+			(unsigned char *)base64_credentials,
+			&base64_credentials_length);
 
+		EVP_ENCODE_CTX_free(evp_ctx);
+#endif
 
-/*
- * unpack_delta_integer
- *
- * Function that reconstructs a 32 bit integer from the data stream.
- */
+		/* Remove the trailing return. */
 
-static uint32_t
-unpack_delta_integer(char *data, uint32_t *position, int bits)
-{
-	uint32_t result = 0, read_bytes = 0, temp = 0, mask = 8;
+		if ((temp = strchr(base64_credentials, '\n')) != NULL)
+			*temp = '\0';
 
-	/* Determine how many bytes in the stream are needed. */
+		length = 30 + strlen(base64_credentials);
 
-	do if (bits & mask) read_bytes++;
-	while (mask >>= 1);
+		connection->proxy_credentials = (char *)malloc(length + 1);
 
-	/*
-	 * Put the bytes in their proper position based on the bit field
-	 * passed in.
-	 */
+		if (connection->proxy_credentials == NULL)
+			err(EXIT_FAILURE, "update_section: malloc");
 
-	if (read_bytes > 0) {
-		temp = read_bytes;
-		mask = 3;
+		snprintf(connection->proxy_credentials, length,
+			"Proxy-Authorization: Basic %s\r\n",
+			base64_credentials);
+	} else {
+		connection->proxy_credentials = (char *)malloc(1);
 
-		do {
-			if (bits & (1 << mask))
-				result += ((unsigned char)data[*position + --temp] << (mask * 8));
-		}
-		while (mask-- > 0);
+		if (connection->proxy_credentials == NULL)
+			err(EXIT_FAILURE, "update_section: malloc");
 
-		*position += read_bytes;
+		connection->proxy_credentials[0] = '\0';
 	}
 
-	return (result);
-}
-
+	/* Remember the umask so new files only need chmod when it applies. */
 
-/*
- * unpack_variable_length_integer
- *
- * Function that reconstructs a variable length integer from the data stream.
- */
+	File_Umask = umask(022);
+	umask(File_Umask);
 
-static uint32_t
-unpack_variable_length_integer(char *data, uint32_t *position)
-{
-	uint32_t result = 0, count = 0;
+	Durability = connection->durability;
 
-	do result += (data[*position] & 0x7F) << (7 * count++);
-	while (data[(*position)++] & 0x80);
+	/* Make sure at least one thread writes the files. */
 
-	return (result);
-}
+	if (connection->write_threads < 1)
+		connection->write_threads = 1;
 
+	/* If a tag and a want are specified, warn and exit. */
 
-/*
- * apply_deltas
- *
- * Procedure that applies the changes in all of the delta objects to their
- * base objects.
- */
+	if ((connection->tag != NULL) && (connection->want != NULL))
+		errc(EXIT_FAILURE, EINVAL,
+			"A tag and a want cannot both be requested");
 
-static void
-apply_deltas(connector *connection)
-{
-	struct object_node *delta, *base, lookup;
-	int       x = 0, instruction = 0, length_bits = 0, offset_bits = 0;
-	int       o = 0, delta_count = -1, deltas[BUFFER_UNIT_SMALL];
-	char     *start, *merge_buffer = NULL, *layer_buffer = NULL;
-	uint32_t  offset = 0, position = 0, length = 0;
-	uint32_t  layer_buffer_size = 0, merge_buffer_size = 0;
-	uint32_t  old_file_size = 0, new_file_size = 0, new_position = 0;
+	/* Create the work path and build the remote data path. */
 
-	for (o = connection->objects - 1; o >= 0; o--) {
-		merge_buffer = NULL;
-		delta        = connection->object[o];
-		delta_count  = 0;
+	make_path(connection->path_work, 0755);
 
-		if (delta->type < 6)
-			continue;
+	if (connection->session_file == NULL)
+		set_session_file(connection);
 
-		/* Follow the chain of ofs-deltas down to the base object. */
+	length = strlen(connection->path_work) + strlen(connection->section) + 1;
 
-		while (delta->type == 6) {
-			deltas[delta_count++] = delta->index;
-			delta = connection->object[delta->index_delta];
-			lookup.hash = delta->hash;
-		}
+	connection->remote_data_file = (char *)malloc(length + 1);
 
-		/* Find the ref-delta base object. */
+	if (connection->remote_data_file == NULL)
+		err(EXIT_FAILURE, "update_section: malloc");
 
-		if (delta->type == 7) {
-			deltas[delta_count++] = delta->index;
-			lookup.hash = delta->ref_delta_hash;
-			load_object(connection, lookup.hash, NULL);
-		}
+	snprintf(connection->remote_data_file, length + 1,
+		"%s/%s",
+		connection->path_work,
+		connection->section);
 
-		/* Lookup the base object and setup the merge buffer. */
+	temp = strdup(connection->remote_data_file);
 
-		if ((base = RB_FIND(Tree_Objects, &Objects, &lookup)) == NULL)
-			errc(EXIT_FAILURE, ENOENT,
-				"apply_deltas: cannot find %05d -> %d/%s",
-				delta->index,
-				delta->index_delta,
-				delta->ref_delta_hash);
+	/* If non-alphanumerics exist in the section, encode them. */
 
-		if ((merge_buffer = (char *)malloc(base->buffer_size)) == NULL)
-			err(EXIT_FAILURE,
-				"apply_deltas: malloc");
+	length = strlen(connection->section);
 
-		load_buffer(connection, base);
+	for (x = 0; x < length - 1; x++)
+		if ((!isalpha(connection->section[x])) && (!isdigit(connection->section[x]))) {
+			if ((connection->section = (char *)realloc(connection->section, length + 2)) == NULL)
+				err(EXIT_FAILURE, "update_section: realloc");
 
-		memcpy(merge_buffer, base->buffer, base->buffer_size);
-		merge_buffer_size = base->buffer_size;
+			memcpy(section, connection->section + x + 1, length - x);
+			snprintf(connection->section + x, length - x + 3,
+				"%%%X%s",
+				connection->section[x],
+				section);
 
-		/* Loop though the deltas to be applied. */
+			length += 2;
+			x += 2;
+			encoded = true;
+		}
 
-		for (x = delta_count - 1; x >= 0; x--) {
-			delta = connection->object[deltas[x]];
-			load_buffer(connection, delta);
+	if (encoded == true) {
+		/* Store the updated remote data path. */
 
-			position      = 0;
-			new_position  = 0;
-			old_file_size = unpack_variable_length_integer(delta->buffer, &position);
-			new_file_size = unpack_variable_length_integer(delta->buffer, &position);
+		length += strlen(connection->path_work) + 1;
 
-			/* Make sure the layer buffer is large enough. */
+		if ((connection->remote_data_file = (char *)realloc(connection->remote_data_file, length + 1)) == NULL)
+			err(EXIT_FAILURE, "update_section: realloc");
 
-			if (new_file_size > layer_buffer_size) {
-				layer_buffer_size = new_file_size;
+		snprintf(connection->remote_data_file, length + 1,
+			"%s/%s",
+			connection->path_work,
+			connection->section);
 
-				if ((layer_buffer = (char *)realloc(layer_buffer, layer_buffer_size)) == NULL)
-					err(EXIT_FAILURE, "apply_deltas: realloc");
-			}
+		/* If a non-encoded remote data path exists, try and rename it. */
 
-			/* Loop through the copy/insert instructions and build up the layer buffer. */
+		if ((path_exists(temp)) && ((rename(temp, connection->remote_data_file)) != 0))
+			err(EXIT_FAILURE,
+				"update_section: cannot rename %s",
+				connection->remote_data_file);
+	}
 
-			while (position < delta->buffer_size) {
-				instruction = (unsigned char)delta->buffer[position++];
+	free(temp);
 
-				if (instruction & 0x80) {
-					length_bits = (instruction & 0x70) >> 4;
-					offset_bits = (instruction & 0x0F);
+	/*
+	 * If the remote files list or repository are missing, then a clone
+	 * must be performed.
+	 */
 
-					offset = unpack_delta_integer(delta->buffer, &position, offset_bits);
-					start  = merge_buffer + offset;
-					length = unpack_delta_integer(delta->buffer, &position, length_bits);
+	path_target_exists  = path_exists(connection->path_target);
+	remote_data_exists  = path_exists(connection->remote_data_file);
+	pack_data_exists    = path_exists(connection->pack_data_file);
 
-					if (length == 0)
-						length = 65536;
-				} else {
-					offset    = position;
-					start     = delta->buffer + offset;
-					length    = instruction;
-					position += length;
-				}
+	if ((path_target_exists == true) && (remote_data_exists == true)) {
+		load_remote_data(connection, connection->remote_data_file, false);
 
-				if (new_position + length > new_file_size)
-					errc(EXIT_FAILURE, ERANGE,
-						"apply_deltas: position overflow -- %u + %u > %u",
-						new_position,
-						length,
-						new_file_size);
+		/*
+		 * If the last run was interrupted while saving files, the
+		 * files it already wrote do not need to be repaired.
+		 */
 
-				memcpy(layer_buffer + new_position, start, length);
-				new_position += length;
-			}
+		snprintf(pending_data_file, BUFFER_UNIT_SMALL,
+			"%s.new",
+			connection->remote_data_file);
 
-			/* Make sure the merge buffer is large enough. */
+		if (path_exists(pending_data_file)) {
+			load_remote_data(connection, pending_data_file, true);
+			connection->resume = true;
+		}
+	} else {
+		connection->clone = true;
+	}
 
-			if (new_file_size > merge_buffer_size) {
-				merge_buffer_size = new_file_size;
-				merge_buffer = (char *)realloc(merge_buffer, merge_buffer_size);
+	/*
+	 * Pulls can skip the full scan of the local repository and only scan
+	 * the directories whose trees change, unless a full scan is due.
+	 */
 
-				if (merge_buffer == NULL)
-					err(EXIT_FAILURE,
-						"apply_deltas: realloc");
-			}
+	snprintf(scan_stamp_path, BUFFER_UNIT_SMALL,
+		"%s.scanned",
+		connection->remote_data_file);
 
-			/*
-			 * Store the layer buffer in the merge buffer for the
-			 * next loop iteration.
-			 */
+	if ((connection->incremental_scan) && (connection->clone == false) && (connection->repair == false)) {
+		connection->incremental = true;
 
-			memcpy(merge_buffer, layer_buffer, new_file_size);
-			release_buffer(connection, delta);
-		}
+		if ((connection->scan_interval > 0) && ((stat(scan_stamp_path, &scan_stamp) == -1) || (time(NULL) - scan_stamp.st_mtime >= connection->scan_interval * 86400)))
+			connection->incremental = false;
+	}
 
-		/* Store the completed object. */
+	if ((path_target_exists == true) && (connection->incremental == false)) {
+		if (connection->verbosity)
+			fprintf(stderr, "# Scanning local repository...");
 
-		release_buffer(connection, base);
+		scan_local_repository(connection, connection->path_target, -1);
 
-		store_object(connection,
-			base->type,
-			merge_buffer,
-			new_file_size,
-			0,
-			0,
-			NULL);
+		if (connection->verbosity)
+			fprintf(stderr, "\n");
+	} else if (path_target_exists == false) {
+		connection->clone = true;
 	}
-}
 
+	/* Display connection parameters. */
 
-/*
- * extract_tree_item
- *
- * Procedure that extracts mode/path/hash items in a tree and returns them in
- * a new file_node.
- */
+	if (connection->verbosity) {
+		fprintf(stderr, "# Host: %s\n", connection->host);
+		fprintf(stderr, "# Port: %d\n", connection->port);
 
-static void
-extract_tree_item(struct file_node *file, char **position)
-{
-	int x = 0, path_size = 0;
+		if (connection->proxy_host)
+			fprintf(stderr,
+				"# Proxy Host: %s\n"
+				"# Proxy Port: %d\n",
+				connection->proxy_host,
+				connection->proxy_port);
 
-	/* Extract the file mode. */
+		if (connection->proxy_username)
+			fprintf(stderr,
+				"# Proxy Username: %s\n",
+				connection->proxy_username);
 
-	file->mode = strtol(*position, (char **)NULL, 8);
-	*position  = strchr(*position, ' ') + 1;
+		fprintf(stderr,
+			"# Repository Path: %s\n"
+			"# Target Directory: %s\n",
+			connection->repository_path,
+			connection->path_target);
 
-	/* Extract the file path. */
+		if (connection->use_pack_file == true)
+			fprintf(stderr,
+				"# Using pack file: %s\n",
+				connection->pack_data_file);
 
-	path_size = strlen(*position) + 1;
-	snprintf(file->path, path_size, "%s", *position);
-	*position += path_size;
+		if (connection->tag)
+			fprintf(stderr, "# Tag: %s\n", connection->tag);
 
-	/* Extract the file SHA checksum. */
+		if (connection->have)
+			fprintf(stderr, "# Have: %s\n", connection->have);
 
-	for (x = 0; x < 20; x++)
-		snprintf(&file->hash[x * 2],
-			3,
-			"%02x",
-			(uint8_t)*(*position)++);
+		if (connection->want)
+			fprintf(stderr, "# Want: %s\n", connection->want);
 
-	file->hash[40] = '\0';
-}
+		if (connection->low_memory)
+			fprintf(stderr, "# Low memory mode: Yes\n");
 
+		if (connection->incremental)
+			fprintf(stderr, "# Incremental scan: Yes\n");
 
-/*
- * save_tree
- *
- * Procedure that processes all of the obj-trees and retains the current files.
- */
+		if (connection->resume)
+			fprintf(stderr, "# Resuming interrupted update: Yes\n");
+	}
 
-static void
-process_tree(connector *connection, int remote_descriptor, char *hash, char *base_path)
-{
-	struct object_node  object, *found_object = NULL, *tree = NULL;
-	struct file_node    file, *found_file = NULL;
-	struct file_node   *new_file_node = NULL, *remote_file = NULL;
-	char                full_path[BUFFER_UNIT_SMALL], *buffer = NULL;
-	char                line[BUFFER_UNIT_SMALL], *position = NULL;
-	unsigned int        buffer_size = 0;
+	/* Adjust the display depth to include path_target. */
 
-	object.hash = hash;
+	if (connection->display_depth > 0) {
+		temp = connection->path_target;
 
-	if ((tree = RB_FIND(Tree_Objects, &Objects, &object)) == NULL)
-		errc(EXIT_FAILURE, ENOENT,
-			"process_tree: tree %s -- %s cannot be found",
-			base_path,
-			object.hash);
+		while ((temp = strchr(temp + 1, '/')))
+			connection->display_depth++;
+	}
 
-	/* Remove the base path from the list of upcoming deletions. */
+	/* Setup the connection to the server, unless an earlier section did. */
 
-	load_buffer(connection, tree);
+	if (connection->ssl == NULL) {
+		if ((connection->mirrors > 0) && (connection->mirror_next == 0) && (!connection->use_pack_file))
+			select_mirror(connection);
 
-	file.path  = base_path;
-	found_file = RB_FIND(Tree_Local_Path, &Local_Path, &file);
+		connect_server(connection);
 
-	if (found_file != NULL) {
-		found_file->keep = true;
-		found_file->save = false;
+		if (connection->proxy_host)
+			create_tunnel(connection);
+
+		setup_ssl(connection);
 	}
 
-	/* Add the base path to the output. */
+	/* Execute the fetch, unpack, apply deltas and save. */
 
-	if ((file.path = (char *)malloc(BUFFER_UNIT_SMALL)) == NULL)
-		err(EXIT_FAILURE, "process_tree: malloc");
+	if ((connection->use_pack_file == true) && (pack_data_exists == true)) {
+		if (connection->verbosity)
+			fprintf(stderr,
+				"# Action: %s\n",
+				(connection->clone ? "clone" : "pull"));
 
-	if ((file.hash = (char *)malloc(41)) == NULL)
-		err(EXIT_FAILURE, "process_tree: malloc");
+		load_pack(connection);
+		apply_deltas(connection);
+		save_objects(connection);
+	} else {
+		if ((connection->use_pack_file == false) || ((connection->use_pack_file == true) && (pack_data_exists == false)))
+			get_commit_details(connection);
 
-	snprintf(line, sizeof(line),
-		"%o\t%s\t%s/\n",
-		040000,
-		hash,
-		base_path);
+		if ((connection->have != NULL) && (connection->want != NULL) && (strncmp(connection->have, connection->want, 40) == 0))
+			current_repository = true;
 
-	append(&buffer, &buffer_size, line, strlen(line));
+		/*
+		 * When pulling, first ensure the local tree is pristine (an
+		 * incremental scan leaves this to the next full scan).
+		 */
 
-	/* Process the tree items. */
+		if ((connection->repair == true) || ((connection->clone == false) && (connection->incremental == false))) {
+			command = build_repair_command(connection);
 
-	position = tree->buffer;
+			if ((command != NULL) || (connection->local_repairs > 0)) {
+				connection->repair = true;
 
-	while ((uint32_t)(position - tree->buffer) < tree->buffer_size) {
-		extract_tree_item(&file, &position);
+				if (connection->verbosity)
+					fprintf(stderr, "# Action: repair\n");
 
-		snprintf(full_path, sizeof(full_path),
-			"%s/%s",
-			base_path,
-			file.path);
+				if (command != NULL)
+					fetch_pack(connection, command);
 
-		snprintf(line, sizeof(line),
-			"%o\t%s\t%s\n",
-			file.mode,
-			file.hash,
-			file.path);
+				apply_deltas(connection);
+				save_repairs(connection);
+			}
+		}
 
-		append(&buffer, &buffer_size, line, strlen(line));
+		/* Process the clone or pull. */
 
-		/* Recursively walk the trees and process the files/links. */
+		if ((current_repository == false) && (connection->repair == false)) {
+			if (connection->verbosity)
+				fprintf(stderr,
+					"# Action: %s\n",
+					(connection->clone ? "clone" : "pull"));
 
-		if (S_ISDIR(file.mode)) {
-			process_tree(connection, remote_descriptor, file.hash, full_path);
-		} else {
-			/*
-			 * Locate the pack file object and local copy of
-			 * the file.
-			 */
+			if (connection->clone == false)
+				command = build_pull_command(connection);
+			else
+				command = build_clone_command(connection);
 
-			memcpy(object.hash, file.hash, 41);
-			memcpy(file.path, full_path, strlen(full_path) + 1);
+			fetch_pack(connection, command);
+			apply_deltas(connection);
+			save_objects(connection);
+		}
+	}
 
-			found_object = RB_FIND(Tree_Objects, &Objects, &object);
-			found_file   = RB_FIND(Tree_Local_Path, &Local_Path, &file);
+	/* Save .gituprevision. */
 
-			/* If the local file hasn't changed, skip it. */
+	if ((connection->want) || (connection->tag)) {
+		snprintf(gitup_revision_path, BUFFER_UNIT_SMALL,
+			"%s/.gituprevision",
+			connection->path_target);
 
-			if (found_file != NULL) {
-				found_file->keep = true;
-				found_file->save = false;
+		snprintf(gitup_revision, BUFFER_UNIT_SMALL,
+			"%s:%.9s\n",
+			(connection->tag ? connection->tag : connection->branch),
+			connection->want);
 
-				if (strncmp(file.hash, found_file->hash, 40) == 0)
-					continue;
-			}
+		save_file(gitup_revision_path,
+			0644,
+			gitup_revision,
+			strlen(gitup_revision),
+			0,
+			0);
+	}
 
-			/*
-			 * Missing objects can sometimes be found by searching
-			 * the local tree.
-			 */
+	/* Record when the local repository was last fully scanned. */
 
-			if (found_object == NULL) {
-				load_object(connection, file.hash, full_path);
-				found_object = RB_FIND(Tree_Objects, &Objects, &object);
-			}
+	if ((connection->incremental_scan) && (connection->incremental == false) && (connection->want))
+		save_file(scan_stamp_path, 0644, connection->want, strlen(connection->want), 0, 0);
 
-			/* If the object is still missing, exit. */
+	close_directories();
 
-			if (found_object == NULL)
-				errc(EXIT_FAILURE, ENOENT,
-					"process_tree: file %s -- %s cannot be found",
-					full_path,
-					file.hash);
+	/* Wrap it all up. */
 
-			/* Otherwise retain it. */
+	RB_FOREACH_SAFE(file, Tree_Local_Hash, &Local_Hash, next_file)
+		RB_REMOVE(Tree_Local_Hash, &Local_Hash, file);
 
-			if ((remote_file = RB_FIND(Tree_Remote_Path, &Remote_Path, &file)) == NULL) {
-				new_file_node = (struct file_node *)malloc(sizeof(struct file_node));
+	/*
+	 * Queue the stale files for removal.  Anything inside a stale directory
+	 * is removed along with it.
+	 */
 
-				if (new_file_node == NULL)
-					err(EXIT_FAILURE,
-						"process_tree: malloc");
+	RB_FOREACH(file, Tree_Local_Path, &Local_Path) {
+		if ((file->keep == false) && ((current_repository == false) || (connection->repair == true))) {
+			if (ignore_file(connection, file->path))
+				continue;
 
-				new_file_node->mode = file.mode;
-				new_file_node->hash = strdup(found_object->hash);
-				new_file_node->path = strdup(full_path);
-				new_file_node->keep = true;
-				new_file_node->save = true;
+			if ((connection->verbosity) && (connection->display_depth == 0))
+				printf(" - %s\n", file->path);
 
-				RB_INSERT(Tree_Remote_Path, &Remote_Path, new_file_node);
-			} else {
-				free(remote_file->hash);
-				remote_file->mode = file.mode;
-				remote_file->hash = strdup(found_object->hash);
-				remote_file->keep = true;
-				remote_file->save = true;
-			}
-		}
-	}
+			if ((trim = strrchr(file->path, '/')) != NULL) {
+				*trim = '\0';
+				find_file.path = file->path;
+				parent = RB_FIND(Tree_Local_Path, &Local_Path, &find_file);
+				*trim = '/';
 
-	/* Add the tree data to the remote data list. */
+				if ((parent) && (parent->keep == false))
+					continue;
+			}
 
-	release_buffer(connection, tree);
-	write(remote_descriptor, buffer, buffer_size);
-	write(remote_descriptor, "\n", 1);
+			if (S_ISDIR(file->mode)) {
+				display_path = trim_path(file->path,
+					connection->display_depth,
+					&just_added);
 
-	free(buffer);
-	free(file.hash);
-	free(file.path);
-}
+				if ((connection->verbosity) && (connection->display_depth > 0) && (just_added) && (strlen(display_path) == strlen(file->path)))
+					printf(" - %s\n", display_path);
 
+				free(display_path);
+			}
 
-/*
- * save_repairs
- *
- * Procedure that saves the repaired files.
- */
+			queue_removal(connection, file->path, file->mode);
+		}
+	}
 
-static void
-save_repairs(connector *connection)
-{
-	struct object_node  find_object, *found_object;
-	struct file_node   *local_file, *remote_file, *found_file;
-	char               *check_hash = NULL, *buffer_hash = NULL;
-	bool                missing = false, update = false;
+	flush_write_jobs(connection);
+	close_directories();
 
 	/*
-	 * Loop through the remote file list, looking for objects that arrived
-	 * in the pack data.
+	 * The update is complete, so the pack it used no longer needs to outlast
+	 * the cache's limit.
 	 */
 
-	RB_FOREACH(found_file, Tree_Remote_Path, &Remote_Path) {
-		find_object.hash = found_file->hash;
-
-		found_object = RB_FIND(Tree_Objects, &Objects, &find_object);
-
-		if (found_object == NULL)
-			continue;
+	if (connection->pack_cache_size > 0) {
+		snprintf(pack_cache, sizeof(pack_cache), "%s/.packs", connection->path_work);
+		trim_cache(pack_cache, (uint64_t)connection->pack_cache_size * 1048576, NULL);
+	}
 
-		/* Save the object. */
+	RB_FOREACH_SAFE(file, Tree_Local_Path, &Local_Path, next_file) {
+		RB_REMOVE(Tree_Local_Path, &Local_Path, file);
+		file_node_free(file);
+	}
 
-		if (S_ISDIR(found_file->mode)) {
-			if ((mkdir(found_file->path, 0755) == -1) && (errno != EEXIST))
-				err(EXIT_FAILURE,
-					"save_repairs: cannot create %s",
-					found_file->path);
-		} else {
-			missing = !path_exists(found_file->path);
-			update  = true;
+	RB_FOREACH_SAFE(file, Tree_Remote_Path, &Remote_Path, next_file) {
+		RB_REMOVE(Tree_Remote_Path, &Remote_Path, file);
+		file_node_free(file);
+	}
 
-			/*
-			 * Because identical files can exist in multiple places,
-			 * only update the altered files.
-			 */
+	RB_FOREACH_SAFE(file, Tree_Remote_Hash, &Remote_Hash, next_file) {
+		RB_REMOVE(Tree_Remote_Hash, &Remote_Hash, file);
+		file_node_free(file);
+	}
 
-			if (missing == false) {
-				load_buffer(connection, found_object);
+	Remote_Hash_Built = false;
 
-				check_hash = calculate_file_hash(
-					found_file->path,
-					found_file->mode);
+	RB_FOREACH_SAFE(file, Tree_Trim_Path, &Trim_Path, next_file) {
+		RB_REMOVE(Tree_Trim_Path, &Trim_Path, file);
+		file_node_free(file);
+	}
 
-				buffer_hash = calculate_object_hash(
-					found_object->buffer,
-					found_object->buffer_size,
-					3);
+	RB_FOREACH_SAFE(file, Tree_Pending_Path, &Pending_Path, next_file) {
+		RB_REMOVE(Tree_Pending_Path, &Pending_Path, file);
+		file_node_free(file);
+	}
 
-				release_buffer(connection, found_object);
+	RB_FOREACH_SAFE(object, Tree_Objects, &Objects, next_object)
+		RB_REMOVE(Tree_Objects, &Objects, object);
 
-				if (strncmp(check_hash, buffer_hash, 40) == 0)
-					update = false;
-			}
+	for (o = 0; o < connection->objects; o++) {
+		if (connection->verbosity > 1)
+			fprintf(stdout,
+				"###### %05d-%d\t%d\t%u\t%s\t%d\t%s\n",
+				connection->object[o]->index,
+				connection->object[o]->type,
+				connection->object[o]->pack_offset,
+				connection->object[o]->buffer_size,
+				connection->object[o]->hash,
+				connection->object[o]->index_delta,
+				connection->object[o]->ref_delta_hash);
+
+		object_node_free(connection->object[o]);
+	}
 
-			if (update == true) {
-				load_buffer(connection, found_object);
+	if ((connection->verbosity) && (connection->updating))
+		fprintf(stderr,
+			"#\n# Please review the following file(s) for "
+			"important changes.\n%s#\n",
+			connection->updating);
 
-				save_file(found_file->path,
-					found_file->mode,
-					found_object->buffer,
-					found_object->buffer_size,
-					connection->verbosity,
-					connection->display_depth);
+	for (x = 0; x < connection->ignores; x++)
+		free(connection->ignore[x]);
 
-				release_buffer(connection, found_object);
+	for (x = 0; x < connection->excludes; x++)
+		free(connection->exclude[x]);
 
-				if (strstr(found_file->path, "UPDATING"))
-					extend_updating_list(connection,
-						found_file->path);
-			}
-		}
-	}
+	if (connection->back_store != -1)
+		close(connection->back_store);
 
-	/* Make sure no files are deleted. */
+	free(connection->ignore);
+	free(connection->exclude);
+	free(connection->response);
+	free(connection->object);
+	free(connection->proxy_host);
+	free(connection->proxy_username);
+	free(connection->proxy_password);
+	free(connection->proxy_credentials);
+	free(connection->section);
+	free(connection->repository_path);
+	free(connection->branch);
+	free(connection->tag);
+	free(connection->have);
+	free(connection->want);
+	free(connection->pack_data_file);
+	free(connection->path_target);
+	free(connection->path_work);
+	free(connection->remote_data_file);
+	free(connection->updating);
+	free(connection->write_job);
+	free(connection->link_job);
+
+	if (connection->repair == true)
+		fprintf(stderr,
+			"# The local repository has been repaired.  "
+			"Please rerun gitup to pull the latest commit.\n");
 
-	RB_FOREACH(remote_file, Tree_Remote_Path, &Remote_Path) {
-		local_file = RB_FIND(Tree_Local_Path, &Local_Path, remote_file);
+	if (connection->verbosity)
+		fprintf(stderr, "# Done.\n");
 
-		if (local_file != NULL)
-			local_file->keep = true;
-	}
 }
 
 
 /*
- * save_objects
+ * same_server
  *
- * Procedure that commits the objects and trees to disk.
+ * Function that checks whether two sections connect to the same server (and
+ * through the same proxy).
  */
 
-static void
-save_objects(connector *connection)
+static bool
+same_server(connector *one, connector *two)
 {
-	struct object_node *found_object = NULL, find_object;
-	struct file_node   *found_file = NULL;
-	char                tree[41], remote_data_file_new[BUFFER_UNIT_SMALL];
-	int                 fd;
-
-	/* Find the tree object referenced in the commit. */
-
-	find_object.hash = connection->want;
-	found_object     = RB_FIND(Tree_Objects, &Objects, &find_object);
-
-	if (found_object == NULL)
-		errc(EXIT_FAILURE, EINVAL,
-			"save_objects: cannot find %s",
-			connection->want);
-
-	load_buffer(connection, found_object);
-
-	if (memcmp(found_object->buffer, "tree ", 5) != 0)
-		errc(EXIT_FAILURE, EINVAL,
-			"save_objects: first object is not a commit");
+	if ((one->port != two->port) || (one->proxy_port != two->proxy_port))
+		return (false);
 
-	memcpy(tree, found_object->buffer + 5, 40);
-	tree[40] = '\0';
+	if ((one->host == NULL) || (two->host == NULL) || (strcmp(one->host, two->host) != 0))
+		return (false);
 
-	release_buffer(connection, found_object);
+	if ((one->proxy_host == NULL) || (two->proxy_host == NULL))
+		return (one->proxy_host == two->proxy_host);
 
-	/* Recursively start processing the tree. */
+	return (strcmp(one->proxy_host, two->proxy_host) == 0);
+}
 
-	snprintf(remote_data_file_new, BUFFER_UNIT_SMALL,
-		"%s.new",
-		connection->remote_data_file);
 
-	fd = open(remote_data_file_new, O_WRONLY | O_CREAT | O_TRUNC);
+/*
+ * free_server
+ *
+ * Procedure that releases a section's server address and mirror list.
+ */
 
-	if ((fd == -1) && (errno != EEXIST))
-		err(EXIT_FAILURE,
-			"save_objects: write file failure %s",
-			remote_data_file_new);
+static void
+free_server(connector *connection)
+{
+	int x = 0;
 
-	chmod(remote_data_file_new, 0644);
-	write(fd, connection->want, strlen(connection->want));
-	write(fd, "\n", 1);
-	process_tree(connection, fd, tree, connection->path_target);
-	close(fd);
+	for (x = 0; x < connection->mirrors; x++)
+		free(connection->mirror[x]);
 
-	/* Save the remote data list. */
+	free(connection->mirror);
+	free(connection->host);
+	free(connection->host_bracketed);
 
-	if (((remove(connection->remote_data_file)) != 0) && (errno != ENOENT))
-		err(EXIT_FAILURE,
-			"save_objects: cannot remove %s",
-			connection->remote_data_file);
+	connection->mirror         = NULL;
+	connection->mirrors        = 0;
+	connection->host           = NULL;
+	connection->host_bracketed = NULL;
+}
 
-	if ((rename(remote_data_file_new, connection->remote_data_file)) != 0)
-		err(EXIT_FAILURE,
-			"save_objects: cannot rename %s",
-			connection->remote_data_file);
 
-	/* Save all of the new and modified files. */
+/*
+ * share_connection
+ *
+ * Procedure that hands the open server connection and the cached ls-refs
+ * response of one section to the next.
+ */
 
-	RB_FOREACH(found_file, Tree_Remote_Path, &Remote_Path) {
-		if (!found_file->save)
-			continue;
+static void
+share_connection(connector *to, connector *from)
+{
+	int x = 0;
+
+	/* The connection may have moved to one of the server's mirrors. */
+
+	free_server(to);
+
+	to->host           = strdup(from->host);
+	to->host_bracketed = strdup(from->host_bracketed);
+	to->port           = from->port;
+	to->mirrors        = from->mirrors;
+	to->mirror_next    = from->mirror_next;
+
+	if ((to->mirror = (char **)malloc((from->mirrors + 1) * sizeof(char *))) == NULL)
+		err(EXIT_FAILURE, "share_connection: malloc");
+
+	for (x = 0; x < from->mirrors; x++)
+		to->mirror[x] = strdup(from->mirror[x]);
+
+	to->ssl               = from->ssl;
+	to->ctx               = from->ctx;
+	to->session           = from->session;
+	to->session_file      = from->session_file;
+	to->socket_descriptor = from->socket_descriptor;
+	to->reconnect         = from->reconnect;
+	to->refs              = from->refs;
+	to->refs_path         = from->refs_path;
+	to->refs_size         = from->refs_size;
+	to->can_filter        = from->can_filter;
+}
 
-		find_object.hash = found_file->hash;
-		found_object = RB_FIND(Tree_Objects, &Objects, &find_object);
 
-		if (found_object == NULL)
-			errc(EXIT_FAILURE, EINVAL,
-				"save_objects: cannot find %s",
-				found_file->hash);
+/*
+ * close_connection
+ *
+ * Procedure that saves the TLS session and closes the connection to the server.
+ */
 
-		load_buffer(connection, found_object);
+static void
+close_connection(connector *connection)
+{
+	if (connection->ssl) {
+		save_session(connection);
+		SSL_shutdown(connection->ssl);
+		SSL_CTX_free(connection->ctx);
+		close(connection->socket_descriptor);
+		SSL_free(connection->ssl);
+	}
 
-		save_file(found_file->path,
-			found_file->mode,
-			found_object->buffer,
-			found_object->buffer_size,
-			connection->verbosity,
-			connection->display_depth);
+	if (connection->session)
+		SSL_SESSION_free(connection->session);
 
-		release_buffer(connection, found_object);
+	free(connection->session_file);
+	free(connection->refs);
+	free(connection->refs_path);
+	free_server(connection);
 
-		if (strstr(found_file->path, "UPDATING"))
-			extend_updating_list(connection, found_file->path);
-	}
+	connection->ssl          = NULL;
+	connection->session      = NULL;
+	connection->session_file = NULL;
+	connection->refs         = NULL;
+	connection->refs_path    = NULL;
 }
 
 
 /*
- * extract_proxy_data
+ * overlapping_targets
  *
- * Procedure that extracts username/password/host/port data from environment
- * variables.
+ * Function that checks whether one target directory is inside the other.
  */
 
-static void
-extract_proxy_data(connector *connection, const char *data)
+static bool
+overlapping_targets(const char *one, const char *two)
 {
-	char *copy = NULL, *temp = NULL, *server = NULL, *port = NULL;
-	int   offset = 0;
-
-	if ((data) && (strstr(data, "https://") == data))
-		offset = 8;
+	size_t length_one = 0, length_two = 0;
 
-	if ((data) && (strstr(data, "http://") == data))
-		offset = 7;
-
-	if (offset == 0)
-		return;
+	if ((one == NULL) || (two == NULL))
+		return (true);
 
-	copy = strdup(data + offset);
+	length_one = strlen(one);
+	length_two = strlen(two);
 
-	/* Extract the username and password values. */
+	while ((length_one > 1) && (one[length_one - 1] == '/'))
+		length_one--;
 
-	if ((temp = strchr(copy, '@')) != NULL) {
-		*temp  = '\0';
-		server = temp + 1;
+	while ((length_two > 1) && (two[length_two - 1] == '/'))
+		length_two--;
 
-		if ((temp = strchr(copy, ':')) != NULL) {
-			*temp = '\0';
+	if (length_one > length_two)
+		return (overlapping_targets(two, one));
 
-			free(connection->proxy_username);
-			free(connection->proxy_password);
+	if (strncmp(one, two, length_one) != 0)
+		return (false);
 
-			connection->proxy_username = strdup(copy);
-			connection->proxy_password = strdup(temp + 1);
-		}
-	} else {
-		server = copy;
-	}
+	return ((length_one == length_two) || (two[length_one] == '/') || (one[length_one - 1] == '/'));
+}
 
-	/* If a trailing slash is present, remove it. */
 
-	if ((temp = strchr(server, '/')) != NULL)
-		*temp = '\0';
+/*
+ * update_group
+ *
+ * Procedure that updates, one after another, the sections in a group, reusing
+ * the connection between consecutive sections on the same server.
+ */
 
-	/* Extract the host and port values. */
+static void
+update_group(connector *connection, int sections, int *group, int *server, int leader)
+{
+	connector shared;
+	int       s = 0, current = -1;
 
-	if (*(server) == '[') {
-		server++;
+	memset(&shared, 0, sizeof(shared));
 
-		if ((port = strchr(server, ']')) != NULL)
-			*(port++) = '\0';
-	} else if ((port = strchr(server, ':')) != NULL)
-		*port = '\0';
+	for (s = 0; s < sections; s++) {
+		if (group[s] != leader)
+			continue;
 
-	if ((server == NULL) || (port == NULL))
-		errc(EXIT_FAILURE, EFAULT,
-			"extract_proxy_data: malformed host/port %s", data);
+		if (server[s] == current)
+			share_connection(&connection[s], &shared);
+		else if (current != -1)
+			close_connection(&shared);
 
-	free(connection->proxy_host);
-	connection->proxy_host = strdup(server);
-	connection->proxy_port = strtol(port + 1, (char **)NULL, 10);
+		update_section(&connection[s]);
+		share_connection(&shared, &connection[s]);
+		free_server(&connection[s]);
+		current = server[s];
+	}
 
-	free(copy);
+	close_connection(&shared);
 }
 
 
 /*
- * load_configuration
+ * start_worker
  *
- * Procedure that loads the section options from gitup.conf
+ * Function that forks a process to update a group of sections, capturing its
+ * output so it can be displayed in one piece when the process finishes.
  */
 
-static int
-load_configuration(connector *connection, const char *configuration_file, char **argv, int argc)
+static pid_t
+start_worker(connector *connection, int sections, int *group, int *server, int leader, FILE **output)
 {
-	struct ucl_parser  *parser = NULL;
-	ucl_object_t       *object = NULL;
-	const ucl_object_t *section = NULL, *pair = NULL, *ignore = NULL;
-	ucl_object_iter_t   it = NULL, it_section = NULL, it_ignores = NULL;
-	const char         *key = NULL, *config_section = NULL;
-	char               *sections = NULL, temp[BUFFER_UNIT_SMALL];
-	unsigned int        sections_size = 0;
-	uint8_t             argument_index = 0, x = 0, length = 0;
-	struct stat         check_file;
-
-	if ((sections = (char *)malloc(sections_size)) == NULL)
-		err(EXIT_FAILURE, "load_configuration: malloc");
+	pid_t child = 0;
 
-	/* Check to make sure the configuration file is actually a file. */
+	if ((*output = tmpfile()) == NULL)
+		err(EXIT_FAILURE, "start_worker: tmpfile");
 
-	stat(configuration_file, &check_file);
+	fflush(stdout);
+	fflush(stderr);
 
-	if (!S_ISREG(check_file.st_mode))
-		errc(EXIT_FAILURE, EFTYPE,
-			"load_configuration: cannot load %s",
-			configuration_file);
+	if ((child = fork()) == -1)
+		err(EXIT_FAILURE, "start_worker: fork");
 
-	/* Load and process the configuration file. */
+	if (child == 0) {
+		if ((dup2(fileno(*output), STDOUT_FILENO) == -1) || (dup2(fileno(*output), STDERR_FILENO) == -1))
+			err(EXIT_FAILURE, "start_worker: dup2");
 
-	parser = ucl_parser_new(0);
+		setvbuf(stdout, NULL, _IOLBF, 0);
 
-	if (ucl_parser_add_file(parser, configuration_file) == false) {
-		fprintf(stderr,
-			"load_configuration: %s\n",
-			ucl_parser_get_error(parser));
+		update_group(connection, sections, group, server, leader);
 
-		exit(EXIT_FAILURE);
+		fflush(stdout);
+		exit(EXIT_SUCCESS);
 	}
 
-	object = ucl_parser_get_object(parser);
+	return (child);
+}
 
-	while ((connection->section == NULL) && (section = ucl_iterate_object(object, &it, true))) {
-		config_section = ucl_object_key(section);
 
-		/* Look for the section in the command line arguments. */
+/*
+ * finish_worker
+ *
+ * Function that waits for a worker process to finish, displays its output and
+ * returns whether its sections were updated successfully.
+ */
 
-		for (x = 0; x < argc; x++) {
-			if ((strlen(argv[x]) == 2) && (strncmp(argv[x], "-V", 2)) == 0) {
-				fprintf(stdout,
-					"gitup version %s\n",
-					GITUP_VERSION);
+static bool
+finish_worker(connector *connection, int sections, pid_t *worker, FILE **output)
+{
+	char   buffer[BUFFER_UNIT_SMALL];
+	size_t bytes = 0;
+	pid_t  child = 0;
+	int    s = 0, status = 0;
 
-				exit(EXIT_SUCCESS);
-			}
+	if ((child = wait(&status)) == -1)
+		err(EXIT_FAILURE, "finish_worker: wait");
 
-			if ((strlen(argv[x]) == strlen(config_section)) && (strncmp(argv[x], config_section, strlen(config_section)) == 0)) {
-				connection->section = strdup(argv[x]);
-				argument_index = x;
-			}
-		}
+	for (s = 0; (s < sections) && (worker[s] != child); s++);
 
-		/*
-		 * Add the section to the list of known sections in case a
-		 * valid section is not found.
-		 */
+	if (s == sections)
+		return (true);
 
-		if (strncmp(config_section, "defaults", 8) != 0) {
-			snprintf(temp, sizeof(temp), "\t * %s\n", config_section);
-			append(&sections, &sections_size, temp, strlen(temp));
+	worker[s] = 0;
 
-			if (argument_index == 0)
-				continue;
-		}
+	rewind(output[s]);
 
-		/* Iterate through the section's configuration parameters. */
+	while ((bytes = fread(buffer, 1, sizeof(buffer), output[s])) > 0)
+		fwrite(buffer, 1, bytes, stdout);
 
-		while ((pair = ucl_iterate_object(section, &it_section, true))) {
-			key = ucl_object_key(pair);
+	fflush(stdout);
+	fclose(output[s]);
 
-			if (strnstr(key, "branch", 6) != NULL)
-				connection->branch = strdup(ucl_object_tostring(pair));
+	if ((WIFEXITED(status)) && (WEXITSTATUS(status) == EXIT_SUCCESS))
+		return (true);
 
-			if (strnstr(key, "display_depth", 16) != NULL) {
-				if (ucl_object_type(pair) == UCL_INT)
-					connection->display_depth = ucl_object_toint(pair);
-				else
-					connection->display_depth = strtol(ucl_object_tostring(pair), (char **)NULL, 10);
-			}
+	fprintf(stderr, "gitup: update of %s failed\n", connection[s].section);
+
+	return (false);
+}
 
-			if (strnstr(key, "host", 4) != NULL) {
-				connection->host = strdup(ucl_object_tostring(pair));
 
-				/* Add brackets to IPv6 addresses, if needed. */
+/*
+ * receive_request
+ *
+ * Function that reads the next HTTP request from a client into its response
+ * buffer, returning false once the client closes the connection.
+ */
+
+static bool
+receive_request(connector *client, int *header_size, int *body_size)
+{
+	char *marker = NULL, *temp = NULL;
+	int   bytes_read = 0, total_bytes_read = 0, read_size = 0;
 
-				length = strlen(connection->host) + 3;
+	*header_size = 0;
+	*body_size   = 0;
 
-				connection->host_bracketed = (char *)realloc(
-					connection->host_bracketed,
-					length);
+	while ((*header_size == 0) || (total_bytes_read < *header_size + *body_size)) {
+		read_size = BUFFER_UNIT_SMALL;
 
-				if (connection->host_bracketed == NULL)
-					err(EXIT_FAILURE,
-						"load_configuration: malloc");
+		if ((*header_size) && (*header_size + *body_size - total_bytes_read < read_size))
+			read_size = *header_size + *body_size - total_bytes_read;
 
-				if ((strchr(connection->host, ':')) && (strchr(connection->host, '[') == NULL))
-					snprintf(connection->host_bracketed,
-						length,
-						"[%s]",
-						connection->host);
-				else
-					snprintf(connection->host_bracketed,
-						length,
-						"%s",
-						connection->host);
-			}
+		reserve_response(client, total_bytes_read + read_size + 1);
 
-			if (((strnstr(key, "ignore", 6) != NULL) || (strnstr(key, "ignores", 7) != NULL)) && (ucl_object_type(pair) == UCL_ARRAY))
-				while ((ignore = ucl_iterate_object(pair, &it_ignores, true))) {
-					if ((connection->ignore = (char **)realloc(connection->ignore, (connection->ignores + 1) * sizeof(char *))) == NULL)
-						err(EXIT_FAILURE, "set_configuration_parameters: malloc");
+		if ((bytes_read = receive_data(client, client->response + total_bytes_read, read_size)) <= 0)
+			return (false);
 
-					snprintf(temp, sizeof(temp), "%s", ucl_object_tostring(ignore));
+		total_bytes_read += bytes_read;
+		client->response[total_bytes_read] = '\0';
 
-					if (temp[0] != '/')
-						snprintf(temp, sizeof(temp), "%s/%s", connection->path_target, ucl_object_tostring(ignore));
+		if (*header_size)
+			continue;
 
-					connection->ignore[connection->ignores++] = strdup(temp);
-				}
+		if ((marker = strnstr(client->response, "\r\n\r\n", total_bytes_read)) == NULL) {
+			if (total_bytes_read > BUFFER_UNIT_LARGE)
+				return (false);
 
-			if (strnstr(key, "low_memory", 10) != NULL)
-				connection->low_memory = ucl_object_toboolean(pair);
+			continue;
+		}
 
-			if (strnstr(key, "port", 4) != NULL) {
-				if (ucl_object_type(pair) == UCL_INT)
-					connection->port = ucl_object_toint(pair);
-				else
-					connection->port = strtol(ucl_object_tostring(pair), (char **)NULL, 10);
-			}
+		*header_size = marker - client->response + 4;
 
-			if (strnstr(key, "proxy_host", 10) != NULL)
-				connection->proxy_host = strdup(ucl_object_tostring(pair));
+		if (((temp = strcasestr(client->response, "\r\nContent-Length: ")) != NULL) && (temp < marker))
+			*body_size = strtol(temp + 18, (char **)NULL, 10);
 
-			if (strnstr(key, "proxy_port", 10) != NULL) {
-				if (ucl_object_type(pair) == UCL_INT)
-					connection->proxy_port = ucl_object_toint(pair);
-				else
-					connection->proxy_port = strtol(ucl_object_tostring(pair), (char **)NULL, 10);
-			}
+		if (*body_size < 0)
+			return (false);
+	}
 
-			if (strnstr(key, "proxy_password", 14) != NULL)
-				connection->proxy_password = strdup(ucl_object_tostring(pair));
+	client->response_size = total_bytes_read;
 
-			if (strnstr(key, "proxy_username", 14) != NULL)
-				connection->proxy_username = strdup(ucl_object_tostring(pair));
+	return (true);
+}
 
-			if ((strnstr(key, "repository_path", 15) != NULL) || (strnstr(key, "repository", 10) != NULL)) {
-				snprintf(temp, sizeof(temp), "%s", ucl_object_tostring(pair));
 
-				if (temp[0] != '/')
-					snprintf(temp, sizeof(temp), "/%s", ucl_object_tostring(pair));
+/*
+ * serve_reply
+ *
+ * Procedure that sends a response to a client, ending the client's process
+ * if the client has gone away.
+ */
 
-				connection->repository_path = strdup(temp);
-			}
+static void
+serve_reply(connector *client, const char *status, const char *type, char *body, uint32_t body_size)
+{
+	char header[BUFFER_UNIT_SMALL];
+	int  header_size = 0;
+
+	header_size = snprintf(header,
+		sizeof(header),
+		"HTTP/1.1 %s\r\n"
+		"Server: gitup/%s\r\n"
+		"Content-Type: %s\r\n"
+		"Content-Length: %u\r\n"
+		"Cache-Control: no-cache\r\n"
+		"\r\n",
+		status,
+		GITUP_VERSION,
+		type,
+		body_size);
 
-			if ((strnstr(key, "target_directory", 16) != NULL) || (strnstr(key, "target", 6) != NULL)) {
-				connection->path_target = strdup(ucl_object_tostring(pair));
+	if ((!transmit_command(client, header, header_size)) || ((body_size > 0) && (!transmit_command(client, body, body_size))))
+		exit(EXIT_FAILURE);
+}
 
-				length = strlen(connection->path_target) - 1;
 
-				if (*(connection->path_target + length) == '/')
-					*(connection->path_target + length) = '\0';
-			}
+/*
+ * serve_cache_file
+ *
+ * Function that returns the path of the file in the work directory that
+ * caches the response to a request.
+ */
 
-			if (strnstr(key, "verbosity", 9) != NULL) {
-				if (ucl_object_type(pair) == UCL_INT)
-					connection->verbosity = ucl_object_toint(pair);
-				else
-					connection->verbosity = strtol(ucl_object_tostring(pair), (char **)NULL, 10);
-			}
+static char *
+serve_cache_file(connector *connection, char *request, uint32_t request_size)
+{
+	char   *file = NULL, *id = NULL, hash[20];
+	size_t  length = strlen(connection->path_work) + 50;
 
-			if (strnstr(key, "work_directory", 14) != NULL)
-				connection->path_work = strdup(ucl_object_tostring(pair));
-		}
-	}
+	SHA1((uint8_t *)request, request_size, (uint8_t *)hash);
+	id = legible_hash(hash);
 
-	ucl_object_unref(object);
-	ucl_parser_free(parser);
+	if ((file = (char *)malloc(length)) == NULL)
+		err(EXIT_FAILURE, "serve_cache_file: malloc");
 
-	/*
-	 * Check to make sure all of the required information was found in the
-	 * configuration file.
-	 */
+	snprintf(file, length, "%s/.serve/%s", connection->path_work, id);
+	free(id);
 
-	if (argument_index == 0)
-		errc(EXIT_FAILURE, EINVAL,
-			"\nCannot find a matching section in the command line "
-			"arguments.  These are the configured sections:\n%s",
-			sections);
+	return (file);
+}
 
-	if (connection->branch == NULL)
-		errc(EXIT_FAILURE, EINVAL,
-			"No branch found in [%s]",
-			connection->section);
 
-	if (connection->host == NULL)
-		errc(EXIT_FAILURE, EDESTADDRREQ,
-			"No host found in [%s]",
-			connection->section);
+/*
+ * load_cached_response
+ *
+ * Function that loads a cached response, returning false if there is none or
+ * it is older than max_age seconds (-1 = no limit).
+ */
 
-	if (connection->path_target == NULL)
-		errc(EXIT_FAILURE, EINVAL,
-			"No target path found in [%s]",
-			connection->section);
+static bool
+load_cached_response(const char *file, int max_age, char **buffer, uint32_t *buffer_size)
+{
+	struct stat cached;
 
-	if (connection->path_work == NULL)
-		errc(EXIT_FAILURE, EINVAL,
-			"No work directory found in [%s]",
-			connection->section);
+	if (stat(file, &cached) == -1)
+		return (false);
 
-	if (connection->port == 0)
-		errc(EXIT_FAILURE, EDESTADDRREQ,
-			"No port found in [%s]",
-			connection->section);
+	if ((max_age >= 0) && (time(NULL) - cached.st_mtime >= max_age))
+		return (false);
 
-	if (connection->repository_path == NULL)
-		errc(EXIT_FAILURE, EINVAL,
-			"No repository found in [%s]",
-			connection->section);
+	/* Mark responses that never expire as recently used. */
 
-	/* Extract username/password/host/port from the environment variables. */
+	if (max_age == -1)
+		utimes(file, NULL);
 
-	extract_proxy_data(connection, getenv("HTTP_PROXY"));
-	extract_proxy_data(connection, getenv("HTTPS_PROXY"));
+	free(*buffer);
+	*buffer      = NULL;
+	*buffer_size = 0;
 
-	free(sections);
+	load_file(file, buffer, buffer_size);
 
-	return (argument_index);
+	return (true);
 }
 
 
 /*
- * extract_command_line_want
+ * save_cached_response
  *
- * Procedure that stores the pack data file from the command line argument,
- * extracts the want and creates the pack commit data file name.
+ * Procedure that caches a response, renaming it into place so a client never
+ * reads a partial copy.
  */
 
 static void
-extract_command_line_want(connector *connection, char *option)
+save_cached_response(const char *file, char *buffer, uint32_t buffer_size)
 {
-	char *extension = NULL, *temp = NULL, *want = NULL, *start = NULL;
-	int   length = 0;
+	char temp[BUFFER_UNIT_SMALL];
 
-	if (!path_exists(option))
-		err(EXIT_FAILURE,
-			"extract_command_line_want: %s",
-			option);
+	snprintf(temp, sizeof(temp), "%s.new", file);
+	save_file(temp, 0600, buffer, buffer_size, 0, 0);
 
-	connection->use_pack_file  = true;
-	connection->pack_data_file = strdup(option);
+	if (rename(temp, file) == -1)
+		err(EXIT_FAILURE, "save_cached_response: cannot rename %s", temp);
+}
 
-	length    = strlen(option);
-	start     = option;
-	temp      = option;
-	extension = strnstr(option, ".pack", length);
 
-	/* Try and extract the want from the file name. */
+/*
+ * serve_upstream
+ *
+ * Procedure that forwards a client's request to the upstream server, leaving
+ * the decoded response in the connection's response buffer.  The path is the
+ * request target of a GET, or the repository path of a POST.
+ */
 
-	while ((temp = strchr(start, '/')) != NULL)
-		start = temp + 1;
+static void
+serve_upstream(connector *connection, char *path, char *body)
+{
+	char command[BUFFER_UNIT_SMALL];
 
-	want = strnstr(start, connection->section, length - (start - option));
+	if (connection->ssl == NULL) {
+		connect_server(connection);
 
-	if (want == NULL)
-		return;
-	else
-		want += strlen(connection->section) + 1;
+		if (connection->proxy_host)
+			create_tunnel(connection);
 
-	if (extension != NULL)
-		*extension = '\0';
+		setup_ssl(connection);
+	}
 
-	if (strlen(want) == 40)
-		connection->want = strdup(want);
+	if (body == NULL) {
+		snprintf(command,
+			BUFFER_UNIT_SMALL,
+			"GET %s HTTP/1.1\r\n"
+			"Host: %s:%d\r\n"
+			"User-Agent: gitup/%s\r\n"
+			"Accept-encoding: deflate, gzip\r\n"
+			"Git-Protocol: version=2\r\n"
+			"\r\n",
+			path,
+			connection->host_bracketed,
+			connection->port,
+			GITUP_VERSION);
+
+		process_command(connection, command, strlen(command));
+	} else {
+		free(connection->repository_path);
+		connection->repository_path = strdup(path);
+
+		send_command(connection, body);
+	}
 }
 
 
 /*
- * usage
+ * serve_failed
  *
- * Procedure that prints a summary of command line options and exits.
+ * Exit handler that tells a client waiting on the upstream server that its
+ * request failed, instead of just dropping the connection.
  */
 
 static void
-usage(const char *configuration_file)
+serve_failed(void)
 {
-	fprintf(stderr,
-		"Usage: gitup <section> [-cklrV] [-h checksum] [-t tag] "
-		"[-u pack file] [-v verbosity] [-w checksum]\n"
-		"  Please see %s for the list of <section> options.\n\n"
-		"  Options:\n"
-		"    -C  Override the default configuration file.\n"
-		"    -c  Force gitup to clone the repository.\n"
-		"    -d  Limit the display of changes to the specified number of\n"
-		"          directory levels deep (0 = display the entire path).\n"
-		"    -h  Override the 'have' checksum.\n"
-		"    -k  Save a copy of the pack data to the current working directory.\n"
-		"    -l  Low memory mode -- stores temporary object data to disk.\n"
-		"    -r  Repair all missing/modified files in the local repository.\n"
-		"    -t  Fetch the commit referenced by the specified tag.\n"
-		"    -u  Path to load a copy of the pack data, skipping the download.\n"
-		"    -v  How verbose the output should be (0 = no output, 1 = the default\n"
-		"          normal output, 2 = also show debugging information).\n"
-		"    -V  Display gitup's version number and exit.\n"
-		"    -w  Override the 'want' checksum.\n"
-		"\n", configuration_file);
+	char reply[BUFFER_UNIT_SMALL];
+	int  reply_size = 0;
 
-	exit(EXIT_FAILURE);
+	if (Serve_Waiting == NULL)
+		return;
+
+	reply_size = snprintf(reply,
+		sizeof(reply),
+		"HTTP/1.1 502 Bad Gateway\r\n"
+		"Server: gitup/%s\r\n"
+		"Content-Type: text/plain\r\n"
+		"Content-Length: 0\r\n"
+		"Connection: close\r\n"
+		"\r\n",
+		GITUP_VERSION);
+
+	transmit_command(Serve_Waiting, reply, reply_size);
+	Serve_Waiting = NULL;
 }
 
 
 /*
- * main
+ * serve_client
  *
- * A lightweight, dependency-free program to clone/pull a Git repository.
+ * Procedure that answers a client's upload-pack requests until the client
+ * disconnects.  Pack responses never change, so they are cached for good,
+ * while the ref listings are only cached for serve_refs_ttl seconds.  Clients
+ * waiting on the same request share a single upstream fetch.
  */
 
-int
-main(int argc, char **argv)
+static void
+serve_client(connector *connection, connector *client)
 {
-	struct object_node *object = NULL, *next_object = NULL;
-	struct file_node   *file   = NULL, *next_file   = NULL;
-	const char         *configuration_file = CONFIG_FILE_PATH;
+	char     *target = NULL, *temp = NULL, *body = NULL, *key = NULL;
+	char     *repository = NULL, length[5];
+	char     *cache_file = NULL, *cached = NULL, lock_file[BUFFER_UNIT_SMALL];
+	char      cache[BUFFER_UNIT_SMALL];
+	uint32_t  cached_size = 0, key_size = 0;
+	int       header_size = 0, body_size = 0, max_age = 0, lock = -1;
+	bool      get = false, hit = false, fetch = false;
 
-	char     *command = NULL, *display_path = NULL, *temp = NULL;
-	char      base64_credentials[BUFFER_UNIT_SMALL];
-	char      credentials[BUFFER_UNIT_SMALL];
-	char      section[BUFFER_UNIT_SMALL];
-	char      gitup_revision[BUFFER_UNIT_SMALL];
-	char      gitup_revision_path[BUFFER_UNIT_SMALL];
-	int       x = 0, option = 0, length = 0;
-	int       base64_credentials_length = 0, skip_optind = 0;
-	uint32_t  o = 0;
-	bool      encoded = false, just_added = false;
-	bool      current_repository = false, path_target_exists = false;
-	bool      remote_data_exists = false, pack_data_exists = false;
+	snprintf(cache, sizeof(cache), "%s/.serve", connection->path_work);
 
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-	EVP_ENCODE_CTX      evp_ctx;
-#else
-	EVP_ENCODE_CTX     *evp_ctx;
-#endif
+	while (receive_request(client, &header_size, &body_size)) {
+		get = (strncmp(client->response, "GET ", 4) == 0);
 
-	connector connection = {
-		.ssl               = NULL,
-		.ctx               = NULL,
-		.socket_descriptor = 0,
-		.host              = NULL,
-		.host_bracketed    = NULL,
-		.port              = 0,
-		.proxy_host        = NULL,
-		.proxy_port        = 0,
-		.proxy_username    = NULL,
-		.proxy_password    = NULL,
-		.proxy_credentials = NULL,
-		.section           = NULL,
-		.repository_path   = NULL,
-		.branch            = NULL,
-		.tag               = NULL,
-		.have              = NULL,
-		.want              = NULL,
-		.response          = NULL,
-		.response_blocks   = 0,
-		.response_size     = 0,
-		.clone             = false,
-		.repair            = false,
-		.object            = NULL,
-		.objects           = 0,
-		.pack_data_file    = NULL,
-		.path_target       = NULL,
-		.path_work         = NULL,
-		.remote_data_file  = NULL,
-		.ignore            = NULL,
-		.ignores           = 0,
-		.keep_pack_file    = false,
-		.use_pack_file     = false,
-		.verbosity         = 1,
-		.display_depth     = 0,
-		.updating          = NULL,
-		.back_store        = -1,
-		.low_memory        = false,
-		};
+		if ((!get) && (strncmp(client->response, "POST ", 5) != 0)) {
+			serve_reply(client, "405 Method Not Allowed", "text/plain", NULL, 0);
+			continue;
+		}
 
-	if (argc < 2)
-		usage(configuration_file);
+		/* Only upload-pack requests are answered. */
 
-	/* Check to see if the configuration file path is being overridden. */
+		target = client->response + (get ? 4 : 5);
 
-	for (x = 0; x < argc; x++)
-		if ((strlen(argv[x]) > 1) && (strnstr(argv[x], "-C", 2) == argv[x])) {
-			if (strlen(argv[x]) > 2)
-				configuration_file = strdup(argv[x] + 2);
-			else if ((argc > x) && (argv[x + 1][0] != '-'))
-				configuration_file = strdup(argv[x + 1]);
+		if ((temp = strchr(target, ' ')) == NULL) {
+			serve_reply(client, "400 Bad Request", "text/plain", NULL, 0);
+			continue;
 		}
 
-	/* Load the configuration file to learn what section is being requested. */
+		target = strndup(target, temp - target);
 
-	skip_optind = load_configuration(&connection, configuration_file, argv, argc);
+		if (get)
+			temp = strstr(target, "/info/refs?service=git-upload-pack");
+		else
+			temp = strstr(target, "/git-upload-pack");
 
-	if (skip_optind == 1)
-		optind++;
+		if ((temp == NULL) || (temp[(get ? 34 : 16)] != '\0')) {
+			serve_reply(client, "404 Not Found", "text/plain", NULL, 0);
+			free(target);
+			continue;
+		}
 
-	/* Process the command line parameters. */
+		repository = strndup(target, temp - target);
 
-	while ((option = getopt(argc, argv, "C:cd:h:klrt:u:v:w:")) != -1) {
-		switch (option) {
-			case 'C':
-				if (connection.verbosity)
-					fprintf(stderr,
-						"# Configuration file: %s\n",
-						configuration_file);
-				break;
-			case 'c':
-				connection.clone = true;
-				break;
-			case 'd':
-				connection.display_depth = strtol(optarg, (char **)NULL, 10);
-				break;
-			case 'h':
-				connection.have = strdup(optarg);
-				break;
-			case 'k':
-				connection.keep_pack_file = true;
-				break;
-			case 'l':
-				connection.low_memory = true;
-				break;
-			case 'r':
-				connection.repair = true;
-				break;
-			case 't':
-				connection.tag = strdup(optarg);
-				break;
-			case 'u':
-				extract_command_line_want(&connection, optarg);
-				break;
-			case 'v':
-				connection.verbosity = strtol(optarg, (char **)NULL, 10);
-				break;
-			case 'w':
-				connection.want = strdup(optarg);
-				break;
+		/* Move the body to the front of the buffer, inflating it if needed. */
+
+		if (header_value(client->response, header_size, "Content-Encoding", "gzip", "deflate")) {
+			memmove(client->response, client->response + header_size, body_size);
+			inflate_response(client, body_size);
+		} else {
+			memmove(client->response, client->response + header_size, body_size);
+			client->response_size = body_size;
+			client->response[client->response_size] = '\0';
 		}
 
-		if (optind == skip_optind)
-			optind++;
-	}
+		body = client->response;
+
+		/* Key the cache on the request target and body. */
 
-	/* Build the proxy credentials string. */
+		key_size = strlen(target) + 1 + client->response_size;
 
-	if (connection.proxy_username) {
-		snprintf(credentials, sizeof(credentials),
-			"%s:%s",
-			connection.proxy_username,
-			connection.proxy_password);
+		if ((key = (char *)malloc(key_size)) == NULL)
+			err(EXIT_FAILURE, "serve_client: malloc");
 
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-		EVP_EncodeInit(&evp_ctx);
+		memcpy(key, target, strlen(target) + 1);
+		memcpy(key + strlen(target) + 1, body, client->response_size);
 
-		EVP_EncodeUpdate(&evp_ctx,
-			(unsigned char *)base64_credentials,
-			&base64_credentials_length,
-			(unsigned char *)credentials,
-			strlen(credentials));
+		cache_file = serve_cache_file(connection, key, key_size);
+		max_age    = connection->serve_refs_ttl;
 
-		EVP_EncodeFinal(&evp_ctx,
-			(unsigned char *)base64_credentials,
-			&base64_credentials_length);
-#else
-		evp_ctx = EVP_ENCODE_CTX_new();
+		/*
+		 * The first pkt-line of a request names its command, with or
+		 * without a trailing LF.  Pack responses are kept while they fit
+		 * in pack_cache_size.
+		 */
 
-		EVP_EncodeInit(evp_ctx);
+		fetch = false;
 
-		EVP_EncodeUpdate(evp_ctx,
-			(unsigned char *)base64_credentials,
-			&base64_credentials_length,
-			(unsigned char *)credentials,
-			strlen(credentials));
+		if ((!get) && (client->response_size >= 17) && (strncmp(body + 4, "command=fetch", 13) == 0)) {
+			memcpy(length, body, 4);
+			length[4] = '\0';
 
-		EVP_EncodeFinal(evp_ctx,
-			(unsigned char *)base64_credentials,
-			&base64_credentials_length);
+			fetch = ((strtol(length, (char **)NULL, 16) == 17) || ((strtol(length, (char **)NULL, 16) == 18) && (body[17] == '\n')));
+		}
 
-		EVP_ENCODE_CTX_free(evp_ctx);
-#endif
+		if (fetch)
+			max_age = (connection->pack_cache_size > 0 ? -1 : 0);
 
-		/* Remove the trailing return. */
+		if (max_age != 0) {
+			hit = load_cached_response(cache_file, max_age, &cached, &cached_size);
 
-		if ((temp = strchr(base64_credentials, '\n')) != NULL)
-			*temp = '\0';
+			if (!hit) {
+				snprintf(lock_file, sizeof(lock_file), "%s.lock", cache_file);
 
-		length = 30 + strlen(base64_credentials);
+				if ((lock = open(lock_file, O_RDWR | O_CREAT, 0600)) == -1)
+					err(EXIT_FAILURE, "serve_client: cannot open %s", lock_file);
 
-		connection.proxy_credentials = (char *)malloc(length + 1);
+				if (flock(lock, LOCK_EX) == -1)
+					err(EXIT_FAILURE, "serve_client: flock");
 
-		if (connection.proxy_credentials == NULL)
-			err(EXIT_FAILURE, "main: malloc");
+				hit = load_cached_response(cache_file, max_age, &cached, &cached_size);
+			}
+		} else {
+			hit = false;
+		}
 
-		snprintf(connection.proxy_credentials, length,
-			"Proxy-Authorization: Basic %s\r\n",
-			base64_credentials);
-	} else {
-		connection.proxy_credentials = (char *)malloc(1);
+		if (connection->verbosity)
+			fprintf(stderr,
+				"# %s %s (%s)\n",
+				(get ? "GET" : "POST"),
+				target,
+				(hit ? "cached" : "upstream"));
 
-		if (connection.proxy_credentials == NULL)
-			err(EXIT_FAILURE, "main: malloc");
+		if (!hit) {
+			Serve_Waiting = client;
+			serve_upstream(connection, (get ? target : repository), (get ? NULL : body));
+			Serve_Waiting = NULL;
 
-		connection.proxy_credentials[0] = '\0';
-	}
+			if (max_age > 0)
+				save_cached_response(cache_file, connection->response, connection->response_size);
 
-	/* If a tag and a want are specified, warn and exit. */
+			if ((fetch) && (max_age == -1) && (connection->response_size <= (uint64_t)connection->pack_cache_size * 1048576) && (memmem(connection->response, connection->response_size, "000dpackfile\n", 13) != NULL))
+				save_cached_response(cache_file, connection->response, connection->response_size);
 
-	if ((connection.tag != NULL) && (connection.want != NULL))
-		errc(EXIT_FAILURE, EINVAL,
-			"A tag and a want cannot both be requested");
+			if ((max_age != 0) && (connection->pack_cache_size > 0))
+				trim_cache(cache, (uint64_t)connection->pack_cache_size * 1048576, (path_exists(cache_file) ? cache_file : NULL));
+		}
 
-	/* Create the work path and build the remote data path. */
+		/*
+		 * Remove the lock file while still holding it, a client waiting on
+		 * it finds the response cached when it gets the lock.
+		 */
 
-	make_path(connection.path_work, 0755);
+		if (lock != -1) {
+			unlink(lock_file);
+			flock(lock, LOCK_UN);
+			close(lock);
+			lock = -1;
+		}
 
-	length = strlen(connection.path_work) + strlen(connection.section) + 1;
+		serve_reply(client,
+			"200 OK",
+			(get ? "application/x-git-upload-pack-advertisement" : "application/x-git-upload-pack-result"),
+			(hit ? cached : connection->response),
+			(hit ? cached_size : connection->response_size));
 
-	connection.remote_data_file = (char *)malloc(length + 1);
+		free(cache_file);
+		free(key);
+		free(repository);
+		free(target);
+	}
 
-	if (connection.remote_data_file == NULL)
-		err(EXIT_FAILURE, "main: malloc");
+	free(cached);
+}
 
-	snprintf(connection.remote_data_file, length + 1,
-		"%s/%s",
-		connection.path_work,
-		connection.section);
 
-	temp = strdup(connection.remote_data_file);
+/*
+ * serve_section
+ *
+ * Procedure that answers the smart HTTP upload-pack requests of other gitup
+ * clients over TLS, forwarding them to the section's server and caching the
+ * responses in the work directory.  Each client is served by its own process.
+ */
 
-	/* If non-alphanumerics exist in the section, encode them. */
+static void
+serve_section(connector *connection)
+{
+	struct sockaddr_in6  address6;
+	struct sockaddr_in   address4;
+	struct timeval       idle = { .tv_sec = SERVE_IDLE_TIMEOUT, .tv_usec = 0 };
+	connector            client;
+	SSL_CTX             *server = NULL;
+	char                 cache[BUFFER_UNIT_SMALL];
+	int                  listener = -1, descriptor = -1, on = 1, off = 0;
+	pid_t                child = 0;
+
+	if ((connection->serve_certificate == NULL) || (connection->serve_key == NULL))
+		errc(EXIT_FAILURE, EINVAL,
+			"No serve_certificate or serve_key found in [%s]",
+			connection->section);
 
-	length = strlen(connection.section);
+	SSL_library_init();
+	SSL_load_error_strings();
 
-	for (x = 0; x < length - 1; x++)
-		if ((!isalpha(connection.section[x])) && (!isdigit(connection.section[x]))) {
-			if ((connection.section = (char *)realloc(connection.section, length + 2)) == NULL)
-				err(EXIT_FAILURE, "main: realloc");
+	if ((server = SSL_CTX_new(SSLv23_server_method())) == NULL)
+		errc(EXIT_FAILURE, EINVAL, "serve_section: SSL_CTX_new");
 
-			memcpy(section, connection.section + x + 1, length - x);
-			snprintf(connection.section + x, length - x + 3,
-				"%%%X%s",
-				connection.section[x],
-				section);
+	if (SSL_CTX_use_certificate_chain_file(server, connection->serve_certificate) != 1)
+		errc(EXIT_FAILURE, EINVAL,
+			"serve_section: cannot load %s",
+			connection->serve_certificate);
 
-			length += 2;
-			x += 2;
-			encoded = true;
-		}
+	if (SSL_CTX_use_PrivateKey_file(server, connection->serve_key, SSL_FILETYPE_PEM) != 1)
+		errc(EXIT_FAILURE, EINVAL,
+			"serve_section: cannot load %s",
+			connection->serve_key);
 
-	if (encoded == true) {
-		/* Store the updated remote data path. */
+	snprintf(cache, sizeof(cache), "%s/.serve", connection->path_work);
+	make_path(cache, 0700);
 
-		length += strlen(connection.path_work) + 1;
+	set_session_file(connection);
 
-		if ((connection.remote_data_file = (char *)realloc(connection.remote_data_file, length + 1)) == NULL)
-			err(EXIT_FAILURE, "main: realloc");
+	/* Listen on every IPv6 and IPv4 address, or IPv4 alone without IPv6. */
 
-		snprintf(connection.remote_data_file, length + 1,
-			"%s/%s",
-			connection.path_work,
-			connection.section);
+	memset(&address6, 0, sizeof(address6));
+	address6.sin6_family = AF_INET6;
+	address6.sin6_addr   = in6addr_any;
+	address6.sin6_port   = htons(connection->serve_port);
 
-		/* If a non-encoded remote data path exists, try and rename it. */
+	if ((listener = socket(AF_INET6, SOCK_STREAM, 0)) != -1) {
+		setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+		setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
 
-		if ((path_exists(temp)) && ((rename(temp, connection.remote_data_file)) != 0))
-			err(EXIT_FAILURE,
-				"main: cannot rename %s",
-				connection.remote_data_file);
+		if (bind(listener, (struct sockaddr *)&address6, sizeof(address6)) == -1) {
+			close(listener);
+			listener = -1;
+		}
 	}
 
-	free(temp);
+	if (listener == -1) {
+		memset(&address4, 0, sizeof(address4));
+		address4.sin_family      = AF_INET;
+		address4.sin_addr.s_addr = htonl(INADDR_ANY);
+		address4.sin_port        = htons(connection->serve_port);
 
-	/*
-	 * If the remote files list or repository are missing, then a clone
-	 * must be performed.
-	 */
+		if ((listener = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+			err(EXIT_FAILURE, "serve_section: socket");
 
-	path_target_exists  = path_exists(connection.path_target);
-	remote_data_exists  = path_exists(connection.remote_data_file);
-	pack_data_exists    = path_exists(connection.pack_data_file);
+		setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
 
-	if ((path_target_exists == true) && (remote_data_exists == true))
-		load_remote_data(&connection);
-	else
-		connection.clone = true;
+		if (bind(listener, (struct sockaddr *)&address4, sizeof(address4)) == -1)
+			err(EXIT_FAILURE, "serve_section: cannot bind to port %d", connection->serve_port);
+	}
 
-	if (path_target_exists == true) {
-		if (connection.verbosity)
-			fprintf(stderr, "# Scanning local repository...");
+	if (listen(listener, SOMAXCONN) == -1)
+		err(EXIT_FAILURE, "serve_section: listen");
 
-		scan_local_repository(&connection, connection.path_target);
+	/* The client processes are never waited for. */
 
-		if (connection.verbosity)
-			fprintf(stderr, "\n");
-	} else {
-		connection.clone = true;
-	}
+	signal(SIGCHLD, SIG_IGN);
 
-	/* Display connection parameters. */
+	if (connection->verbosity)
+		fprintf(stderr,
+			"# Serving %s:%d on port %d\n",
+			connection->host,
+			connection->port,
+			connection->serve_port);
+
+	while (true) {
+		if ((descriptor = accept(listener, NULL, NULL)) == -1) {
+			if ((errno == EINTR) || (errno == ECONNABORTED))
+				continue;
 
-	if (connection.verbosity) {
-		fprintf(stderr, "# Host: %s\n", connection.host);
-		fprintf(stderr, "# Port: %d\n", connection.port);
+			err(EXIT_FAILURE, "serve_section: accept");
+		}
 
-		if (connection.proxy_host)
-			fprintf(stderr,
-				"# Proxy Host: %s\n"
-				"# Proxy Port: %d\n",
-				connection.proxy_host,
-				connection.proxy_port);
+		fflush(stdout);
+		fflush(stderr);
 
-		if (connection.proxy_username)
-			fprintf(stderr,
-				"# Proxy Username: %s\n",
-				connection.proxy_username);
+		if ((child = fork()) == -1)
+			err(EXIT_FAILURE, "serve_section: fork");
 
-		fprintf(stderr,
-			"# Repository Path: %s\n"
-			"# Target Directory: %s\n",
-			connection.repository_path,
-			connection.path_target);
+		if (child > 0) {
+			close(descriptor);
+			continue;
+		}
 
-		if (connection.use_pack_file == true)
-			fprintf(stderr,
-				"# Using pack file: %s\n",
-				connection.pack_data_file);
+		close(listener);
 
-		if (connection.tag)
-			fprintf(stderr, "# Tag: %s\n", connection.tag);
+		/* Drop clients that stop sending requests. */
 
-		if (connection.have)
-			fprintf(stderr, "# Have: %s\n", connection.have);
+		setsockopt(descriptor, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
 
-		if (connection.want)
-			fprintf(stderr, "# Want: %s\n", connection.want);
+		memset(&client, 0, sizeof(client));
+		client.socket_descriptor = descriptor;
 
-		if (connection.low_memory)
-			fprintf(stderr, "# Low memory mode: Yes\n");
-	}
+		if ((client.ssl = SSL_new(server)) == NULL)
+			exit(EXIT_FAILURE);
 
-	/* Adjust the display depth to include path_target. */
+		SSL_set_fd(client.ssl, descriptor);
 
-	if (connection.display_depth > 0) {
-		temp = connection.path_target;
+		if (SSL_accept(client.ssl) != 1)
+			exit(EXIT_FAILURE);
 
-		while ((temp = strchr(temp + 1, '/')))
-			connection.display_depth++;
-	}
+		atexit(serve_failed);
+		serve_client(connection, &client);
 
-	/* Setup the connection to the server. */
+		SSL_shutdown(client.ssl);
+		SSL_free(client.ssl);
+		close(descriptor);
 
-	connect_server(&connection);
+		exit(EXIT_SUCCESS);
+	}
+}
 
-	if (connection.proxy_host)
-		create_tunnel(&connection);
 
-	setup_ssl(&connection);
+/*
+ * main
+ *
+ * A lightweight, dependency-free program to clone/pull Git repositories.
+ */
 
-	/* Execute the fetch, unpack, apply deltas and save. */
+int
+main(int argc, char **argv)
+{
+	const char  *configuration_file = CONFIG_FILE_PATH;
+	connector   *connection = NULL;
+	char       **section_name = NULL, **options = NULL;
+	bool        *section_argument = NULL;
+	FILE       **output = NULL;
+	bool         failed = false;
+	int         *group = NULL, *server = NULL;
+	int          x = 0, s = 0, t = 0, low = 0, high = 0, sections = 0, groups = 0;
+	int          jobs = 4, running = 0, option_count = 0;
+	bool         serve = false;
+	pid_t       *worker = NULL;
+
+	connector defaults = {
+		.ssl               = NULL,
+		.session           = NULL,
+		.session_file      = NULL,
+		.reconnect         = false,
+		.demux             = false,
+		.connect_timeout   = 30,
+		.mirror            = NULL,
+		.mirrors           = 0,
+		.mirror_next       = 0,
+		.refs              = NULL,
+		.refs_path         = NULL,
+		.refs_size         = 0,
+		.ctx               = NULL,
+		.socket_descriptor = 0,
+		.host              = NULL,
+		.host_bracketed    = NULL,
+		.port              = 0,
+		.proxy_host        = NULL,
+		.proxy_port        = 0,
+		.proxy_username    = NULL,
+		.proxy_password    = NULL,
+		.proxy_credentials = NULL,
+		.section           = NULL,
+		.repository_path   = NULL,
+		.branch            = NULL,
+		.tag               = NULL,
+		.have              = NULL,
+		.want              = NULL,
+		.response          = NULL,
+		.response_blocks   = 0,
+		.response_size     = 0,
+		.clone             = false,
+		.repair            = false,
+		.local_repairs     = 0,
+		.object            = NULL,
+		.objects           = 0,
+		.pack_data_file    = NULL,
+		.path_target       = NULL,
+		.path_work         = NULL,
+		.remote_data_file  = NULL,
+		.ignore            = NULL,
+		.ignores           = 0,
+		.exclude           = NULL,
+		.excludes          = 0,
+		.filter            = false,
+		.can_filter        = false,
+		.partial_clone     = false,
+		.resolved          = 0,
+		.keep_pack_file    = false,
+		.use_pack_file     = false,
+		.resumable         = true,
+		.retries           = 3,
+		.pack_cache_size   = 256,
+		.verbosity         = 1,
+		.display_depth     = 0,
+		.updating          = NULL,
+		.back_store        = -1,
+		.back_store_size   = 0,
+		.low_memory        = false,
+		.incremental_scan  = false,
+		.incremental       = false,
+		.scan_interval     = 0,
+		.write_threads     = 4,
+		.write_job         = NULL,
+		.write_jobs        = 0,
+		.link_job          = NULL,
+		.link_jobs         = 0,
+		.job               = NULL,
+		.jobs              = 0,
+		.job_next          = 0,
+		.write_lock        = PTHREAD_MUTEX_INITIALIZER,
+		.durability        = DURABILITY_NONE,
+		.resume            = false,
+		.deduplicate       = DEDUPLICATE_NONE,
+		.serve_certificate = NULL,
+		.serve_key         = NULL,
+		.serve_port        = 8443,
+		.serve_refs_ttl    = 60,
+		};
 
-	if ((connection.use_pack_file == true) && (pack_data_exists == true)) {
-		if (connection.verbosity)
-			fprintf(stderr,
-				"# Action: %s\n",
-				(connection.clone ? "clone" : "pull"));
 
-		load_pack(&connection);
-		apply_deltas(&connection);
-		save_objects(&connection);
-	} else {
-		if ((connection.use_pack_file == false) || ((connection.use_pack_file == true) && (pack_data_exists == false)))
-			get_commit_details(&connection);
+	if (argc < 2)
+		usage(configuration_file);
 
-		if ((connection.have != NULL) && (connection.want != NULL) && (strncmp(connection.have, connection.want, 40) == 0))
-			current_repository = true;
+	/*
+	 * Check for a version request, an overridden configuration file path and
+	 * a limit on the number of concurrent updates.
+	 */
 
-		/* When pulling, first ensure the local tree is pristine. */
+	for (x = 1; x < argc; x++) {
+		if ((strlen(argv[x]) > 1) && (strnstr(argv[x], "-j", 2) == argv[x])) {
+			if (strlen(argv[x]) > 2)
+				jobs = strtol(argv[x] + 2, (char **)NULL, 10);
+			else if (x + 1 < argc)
+				jobs = strtol(argv[x + 1], (char **)NULL, 10);
 
-		if ((connection.repair == true) || (connection.clone == false)) {
-			command = build_repair_command(&connection);
+			if (jobs < 1)
+				jobs = 1;
+		}
 
-			if (command != NULL) {
-				connection.repair = true;
+		if (strcmp(argv[x], "-V") == 0) {
+			fprintf(stdout,
+				"gitup version %s\n",
+				GITUP_VERSION);
 
-				if (connection.verbosity)
-					fprintf(stderr, "# Action: repair\n");
+			exit(EXIT_SUCCESS);
+		}
 
-				fetch_pack(&connection, command);
-				apply_deltas(&connection);
-				save_repairs(&connection);
-			}
+		if ((strlen(argv[x]) > 1) && (strnstr(argv[x], "-C", 2) == argv[x])) {
+			if (strlen(argv[x]) > 2)
+				configuration_file = strdup(argv[x] + 2);
+			else if ((x + 1 < argc) && (argv[x + 1][0] != '-'))
+				configuration_file = strdup(argv[x + 1]);
 		}
+	}
 
-		/* Process the clone or pull. */
+	/* Run as a caching server for other clients with "gitup serve <section>". */
 
-		if ((current_repository == false) && (connection.repair == false)) {
-			if (connection.verbosity)
-				fprintf(stderr,
-					"# Action: %s\n",
-					(connection.clone ? "clone" : "pull"));
+	serve = ((argc > 2) && (strcmp(argv[1], "serve") == 0));
 
-			if (connection.clone == false)
-				command = build_pull_command(&connection);
-			else
-				command = build_clone_command(&connection);
+	/* Find the requested sections and strip them from the options. */
 
-			fetch_pack(&connection, command);
-			apply_deltas(&connection);
-			save_objects(&connection);
-		}
+	if ((section_argument = (bool *)calloc(argc, sizeof(bool))) == NULL)
+		err(EXIT_FAILURE, "main: calloc");
+
+	section_name = list_sections(configuration_file, argv, argc, section_argument, &sections);
+
+	if (serve) {
+		if (sections > 1)
+			errc(EXIT_FAILURE, EINVAL, "gitup serve requires a single section");
+
+		section_argument[1] = true;
 	}
 
-	/* Save .gituprevision. */
+	if ((options = (char **)calloc(argc + 1, sizeof(char *))) == NULL)
+		err(EXIT_FAILURE, "main: calloc");
 
-	if ((connection.want) || (connection.tag)) {
-		snprintf(gitup_revision_path, BUFFER_UNIT_SMALL,
-			"%s/.gituprevision",
-			connection.path_target);
+	for (x = 0; x < argc; x++)
+		if ((section_argument[x] == false) && (strcmp(argv[x], "--all") != 0))
+			options[option_count++] = argv[x];
 
-		snprintf(gitup_revision, BUFFER_UNIT_SMALL,
-			"%s:%.9s\n",
-			(connection.tag ? connection.tag : connection.branch),
-			connection.want);
+	/* Load each section's configuration, followed by the command line options. */
 
-		save_file(gitup_revision_path,
-			0644,
-			gitup_revision,
-			strlen(gitup_revision),
-			0,
-			0);
+	if ((connection = (connector *)calloc(sections, sizeof(connector))) == NULL)
+		err(EXIT_FAILURE, "main: calloc");
+
+	for (s = 0; s < sections; s++) {
+		connection[s] = defaults;
+		load_configuration(&connection[s], configuration_file, section_name[s]);
+		apply_options(&connection[s], option_count, options);
+
+		if ((sections > 1) && ((connection[s].have) || (connection[s].want) || (connection[s].tag) || (connection[s].use_pack_file)))
+			errc(EXIT_FAILURE, EINVAL,
+				"The -h, -t, -u and -w options require a single section");
+
+		free(section_name[s]);
 	}
 
-	/* Wrap it all up. */
+	if (serve)
+		serve_section(&connection[0]);
 
-	RB_FOREACH_SAFE(file, Tree_Local_Hash, &Local_Hash, next_file)
-		RB_REMOVE(Tree_Local_Hash, &Local_Hash, file);
+	/*
+	 * Group the sections that share a server, so they are updated over one
+	 * connection, and the sections whose target directories overlap, since
+	 * those have to be updated in order.
+	 */
 
-	RB_FOREACH_SAFE(file, Tree_Local_Path, &Local_Path, next_file) {
-		if ((file->keep == false) && ((current_repository == false) || (connection.repair == true))) {
-			if (ignore_file(&connection, file->path))
-				continue;
+	if ((group = (int *)malloc(sections * sizeof(int))) == NULL)
+		err(EXIT_FAILURE, "main: malloc");
 
-			if ((connection.verbosity) && (connection.display_depth == 0))
-				printf(" - %s\n", file->path);
+	if ((server = (int *)malloc(sections * sizeof(int))) == NULL)
+		err(EXIT_FAILURE, "main: malloc");
 
-			if (S_ISDIR(file->mode)) {
-				display_path = trim_path(file->path,
-					connection.display_depth,
-					&just_added);
+	for (s = 0; s < sections; s++) {
+		for (t = 0; (t < s) && (!same_server(&connection[t], &connection[s])); t++);
 
-				if ((connection.verbosity) && (connection.display_depth > 0) && (just_added) && (strlen(display_path) == strlen(file->path)))
-					printf(" - %s\n", display_path);
+		server[s] = t;
+		group[s]  = (jobs > 1 ? s : 0);
 
-				prune_tree(&connection, file->path);
-				free(display_path);
-			} else if ((remove(file->path)) && (errno != ENOENT)) {
-				fprintf(stderr,
-					" ! cannot remove %s\n",
-					file->path);
-			}
-		}
+		for (t = 0; (jobs > 1) && (t < s); t++) {
+			if ((server[t] != server[s]) && (!overlapping_targets(connection[t].path_target, connection[s].path_target)))
+				continue;
 
-		RB_REMOVE(Tree_Local_Path, &Local_Path, file);
-		file_node_free(file);
-	}
+			low  = (group[t] < group[s] ? group[t] : group[s]);
+			high = (group[t] < group[s] ? group[s] : group[t]);
 
-	RB_FOREACH_SAFE(file, Tree_Remote_Path, &Remote_Path, next_file) {
-		RB_REMOVE(Tree_Remote_Path, &Remote_Path, file);
-		file_node_free(file);
+			for (x = 0; x <= s; x++)
+				if (group[x] == high)
+					group[x] = low;
+		}
 	}
 
-	RB_FOREACH_SAFE(file, Tree_Trim_Path, &Trim_Path, next_file) {
-		RB_REMOVE(Tree_Trim_Path, &Trim_Path, file);
-		file_node_free(file);
-	}
+	for (s = 0; s < sections; s++)
+		if (group[s] == s)
+			groups++;
 
-	RB_FOREACH_SAFE(object, Tree_Objects, &Objects, next_object)
-		RB_REMOVE(Tree_Objects, &Objects, object);
+	/*
+	 * Update independent groups, which use different servers, concurrently in
+	 * up to jobs worker processes, each section within a group one after
+	 * another.
+	 */
 
-	for (o = 0; o < connection.objects; o++) {
-		if (connection.verbosity > 1)
-			fprintf(stdout,
-				"###### %05d-%d\t%d\t%u\t%s\t%d\t%s\n",
-				connection.object[o]->index,
-				connection.object[o]->type,
-				connection.object[o]->pack_offset,
-				connection.object[o]->buffer_size,
-				connection.object[o]->hash,
-				connection.object[o]->index_delta,
-				connection.object[o]->ref_delta_hash);
+	if (groups == 1) {
+		update_group(connection, sections, group, server, 0);
+	} else {
+		if ((worker = (pid_t *)calloc(sections, sizeof(pid_t))) == NULL)
+			err(EXIT_FAILURE, "main: calloc");
 
-		object_node_free(connection.object[o]);
-	}
+		if ((output = (FILE **)calloc(sections, sizeof(FILE *))) == NULL)
+			err(EXIT_FAILURE, "main: calloc");
 
-	if ((connection.verbosity) && (connection.updating))
-		fprintf(stderr,
-			"#\n# Please review the following file(s) for "
-			"important changes.\n%s#\n",
-			connection.updating);
-
-	for (x = 0; x < connection.ignores; x++)
-		free(connection.ignore[x]);
-
-	free(connection.ignore);
-	free(connection.response);
-	free(connection.object);
-	free(connection.host);
-	free(connection.host_bracketed);
-	free(connection.proxy_host);
-	free(connection.proxy_username);
-	free(connection.proxy_password);
-	free(connection.proxy_credentials);
-	free(connection.section);
-	free(connection.repository_path);
-	free(connection.branch);
-	free(connection.tag);
-	free(connection.have);
-	free(connection.want);
-	free(connection.pack_data_file);
-	free(connection.path_target);
-	free(connection.path_work);
-	free(connection.remote_data_file);
-	free(connection.updating);
-
-	if (connection.ssl) {
-		SSL_shutdown(connection.ssl);
-		SSL_CTX_free(connection.ctx);
-		close(connection.socket_descriptor);
-		SSL_free(connection.ssl);
-	}
-
-	if (connection.repair == true)
-		fprintf(stderr,
-			"# The local repository has been repaired.  "
-			"Please rerun gitup to pull the latest commit.\n");
+		for (s = 0; s < sections; s++) {
+			if (group[s] != s)
+				continue;
 
-	if (connection.verbosity)
-		fprintf(stderr, "# Done.\n");
+			while (running >= jobs) {
+				if (!finish_worker(connection, sections, worker, output))
+					failed = true;
+
+				running--;
+			}
+
+			worker[s] = start_worker(connection, sections, group, server, s, &output[s]);
+			running++;
+		}
+
+		while (running-- > 0)
+			if (!finish_worker(connection, sections, worker, output))
+				failed = true;
+
+		free(worker);
+		free(output);
+
+		if (failed)
+			return (EXIT_FAILURE);
+	}
 
-	sync();
+	free(section_name);
+	free(section_argument);
+	free(options);
+	free(connection);
+	free(group);
+	free(server);
 
 	return (0);
 }